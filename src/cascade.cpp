@@ -0,0 +1,98 @@
+//**********************************************************************************************************************
+// FILE: cascade.cpp
+//
+// DESCRIPTION
+// Contains implementation for re-ranking the shortlists of the cascade
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstdio>
+#include "cascade.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+void default_cascade_params(cascade_params &params)
+{
+    params.coarse_func = rg_func;
+    params.shortlist = 100;
+    params.recall = false;
+}
+
+static vector<vector<fi_match> > rerank(const fi_rows &m, feature_function func, const vector<vector<float> > &fts,
+                                        const vector<vector<fi_match> > &shortlists, int k)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (shortlists.size() != fts.size())
+    {
+        printf("%lu shortlists for %lu targets\n", shortlists.size(), fts.size());
+        return result;
+    }
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(func, m.dim, segments);
+
+    // one target per task, its shortlist is scored like the full scan
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        abandon_plan plan;
+        create_abandon_plan(plan, target, m.type, m.scale, segments, count);
+        abandon_stats stats;
+        clear_abandon_stats(stats);
+        topk top_n;
+        create_topk(top_n, k);
+        for (size_t j = 0; j < shortlists[q].size(); j++)
+        {
+            uint32_t id = shortlists[q][j].id;
+            if (id < m.rows)
+            {
+                topk_push(top_n, id, compute_bounded_distance(plan, target, fr_row(m, id), topk_threshold(top_n), stats));
+            }
+        }
+        result[q] = topk_sorted(top_n);
+    });
+    return result;
+}
+
+vector<vector<fi_match> > rerank_shortlists(const feature_matrix &fis, feature_function func, const vector<vector<float> > &fts,
+                                            const vector<vector<fi_match> > &shortlists, int k)
+{
+    return rerank(view_rows(fis), func, fts, shortlists, k);
+}
+
+vector<vector<fi_match> > rerank_shortlists(const quant_matrix &fis, feature_function func, const vector<vector<float> > &fts,
+                                            const vector<vector<fi_match> > &shortlists, int k)
+{
+    return rerank(view_rows(fis), func, fts, shortlists, k);
+}
+
+float cascade_recall(const vector<vector<fi_match> > &found, const vector<vector<fi_match> > &exact)
+{
+    double total = 0;
+    size_t targets = 0;
+    for (size_t q = 0; q < exact.size() && q < found.size(); q++)
+    {
+        if (exact[q].empty())
+        {
+            continue;
+        }
+        size_t hits = 0;
+        for (size_t i = 0; i < exact[q].size(); i++)
+        {
+            for (size_t j = 0; j < found[q].size(); j++)
+            {
+                hits += found[q][j].id == exact[q][i].id;
+            }
+        }
+        total += (double)hits / exact[q].size();
+        targets += 1;
+    }
+    return targets ? total / targets : 0;
+}
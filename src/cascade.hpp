@@ -0,0 +1,64 @@
+//**********************************************************************************************************************
+// FILE: cascade.hpp
+//
+// DESCRIPTION
+// Two stage retrieval. A compact feature, the 64 bin rg histogram or the 64 bin level of the
+// histogram pyramid, is scanned over the whole collection and keeps a shortlist of every target.
+// Only the shortlist is scored with the expensive feature, like the 1024 bins of rgb_mag. The
+// result is approximate, an image the compact feature ranks below the shortlist is never seen,
+// so the recall against the full scan can be measured along with the time of every stage.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include <vector>
+#include <chrono>
+#include "compute.hpp"
+using namespace std;
+
+struct cascade_params
+{
+  feature_function coarse_func; // compact feature of the first stage, the target feature itself for its pyramid
+  int shortlist;                // images of every target scored with the full feature, at least k
+  bool recall;                  // also run the full scan and report the recall of the cascade
+};
+
+/*
+  Sets rg_func, a shortlist of 100 and no recall. rg_func is read from its section of a container,
+  other feature files fall back to the pyramid of the target feature.
+ */
+void default_cascade_params(cascade_params &params);
+
+/*
+  Top k of every target among its shortlist, scored on the full rows like the scan so the
+  errors are the same, the targets are spread over the shared thread pool
+  @params func the function that created fis
+  @params shortlists the candidate ids of every target, rows of fis
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > rerank_shortlists(const feature_matrix &fis, feature_function func, const vector<vector<float> > &fts,
+                                            const vector<vector<fi_match> > &shortlists, int k);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis
+ */
+vector<vector<fi_match> > rerank_shortlists(const quant_matrix &fis, feature_function func, const vector<vector<float> > &fts,
+                                            const vector<vector<fi_match> > &shortlists, int k);
+
+/*
+  Share of the exact matches that were found, averaged over the targets
+ */
+float cascade_recall(const vector<vector<fi_match> > &found, const vector<vector<fi_match> > &exact);
+
+/*
+  Milliseconds since start
+ */
+inline double elapsed_ms(const chrono::steady_clock::time_point &start)
+{
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+#endif
@@ -9,69 +9,195 @@
 
 #include "compute.hpp"
 #include "csv_util.h"
+#include "feature_container.hpp"
+#include "parallel_scan.hpp"
+#include "distance_kernels.hpp"
+#include "early_abandon.hpp"
+#include "inverted_index.hpp"
+#include "ivf_index.hpp"
+#include "hnsw_index.hpp"
+#include "pq_index.hpp"
+#include "vp_tree.hpp"
+#include "lsh_index.hpp"
+#include "histogram_pyramid.hpp"
+#include "cascade.hpp"
+#include "fusion.hpp"
 
 float compute_ssd(vector<float> &ft, vector<float> &fi)
 {
+    return compute_ssd(ft.data(), fi.data(), ft.size());
+}
 
-    // [ (x_1 - x_2) / stdev_x ] ^2
-    float error = 0;
-    for (int i = 0; i < ft.size(); i++)
-    {
-        error += (ft[i] - fi[i]) * (ft[i] - fi[i]);
-    }
-    return error;
+float compute_ssd(const float *ft, const float *fi, int n)
+{
+
+    // [ (x_1 - x_2) / stdev_x ] ^2, on the widest vectors the host has
+    return ssd_f32(ft, fi, n);
 }
 
 float compute_hist_intersect_error(vector<float> &ft, vector<float> &fi)
 {
-    int i = 0;
-    float similarity = 0;
-    for (float count_per_bin_t : ft)
-    {
-        float count_per_bin_i = fi[i];
-        similarity += min(count_per_bin_t, count_per_bin_i);
-        i++;
-        // cout << "similarity: " << similarity << endl;
-    }
+    return compute_hist_intersect_error(ft.data(), fi.data(), ft.size());
+}
+
+float compute_hist_intersect_error(const float *ft, const float *fi, int n)
+{
+    float similarity = intersect_f32(ft, fi, n);
     return (1 - similarity);
 }
 
 float compute_mult_hist_intersect_error(vector<float> &ft, vector<float> &fi, int size_a, const float weight_a, const float weight_b)
 {
-    // split the ft and fi to a and b
+    return compute_mult_hist_intersect_error(ft.data(), fi.data(), ft.size(), size_a, weight_a, weight_b);
+}
+
+float compute_mult_hist_intersect_error(const float *ft, const float *fi, int n, int size_a, const float weight_a, const float weight_b)
+{
+    // split the ft and fi to a and b in place
     // a & b can be "top & bottom" or "rgb & magnitude" or "rgb & magnitudeorientation"
-    // ft_a & ft_b
-    vector<float> ft_a;
-    // cout << "i: " << ft.size()<< endl;
-    
-    for (int i = 0; i < size_a; i++) // from 0 to end of ft_a
+    float dist_a = compute_hist_intersect_error(ft, fi, size_a);
+    float dist_b = compute_hist_intersect_error(ft + size_a, fi + size_a, n - size_a);
+    float dist_ave = (weight_a * dist_a) + (weight_b * dist_b);
+    return dist_ave;
+}
+
+float compute_ssd(const uint8_t *ft, const uint8_t *fi, int n, float scale)
+{
+    return ssd_u8(ft, fi, n) * scale * scale;
+}
+
+float compute_ssd(const uint16_t *ft, const uint16_t *fi, int n, float scale)
+{
+    return ssd_u16(ft, fi, n) * scale * scale;
+}
+
+float compute_hist_intersect_error(const uint8_t *ft, const uint8_t *fi, int n, float scale)
+{
+    return (1 - intersect_u8(ft, fi, n) * scale);
+}
+
+float compute_hist_intersect_error(const uint16_t *ft, const uint16_t *fi, int n, float scale)
+{
+    return (1 - intersect_u16(ft, fi, n) * scale);
+}
+
+int get_feature_segments(feature_function func, int n, fi_segment *segments)
+{
+    int rgb_histo_size = 512; // 8 bins^3 channel
+    int rg_histo_size = 64;   // 8 bins^2 channel
+    int size_a;
+    float weight_a, weight_b;
+
+    // single vector features are one segment
+    if (func == pixel_func || func == rgb_func || func == rg_func)
     {
-        ft_a.push_back(ft[i]);
+        segments[0].offset = 0;
+        segments[0].length = n;
+        segments[0].weight = 1;
+        segments[0].metric = func == pixel_func ? ssd_metric : intersect_metric;
+        return 1;
     }
 
-    vector<float> ft_b;
-    for (int i = size_a; i < ft.size(); i++) // from ft_a to the end
+    // multi histogram features are two histograms side by side, a is the first size_a bins
+    if (func == top_bom_func)
+    {
+        size_a = rgb_histo_size;
+        weight_a = 0.2; // top
+        weight_b = 0.8; // bottom
+    }
+    else if (func == rgb_mag_func)
     {
-        ft_b.push_back(ft[i]);
+        size_a = rgb_histo_size;
+        weight_a = 0.7; // rgb
+        weight_b = 0.3; // texture
     }
+    else if (func == rgb_magori_func)
+    {
+        size_a = rgb_histo_size;
+        weight_a = 0.8; // rgb
+        weight_b = 0.2; // texture
+    }
+    else
+    {
+        size_a = rg_histo_size;
+        weight_a = 0.8; // rg
+        weight_b = 0.2; // texture
+    }
+    size_a = size_a < n ? size_a : n;
+    segments[0].offset = 0;
+    segments[0].length = size_a;
+    segments[0].weight = weight_a;
+    segments[0].metric = intersect_metric;
+    segments[1].offset = size_a;
+    segments[1].length = n - size_a;
+    segments[1].weight = weight_b;
+    segments[1].metric = intersect_metric;
+    return 2;
+}
 
-    // fi a & b
-    vector<float> fi_a;
-    for (int i = 0; i < size_a; i++)
+float compute_segment_distance(const float *ft, const float *fi, const fi_segment *segments, int count)
+{
+    float dist = 0;
+    for (int s = 0; s < count; s++)
     {
-        fi_a.push_back(fi[i]);
+        const fi_segment &seg = segments[s];
+        float error = seg.metric == ssd_metric ? compute_ssd(ft + seg.offset, fi + seg.offset, seg.length)
+                                               : compute_hist_intersect_error(ft + seg.offset, fi + seg.offset, seg.length);
+        dist += seg.weight * error;
     }
+    return dist;
+}
 
-    vector<float> fi_b;
-    for (int i = size_a; i < fi.size(); i++)
+// weighted segment errors between two rows of codes of type T
+template <typename T>
+static float compute_segment_distance_codes(const T *ft, const T *fi, float scale, const fi_segment *segments, int count)
+{
+    float dist = 0;
+    for (int s = 0; s < count; s++)
     {
-        fi_b.push_back(fi[i]);
+        const fi_segment &seg = segments[s];
+        float error = seg.metric == ssd_metric ? compute_ssd(ft + seg.offset, fi + seg.offset, seg.length, scale)
+                                               : compute_hist_intersect_error(ft + seg.offset, fi + seg.offset, seg.length, scale);
+        dist += seg.weight * error;
     }
+    return dist;
+}
 
-    float dist_a = compute_hist_intersect_error(ft_a, fi_a);
-    float dist_b = compute_hist_intersect_error(ft_b, fi_b);
-    float dist_ave = (weight_a * dist_a) + (weight_b * dist_b);
-    return dist_ave;
+float compute_segment_distance(const void *ft, const void *fi, fi_elem_type type, float scale, const fi_segment *segments, int count)
+{
+    if (type == fi_u8)
+    {
+        return compute_segment_distance_codes((const uint8_t *)ft, (const uint8_t *)fi, scale, segments, count);
+    }
+    else if (type == fi_u16)
+    {
+        return compute_segment_distance_codes((const uint16_t *)ft, (const uint16_t *)fi, scale, segments, count);
+    }
+    return compute_segment_distance((const float *)ft, (const float *)fi, segments, count);
+}
+
+float compute_distance(const float *ft, const float *fi, int n, feature_function func)
+{
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(func, n, segments);
+    return compute_segment_distance(ft, fi, segments, count);
+}
+
+float compute_distance(const void *ft, const void *fi, int n, fi_elem_type type, float scale, feature_function func)
+{
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(func, n, segments);
+    return compute_segment_distance(ft, fi, type, scale, segments, count);
+}
+
+float quant_scale(feature_function func, fi_elem_type type)
+{
+    // pixels are already integer channel values, histogram bins are fractions of the image
+    if (func == pixel_func || type == fi_f32)
+    {
+        return 1;
+    }
+    return 1.0f / fi_code_max(type);
 }
 
 void compute_1_pixel(cv::Mat img, vector<float> &fx, int row_start, int col_start, int row_size, int col_size)
@@ -366,7 +492,45 @@ void compute_5_rg_magori(cv::Mat img_uncropped, vector<float> &fx_rg_magori)
     }
 }
 
-void compute_fis(int numOfArgs, char const *dir_path_args[], char *save_to_filepath, feature_function func)
+void compute_feature(cv::Mat img, vector<float> &fx, feature_function func)
+{
+    if (func == pixel_func)
+    {
+        // 1. get the index of center row's top left corner
+        int row_start = (img.rows / 2) - 4;
+        int col_start = (img.cols / 2) - 4;
+
+        // 2. 9X9 pixel
+        int pixel_size = 9;
+        compute_1_pixel(img, fx, row_start, col_start, pixel_size, pixel_size);
+    }
+    else if (func == rgb_func)
+    {
+        compute_2_rgb(img, fx);
+    }
+    else if (func == top_bom_func)
+    {
+        compute_3_top_bom(img, fx); // top and bottom
+    }
+    else if (func == rgb_mag_func)
+    {
+        compute_4_rgb_mag(img, fx);
+    }
+    else if (func == rgb_magori_func)
+    {
+        compute_5_rgb_magori(img, fx);
+    }
+    else if (func == rg_magori_func)
+    {
+        compute_5_rg_magori(img, fx);
+    }
+    else if (func == rg_func)
+    {
+        compute_rg(img, fx);
+    }
+}
+
+void compute_fis(int numOfArgs, char const *dir_path_args[], char *save_to_filepath, feature_function func, fi_elem_type elem_type)
 {
     char dirpath[256];
     char fullPath[256];
@@ -392,7 +556,28 @@ void compute_fis(int numOfArgs, char const *dir_path_args[], char *save_to_filep
         exit(-1);
     }
 
-    int idx = 0;
+    // pixel channel values are exact in uint8, a quarter of the float size
+    if (func == pixel_func)
+    {
+        elem_type = fi_u8;
+    }
+
+    // the output file stays open for the whole directory
+    bool to_bin = is_image_data_bin(save_to_filepath);
+    fi_bin_writer bin_writer;
+    csv_writer csv;
+    if (to_bin ? open_image_data_bin_writer(bin_writer, save_to_filepath, func, elem_type, quant_scale(func, elem_type))
+               : open_image_data_csv_writer(csv, save_to_filepath))
+    {
+        exit(-1);
+    }
+
+    // the coarse levels of the histograms are stored next to a binary store,
+    // csv rows are rounded when written so their levels are summed when they are read
+    bool with_pyramid = to_bin && func != pixel_func;
+    histogram_pyramid pyramid;
+    bool pyramid_created = false; // on the first image, once its feature size is known
+
     // 4. loop over all the files in the image file listing
     while ((dp = readdir(dirp)) != NULL)
     {
@@ -416,184 +601,930 @@ void compute_fis(int numOfArgs, char const *dir_path_args[], char *save_to_filep
             cv::Mat i = cv::imread(fullPath, 1);
             // 8. compute the feature 1 for this image
             vector<float> fi;
-            if (func == pixel_func)
-            {
-                // 1. get the index of center row's top left corner
-                int row_start = (i.rows / 2) - 4;
-                int col_start = (i.cols / 2) - 4;
+            compute_feature(i, fi, func);
 
-                // 2. 9X9 pixel
-                int pixel_size = 9;
-                compute_1_pixel(i, fi, row_start, col_start, pixel_size, pixel_size);
-            }
-            else if (func == rgb_func)
+            // 9. save the feature to a new csv or bin path
+            int err = to_bin ? append_image_data_bin(bin_writer, image_name, fi.data(), fi.size())
+                             : append_image_data_csv(csv, image_name, fi.data(), fi.size());
+            if (err)
             {
-                compute_2_rgb(i, fi);
+                exit(-1);
             }
-            else if (func == top_bom_func)
+            if (with_pyramid)
             {
-                compute_3_top_bom(i, fi);
+                if (!pyramid_created && create_histogram_pyramid(pyramid, func, fi.size()))
+                {
+                    exit(-1);
+                }
+                pyramid_created = true;
+                add_pyramid_row(pyramid, fi.data(), elem_type, quant_scale(func, elem_type));
             }
-            else if (func == rgb_mag_func)
+        }
+    }
+    closedir(dirp);
+    if (to_bin ? close_image_data_bin_writer(bin_writer) : close_image_data_csv_writer(csv))
+    {
+        exit(-1);
+    }
+    // the levels are tied to the file as it was closed
+    if (pyramid_created &&
+        (read_fi_source(save_to_filepath, elem_type, elem_type == fi_f32 ? 1 : quant_scale(func, elem_type), pyramid.source) ||
+         save_histogram_pyramid(pyramid, pyramid_filepath(save_to_filepath, func).c_str())))
+    {
+        exit(-1);
+    }
+    cout << "finish compute fis" << endl;
+}
+
+void compute_fis(int numOfArgs, char const *dir_path_args[], char *save_to_filepath, const vector<feature_function> &funcs, fi_elem_type elem_type,
+                 bool interleave)
+{
+    char fullPath[256];
+    DIR *dirp;
+    struct dirent *dp;
+
+    // 1. if args is not sufficient exit
+    if (numOfArgs < 2)
+    {
+        printf("usage: %s <directory path>\n", dir_path_args[0]);
+        exit(-1);
+    }
+
+    // 2. list the images first, the container needs all the names up front
+    const char *dirpath = dir_path_args[1];
+    printf("Processing directory %s\n", dirpath);
+    dirp = opendir(dirpath);
+    if (dirp == NULL)
+    {
+        printf("Cannot open directory %s\n", dirpath);
+        exit(-1);
+    }
+    name_table image_names;
+    create_name_table(image_names);
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        char *image_name = dp->d_name;
+        if (strstr(image_name, ".jpg") ||
+            strstr(image_name, ".png") ||
+            strstr(image_name, ".ppm") ||
+            strstr(image_name, ".tif"))
+        {
+            add_name(image_names, image_name);
+        }
+    }
+    closedir(dirp);
+
+    // 3. every image is read once and all its features are computed,
+    // the histograms also get their coarse levels
+    fi_container_writer writer;
+    vector<histogram_pyramid> pyramids(funcs.size());
+    for (uint32_t idx = 0; idx < image_names.count; idx++)
+    {
+        strcpy(fullPath, dirpath);
+        strcat(fullPath, "/");
+        strcat(fullPath, nt_name(image_names, idx));
+        cv::Mat i = cv::imread(fullPath, 1);
+
+        vector<vector<float>> fis(funcs.size());
+        for (size_t f = 0; f < funcs.size(); f++)
+        {
+            compute_feature(i, fis[f], funcs[f]);
+        }
+
+        // 4. the features of the first image decide the section sizes
+        if (idx == 0)
+        {
+            vector<int> feature_types, dims;
+            vector<fi_elem_type> elem_types;
+            vector<float> scales;
+            for (size_t f = 0; f < funcs.size(); f++)
             {
-                compute_4_rgb_mag(i, fi);
+                fi_elem_type type = funcs[f] == pixel_func ? fi_u8 : elem_type;
+                feature_types.push_back(funcs[f]);
+                dims.push_back(fis[f].size());
+                elem_types.push_back(type);
+                scales.push_back(quant_scale(funcs[f], type));
             }
-            else if (func == rgb_magori_func)
+            if (open_image_data_container_writer(writer, save_to_filepath, image_names, feature_types, dims, elem_types, scales,
+                                                 interleave ? fi_layout_records : fi_layout_sections))
             {
-                compute_5_rgb_magori(i, fi);
+                exit(-1);
             }
-            else if (func == rg_magori_func)
+            for (size_t f = 0; f < funcs.size(); f++)
             {
-                compute_5_rg_magori(i, fi);
+                if (funcs[f] != pixel_func && create_histogram_pyramid(pyramids[f], funcs[f], dims[f]))
+                {
+                    exit(-1);
+                }
             }
-            else if (func == rg_func)
+        }
+
+        for (size_t f = 0; f < funcs.size(); f++)
+        {
+            if (write_image_data_container_row(writer, f, idx, fis[f].data(), fis[f].size()))
             {
-                compute_rg(i, fi);
+                exit(-1);
             }
-
-            int overwrite = 0;
-            if (idx == 0)
+            if (funcs[f] != pixel_func)
             {
-                overwrite = 1;
+                add_pyramid_row(pyramids[f], fis[f].data(), elem_type, quant_scale(funcs[f], elem_type));
             }
-            // 9. save the feature to a new csv path
-            append_image_data_csv(save_to_filepath, image_name, fi, overwrite);
-            idx += 1;
+        }
+    }
+    if (image_names.count == 0 || close_image_data_container_writer(writer))
+    {
+        printf("No features written to %s\n", save_to_filepath);
+        exit(-1);
+    }
+    for (size_t f = 0; f < funcs.size(); f++)
+    {
+        if (funcs[f] != pixel_func &&
+            (read_fi_source(save_to_filepath, elem_type, elem_type == fi_f32 ? 1 : quant_scale(funcs[f], elem_type), pyramids[f].source) ||
+             save_histogram_pyramid(pyramids[f], pyramid_filepath(save_to_filepath, funcs[f]).c_str())))
+        {
+            exit(-1);
         }
     }
     cout << "finish compute fis" << endl;
 }
 
-void compute_minimum_errors(vector<float> &ft, vector<vector<float>> &fis, vector<char *> &names, feature_function func)
+void print_top_n(const vector<fi_match> &top_n, const name_table &names)
 {
-    // 1. Get list of errors for each feature
-    vector<float> error_list;
+    for (size_t i = 0; i < top_n.size(); i++)
+    {
+        cout << "\n"<< i + 1 << ": ";
+        cout << nt_name(names, top_n[i].id) << endl;
+        cout << "error: " << top_n[i].error << endl;
+    }
+}
 
-    int rgb_histo_size = 512; // 8 bins^3 channel
-    // 2. for each fis compute distance from ft
-    for (int i = 0; i < fis.size(); i++)
+// score the rows of a matrix against the plans of all the targets, row(i) is the start of row i
+template <typename Row>
+static vector<vector<fi_match> > scan_targets(const vector<abandon_plan> &plans, const vector<const void *> &targets,
+                                              size_t rows, size_t row_bytes, int k, Row row)
+{
+    vector<abandon_stats> stats(shared_thread_pool().size());
+    for (size_t w = 0; w < stats.size(); w++)
+    {
+        clear_abandon_stats(stats[w]);
+    }
+    vector<vector<fi_match> > result = parallel_top_k_batch(rows, row_bytes, plans.size(), k, [&](size_t q, size_t i, float threshold, int worker) {
+        return compute_bounded_distance(plans[q], targets[q], row(i), threshold, stats[worker]);
+    });
+    for (size_t w = 1; w < stats.size(); w++)
     {
-        vector<float> fi;
-        // grab a single fi vector
+        add_abandon_stats(stats[0], stats[w]);
+    }
+    print_abandon_stats(stats[0]);
+    return result;
+}
 
-        for (int j = 0; j < fis[i].size(); j++)
+// print the matches of every target, numbered if there is more than one
+static void print_top_n_batch(const vector<vector<fi_match> > &top_n, const name_table &names)
+{
+    for (size_t q = 0; q < top_n.size(); q++)
+    {
+        if (top_n.size() > 1)
         {
-            fi.push_back(fis[i][j]);
-            // printf("%.4f  ", result_fis[i][j]);
+            cout << "\ntarget " << q + 1 << ":" << endl;
         }
-        float error;
+        print_top_n(top_n[q], names);
+    }
+}
 
-        if (func == pixel_func)
+// true if every target has dim features
+static bool check_target_sizes(const vector<vector<float> > &fts, int dim)
+{
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        if (dim != (int)fts[q].size())
         {
-            error = compute_ssd(ft, fi);
+            printf("Feature size %d does not match target size %lu\n", dim, fts[q].size());
+            return false;
         }
-        else if (func == rgb_func)
+    }
+    return true;
+}
+
+// the k best rows of fis for every target, without printing them
+static vector<vector<fi_match> > scan_matrix(const vector<vector<float> > &fts, const feature_matrix &fis, feature_function func, int k)
+{
+    if (!check_target_sizes(fts, fis.dim))
+    {
+        return vector<vector<fi_match> >();
+    }
+
+    // 1. the blocks of every ft are worked out once for the whole scan, a row stops
+    // being scored once it cannot beat the k-th best error of its worker
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(func, fis.dim, segments);
+    vector<abandon_plan> plans(fts.size());
+    vector<const void *> targets(fts.size());
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        targets[q] = fts[q].data();
+        create_abandon_plan(plans[q], targets[q], fi_f32, 1, segments, count);
+    }
+
+    // 2. for each partition of rows of fis compute distance from every ft,
+    // the k minimum distances of every ft come back best first
+    vector<vector<fi_match> > result = scan_targets(plans, targets, fis.rows, fis.stride * sizeof(float), k, [&](size_t i) {
+        return (const void *)fm_row(fis, i);
+    });
+    return result;
+}
+
+static vector<vector<fi_match> > scan_matrix(const vector<vector<float> > &fts, const quant_matrix &fis, feature_function func, int k)
+{
+    if (!check_target_sizes(fts, fis.dim))
+    {
+        return vector<vector<fi_match> >();
+    }
+
+    // 1. quantize the targets with the scale of the database
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(func, fis.dim, segments);
+    vector<vector<uint16_t> > ft_codes(fts.size()); // room for u8 or u16 codes
+    vector<abandon_plan> plans(fts.size());
+    vector<const void *> targets(fts.size());
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        ft_codes[q].resize(fis.dim);
+        quantize_fi(fts[q].data(), fis.dim, fis.type, fis.scale, ft_codes[q].data());
+        targets[q] = ft_codes[q].data();
+        create_abandon_plan(plans[q], targets[q], fis.type, fis.scale, segments, count);
+    }
+
+    // 2. for each partition of rows of fis compute distance from every ft on the codes
+    vector<vector<fi_match> > result = scan_targets(plans, targets, fis.rows, fis.stride * fi_elem_size(fis.type), k, [&](size_t i) {
+        return qm_row(fis, i);
+    });
+    return result;
+}
+
+vector<vector<fi_match> > compute_minimum_errors_batch(const vector<vector<float> > &fts, const feature_matrix &fis, const name_table &names, feature_function func, int k)
+{
+    vector<vector<fi_match> > result = scan_matrix(fts, fis, func, k);
+    print_top_n_batch(result, names);
+    return result;
+}
+
+vector<vector<fi_match> > compute_minimum_errors_batch(const vector<vector<float> > &fts, const quant_matrix &fis, const name_table &names, feature_function func, int k)
+{
+    vector<vector<fi_match> > result = scan_matrix(fts, fis, func, k);
+    print_top_n_batch(result, names);
+    return result;
+}
+
+vector<fi_match> compute_minimum_errors(vector<float> &ft, const feature_matrix &fis, const name_table &names, feature_function func, int k)
+{
+    vector<vector<fi_match> > result = compute_minimum_errors_batch(vector<vector<float> >(1, ft), fis, names, func, k);
+    return result.empty() ? vector<fi_match>() : result[0];
+}
+
+vector<fi_match> compute_minimum_errors(vector<float> &ft, const quant_matrix &fis, const name_table &names, feature_function func, int k)
+{
+    vector<vector<fi_match> > result = compute_minimum_errors_batch(vector<vector<float> >(1, ft), fis, names, func, k);
+    return result.empty() ? vector<fi_match>() : result[0];
+}
+
+// ranks the rows of a matrix with the full scan
+struct scan_ranker
+{
+    feature_function func;
+    int k;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        return compute_minimum_errors_batch(fts, fis, names, func, k);
+    }
+};
+
+// the payload of the feature file as the rows of fis hold it, what an index saved next to the
+// file has to be built from to be reused
+template <typename Matrix>
+static fi_source rows_source(const string &fi_filepath, const Matrix &fis)
+{
+    fi_rows rows = view_rows(fis);
+    fi_source source;
+    read_fi_source(fi_filepath.c_str(), rows.type, rows.scale, source);
+    return source;
+}
+
+// ranks the rows of a matrix through the inverted index saved next to the feature file,
+// the index is built and saved first if there is none for these rows
+struct inverted_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    inverted_search_params params;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
         {
-            error = compute_hist_intersect_error(ft, fi);
+            return result;
         }
-        else if (func == top_bom_func)
+        string index_filepath = sidecar_filepath(fi_filepath.c_str(), func, "inv");
+        fi_source source = rows_source(fi_filepath, fis);
+        inverted_index index;
+        if (load_inverted_index(index_filepath.c_str(), index) || index.func != func || index.count != fis.rows ||
+            index.dim != fis.dim || index.min_mass != 0 || !same_fi_source(index.source, source))
         {
-            const float top_weight = 0.2;
-            const float bom_weight = 0.8;
-            error = compute_mult_hist_intersect_error(ft, fi, rgb_histo_size, top_weight, bom_weight);
+            build_inverted_index(index, fis, func);
+            index.source = source;
+            save_inverted_index(index, index_filepath.c_str());
         }
-        else if (func == rgb_mag_func)
+        result = search_inverted_index(index, fts, k, params);
+        print_top_n_batch(result, names);
+        return result;
+    }
+};
+
+// ranks the rows of a matrix through the k-means cluster index saved next to the feature file,
+// the index is trained and saved first if there is none for these rows
+struct ivf_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    int nlist;
+    ivf_search_params params;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
         {
-            const float rgb_weight = 0.7;
-            const float texture_weight = 0.3;
-            error = compute_mult_hist_intersect_error(ft, fi, rgb_histo_size, rgb_weight, texture_weight);
+            return result;
         }
-        else if (func == rgb_magori_func)
+        string index_filepath = sidecar_filepath(fi_filepath.c_str(), func, "ivf");
+        fi_source source = rows_source(fi_filepath, fis);
+        ivf_index index;
+        if (load_ivf_index(index_filepath.c_str(), index) || index.func != func || index.count != fis.rows || index.dim != fis.dim ||
+            index.nlist != ivf_list_count(fis.rows, nlist) || !same_fi_source(index.source, source))
         {
-            const float rgb_weight = 0.8;
-            const float texture_weight = 0.2;
-            error = compute_mult_hist_intersect_error(ft, fi, rgb_histo_size, rgb_weight, texture_weight);
+            if (build_ivf_index(index, fis, func, nlist))
+            {
+                return result;
+            }
+            index.source = source;
+            save_ivf_index(index, index_filepath.c_str());
         }
-        else if (func == rg_magori_func)
+        result = search_ivf_index(index, fis, fts, k, params);
+        print_top_n_batch(result, names);
+        return result;
+    }
+};
+
+// ranks the rows of a matrix through the HNSW graph saved next to the feature file,
+// the graph is built and saved first if there is none for these rows
+struct hnsw_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    hnsw_params build;
+    hnsw_search_params params;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
         {
-            const float rg_weight = 0.8;
-            const float texture_weight = 0.2;
-            int rg_histo_size = 64; // 8 bins^2 channel
-           error = compute_mult_hist_intersect_error(ft, fi, rg_histo_size, rg_weight, texture_weight);
+            return result;
         }
-        else if (func == rg_func)
+        string graph_filepath = sidecar_filepath(fi_filepath.c_str(), func, "hnsw");
+        fi_source source = rows_source(fi_filepath, fis);
+        hnsw_index index;
+        if (load_hnsw_index(graph_filepath.c_str(), index) || index.func != func || index.count != fis.rows || index.dim != fis.dim ||
+            index.m != max(2, build.m) || index.ef_construction != build.ef_construction || !same_fi_source(index.source, source))
         {
-           error = compute_hist_intersect_error(ft, fi);
+            if (build_hnsw_index(index, fis, func, build))
+            {
+                return result;
+            }
+            index.source = source;
+            save_hnsw_index(index, graph_filepath.c_str());
         }
-        error_list.push_back(error);
+        result = search_hnsw_index(index, fis, fts, k, params);
+        print_top_n_batch(result, names);
+        return result;
     }
+};
 
-    // 3. get top 3 minimum distance
-    vector<char *> top3;
-    int i = 0;
-    while (i < 10)
+// ranks the rows of a matrix by the product quantized codes saved next to the feature file,
+// the codes are trained and saved first if there are none for these rows
+struct pq_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    pq_params build;
+    pq_search_params params;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
     {
-        // get minimum value in error list
-        int min_ele_idx = std::min_element(error_list.begin(), error_list.end()) - error_list.begin();
-        int min_ele_val = *std::min_element(error_list.begin(), error_list.end());
-        cout << "\n"<< i + 1 << ": ";
-        cout << names.at(min_ele_idx) << endl;
-        cout << "error: " << error_list.at(min_ele_idx) << endl;
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
+        {
+            return result;
+        }
+        string codes_filepath = sidecar_filepath(fi_filepath.c_str(), func, "pq");
+        fi_source source = rows_source(fi_filepath, fis);
+        pq_index index;
+        if (load_pq_index(codes_filepath.c_str(), index) || index.func != func || index.count != fis.rows || index.dim != fis.dim ||
+            index.bits != build.bits || build.nsub < 1 || index.nsub != pq_run_count(fis.dim, build.nsub) ||
+            !same_fi_source(index.source, source))
+        {
+            if (build_pq_index(index, fis, func, build))
+            {
+                return result;
+            }
+            index.source = source;
+            save_pq_index(index, codes_filepath.c_str());
+        }
+        result = search_pq_index(index, fis, fts, k, params);
+        print_top_n_batch(result, names);
+        return result;
+    }
+};
 
-        // remove this index from error_list
-        error_list.erase(error_list.begin() + min_ele_idx);
+// ranks the rows of a matrix through the vantage point tree saved next to the feature file,
+// the tree is built and saved first if there is none for these rows
+struct vp_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
 
-        // add name from result_name at this index to top3
-        top3.push_back(names.at(min_ele_idx));
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
+        {
+            return result;
+        }
+        string tree_filepath = sidecar_filepath(fi_filepath.c_str(), func, "vp");
+        fi_source source = rows_source(fi_filepath, fis);
+        vp_tree tree;
+        if (load_vp_tree(tree_filepath.c_str(), tree) || tree.func != func || tree.count != fis.rows || tree.dim != fis.dim ||
+            !same_fi_source(tree.source, source))
+        {
+            if (build_vp_tree(tree, fis, func))
+            {
+                return result;
+            }
+            tree.source = source;
+            save_vp_tree(tree, tree_filepath.c_str());
+        }
+        result = search_vp_tree(tree, fis, fts, k);
+        print_top_n_batch(result, names);
+        return result;
+    }
+};
 
-        // remove it from the result name
-        names.erase(names.begin() + min_ele_idx);
-        i++;
+// ranks the rows of a matrix through the LSH tables saved next to the feature file,
+// the tables are built and saved first if there are none for these rows
+struct lsh_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    lsh_params build;
+    lsh_search_params params;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
+        {
+            return result;
+        }
+        string index_filepath = sidecar_filepath(fi_filepath.c_str(), func, "lsh");
+        fi_source source = rows_source(fi_filepath, fis);
+        lsh_index index;
+        if (load_lsh_index(index_filepath.c_str(), index) || index.func != func || index.count != fis.rows || index.dim != fis.dim ||
+            index.tables != build.tables || index.hashes != build.hashes || index.params_width != (build.width > 0 ? build.width : 0) ||
+            !same_fi_source(index.source, source))
+        {
+            if (build_lsh_index(index, fis, func, build))
+            {
+                return result;
+            }
+            index.source = source;
+            save_lsh_index(index, index_filepath.c_str());
+        }
+        result = search_lsh_index(index, fis, fts, k, params);
+        print_top_n_batch(result, names);
+        return result;
     }
-}
+};
 
-void get_top_n(cv::Mat t, char *fi_filepath, feature_function func)
+// reads the pyramid of the func rows of fi_filepath from pyramid_filepath, the levels are summed
+// and saved again if the file is missing or was summed from other rows
+template <typename Matrix>
+static int load_pyramid(histogram_pyramid &pyr, const Matrix &fis, feature_function func, const string &fi_filepath,
+                        const string &pyramid_filepath)
 {
-    // 1. get ft
-    vector<float> ft;
-    if (func == pixel_func)
+    fi_source source = rows_source(fi_filepath, fis);
+    if (load_histogram_pyramid(pyramid_filepath.c_str(), pyr) || pyr.func != func || pyr.count != fis.rows || pyr.dim != fis.dim ||
+        !same_fi_source(pyr.source, source))
     {
-        // 1. get the index of center row's top left corner
-        int row_start = (t.rows / 2) - 4;
-        int col_start = (t.cols / 2) - 4;
+        if (build_histogram_pyramid(pyr, fis, func))
+        {
+            return -1;
+        }
+        pyr.source = source;
+        save_histogram_pyramid(pyr, pyramid_filepath.c_str());
+    }
+    return 0;
+}
 
-        // 2. 9X9 pixel
-        int pixel_size = 9;
-        compute_1_pixel(t, ft, row_start, col_start, pixel_size, pixel_size);
+// ranks the rows of a matrix by their histogram pyramid, read from the file compute_fis saved
+// next to the feature file, the levels are summed and saved first if there are none for these rows
+struct pyramid_ranker
+{
+    feature_function func;
+    int k;
+    string fi_filepath;
+    string pyramid_filepath;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
+    {
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
+        {
+            return result;
+        }
+        histogram_pyramid pyr;
+        if (load_pyramid(pyr, fis, func, fi_filepath, pyramid_filepath))
+        {
+            return result;
+        }
+        result = search_histogram_pyramid(pyr, fis, fts, k);
+        print_top_n_batch(result, names);
+        return result;
     }
-    else if (func == rgb_func)
+};
+
+// keeps the best n rows of a matrix for every target, the first stage of the cascade
+struct shortlist_ranker
+{
+    feature_function func;
+    int n;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &) const
     {
-        compute_2_rgb(t, ft);
+        return scan_matrix(fts, fis, func, n);
     }
-    else if (func == top_bom_func)
+};
+
+// re-ranks the shortlists of the targets on the rows of a matrix, the shortlists come from the
+// compact feature or, if there are none, from the pyramid saved next to the feature file
+struct cascade_ranker
+{
+    feature_function func;
+    int k;
+    cascade_params params;
+    vector<vector<fi_match> > shortlists;
+    double shortlist_ms;
+    string fi_filepath;
+    string pyramid_filepath;
+
+    template <typename Matrix>
+    vector<vector<fi_match> > operator()(const vector<vector<float> > &fts, const Matrix &fis, const name_table &names) const
     {
-        compute_3_top_bom(t, ft); // ft top and bottom
+        vector<vector<fi_match> > result;
+        if (!check_target_sizes(fts, fis.dim))
+        {
+            return result;
+        }
+
+        // 1. the shortlists by the 64 bin level of the full feature
+        vector<vector<fi_match> > found = shortlists;
+        double found_ms = shortlist_ms;
+        if (params.coarse_func == func)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            histogram_pyramid pyr;
+            if (load_pyramid(pyr, fis, func, fi_filepath, pyramid_filepath))
+            {
+                return result;
+            }
+            found = shortlist_histogram_pyramid(pyr, fts, params.shortlist);
+            found_ms = elapsed_ms(start);
+        }
+
+        // 2. only the shortlists are scored with the full feature
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        result = rerank_shortlists(fis, func, fts, found, k);
+        printf("Cascade: shortlist of %d of %lu images in %.2f ms, re-ranked in %.2f ms\n",
+               params.shortlist, fis.rows, found_ms, elapsed_ms(start));
+
+        // 3. the full scan it stands in for, to see what the shortlist missed
+        if (params.recall)
+        {
+            start = chrono::steady_clock::now();
+            vector<vector<fi_match> > exact = scan_matrix(fts, fis, func, k);
+            printf("Cascade: recall@%d %.3f against the full scan in %.2f ms\n", k, cascade_recall(result, exact), elapsed_ms(start));
+        }
+        print_top_n_batch(result, names);
+        return result;
     }
-    else if (func == rgb_mag_func)
+};
+
+// rank the rows of a mapped store, on the codes if it is quantized
+template <typename Ranker>
+static vector<vector<fi_match> > rank_feature_store(const vector<vector<float> > &fts, feature_store &store, feature_function func, const Ranker &rank)
+{
+    if (store.header->feature_type != (uint32_t)func)
     {
-        compute_4_rgb_mag(t, ft);
+        printf("Feature file holds type %u, target is type %d\n", store.header->feature_type, func);
+        return vector<vector<fi_match> >();
     }
-    else if (func == rgb_magori_func)
+    name_table result_name;
+    view_image_data_bin(store, result_name);
+
+    // 3. calculate rank
+    feature_matrix result_fis;
+    quant_matrix result_codes;
+    if (store.header->elem_type == fi_f32)
     {
-        compute_5_rgb_magori(t, ft);
+        view_image_data_bin(store, result_fis);
+        return rank(fts, result_fis, result_name);
     }
-    else if (func == rg_magori_func)
+    view_image_data_bin(store, result_codes);
+    return rank(fts, result_codes, result_name);
+}
+
+// load the fis of fi_filepath once and rank them for every target
+template <typename Ranker>
+static vector<vector<fi_match> > rank_fi_file(const vector<vector<float> > &fts, char *fi_filepath, feature_function func, const Ranker &rank)
+{
+    vector<vector<fi_match> > result;
+
+    // 2. get fis and their file names
+    // the binary store, or the section of a container, is scanned in place
+    if (is_image_data_bin(fi_filepath))
     {
-        compute_5_rg_magori(t, ft);
+        feature_store store;
+        if (open_image_data_bin(fi_filepath, store))
+        {
+            return result;
+        }
+        result = rank_feature_store(fts, store, func, rank);
+        close_image_data_bin(store);
+        return result;
     }
-    else if (func == rg_func)
+    if (is_image_data_container(fi_filepath))
     {
-        compute_rg(t, ft);
+        feature_container container;
+        feature_store store;
+        if (open_image_data_container(fi_filepath, container))
+        {
+            return result;
+        }
+        if (open_container_section(container, func, store) == 0)
+        {
+            result = rank_feature_store(fts, store, func, rank);
+            close_image_data_bin(store);
+        }
+        close_image_data_container(container);
+        return result;
     }
 
-    // 2. get fis and their file names
-    vector<char *> result_name;
-    vector<vector<float>> result_fis;
-    read_image_data_csv(fi_filepath, result_name, result_fis, 1);
+    name_table result_name;
+    create_name_table(result_name);
+    feature_matrix result_fis;
+    create_feature_matrix(result_fis, fts.empty() ? 0 : fts[0].size());
+    // a partly read file would be ranked and indexed as if it were whole
+    if (read_image_data_csv(fi_filepath, result_name, result_fis, 1))
+    {
+        free_feature_matrix(result_fis);
+        return result;
+    }
     cout << "finsih read image" << endl;
 
     // 3. calculate rank
-    compute_minimum_errors(ft, result_fis, result_name, func);
+    result = rank(fts, result_fis, result_name);
+    free_feature_matrix(result_fis);
+    return result;
+}
+
+void get_top_n(cv::Mat t, char *fi_filepath, feature_function func, int k)
+{
+    // 1. get ft
+    vector<vector<float> > fts(1);
+    compute_feature(t, fts[0], func);
+    scan_ranker rank = {func, k};
+    rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+// the ft of every target
+static vector<vector<float> > compute_targets(const vector<cv::Mat> &targets, feature_function func)
+{
+    vector<vector<float> > fts(targets.size());
+    for (size_t q = 0; q < targets.size(); q++)
+    {
+        compute_feature(targets[q], fts[q], func);
+    }
+    return fts;
+}
+
+vector<vector<fi_match> > get_top_n_batch(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    scan_ranker rank = {func, k};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_inverted(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                             const inverted_search_params &params)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    inverted_ranker rank = {func, k, fi_filepath, params};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_ivf(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                        int nlist, const ivf_search_params &params)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    ivf_ranker rank = {func, k, fi_filepath, nlist, params};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_hnsw(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                         const hnsw_params &build, const hnsw_search_params &params)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    hnsw_ranker rank = {func, k, fi_filepath, build, params};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_pq(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                       const pq_params &build, const pq_search_params &params)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    pq_ranker rank = {func, k, fi_filepath, build, params};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_vp(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    vp_ranker rank = {func, k, fi_filepath};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_lsh(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                        const lsh_params &build, const lsh_search_params &params)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    lsh_ranker rank = {func, k, fi_filepath, build, params};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_pyramid(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k)
+{
+    // 1. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    pyramid_ranker rank = {func, k, fi_filepath, pyramid_filepath(fi_filepath, func)};
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_cascade(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                            const cascade_params &params)
+{
+    vector<vector<fi_match> > result;
+    if (params.shortlist < k)
+    {
+        printf("Shortlist of %d is shorter than k = %d\n", params.shortlist, k);
+        return result;
+    }
+
+    // 1. only a container holds a second feature, a single feature file is shortlisted by its pyramid
+    cascade_params used = params;
+    if (used.coarse_func != func && !is_image_data_container(fi_filepath))
+    {
+        printf("%s holds no feature %d, the shortlist comes from the pyramid of feature %d\n", fi_filepath, used.coarse_func, func);
+        used.coarse_func = func;
+    }
+
+    // 2. get the ft of every target
+    vector<vector<float> > fts = compute_targets(targets, func);
+    cascade_ranker rank = {func, k, used, vector<vector<fi_match> >(), 0, fi_filepath, pyramid_filepath(fi_filepath, func)};
+
+    // 3. the compact feature is scanned first, from its own section of the file
+    if (used.coarse_func != func)
+    {
+        vector<vector<float> > coarse_fts = compute_targets(targets, used.coarse_func);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        shortlist_ranker shortlist = {used.coarse_func, used.shortlist};
+        rank.shortlists = rank_fi_file(coarse_fts, fi_filepath, used.coarse_func, shortlist);
+        rank.shortlist_ms = elapsed_ms(start);
+        if (rank.shortlists.size() != targets.size())
+        {
+            return result;
+        }
+    }
+    return rank_fi_file(fts, fi_filepath, func, rank);
+}
+
+vector<vector<fi_match> > get_top_n_fused(const vector<cv::Mat> &targets, char *fi_filepath, const vector<feature_function> &funcs,
+                                          const vector<float> &weights, int k)
+{
+    vector<vector<fi_match> > result;
+    if (funcs.empty() || funcs.size() != weights.size())
+    {
+        printf("%lu weights for %lu features\n", weights.size(), funcs.size());
+        return result;
+    }
+    feature_container container;
+    if (!is_image_data_container(fi_filepath) || open_image_data_container(fi_filepath, container))
+    {
+        printf("Fused ranking needs a feature container, %s is not one\n", fi_filepath);
+        return result;
+    }
+
+    // 1. every feature is a section of the container, the histograms come with their pyramid
+    // unless the records are scanned in one pass
+    bool records = container.header->layout == fi_layout_records;
+    vector<feature_store> stores(funcs.size());
+    vector<histogram_pyramid> pyramids(funcs.size());
+    vector<fusion_list> lists(funcs.size());
+    vector<vector<vector<float> > > fts(funcs.size());
+    size_t opened = 0;
+    bool valid = true;
+    for (; valid && opened < funcs.size(); opened++)
+    {
+        if (open_container_section(container, funcs[opened], stores[opened]))
+        {
+            valid = false;
+            break;
+        }
+        feature_matrix fis;
+        quant_matrix codes;
+        fusion_list &list = lists[opened];
+        if (stores[opened].header->elem_type == fi_f32)
+        {
+            view_image_data_bin(stores[opened], fis);
+            list.rows = view_rows(fis);
+        }
+        else
+        {
+            view_image_data_bin(stores[opened], codes);
+            list.rows = view_rows(codes);
+        }
+        list.func = funcs[opened];
+        list.weight = weights[opened];
+        list.pyramid = NULL;
+        if (funcs[opened] != pixel_func && !records)
+        {
+            string path = pyramid_filepath(fi_filepath, funcs[opened]);
+            histogram_pyramid &pyr = pyramids[opened];
+            valid = (list.rows.type == fi_f32 ? load_pyramid(pyr, fis, funcs[opened], fi_filepath, path)
+                                              : load_pyramid(pyr, codes, funcs[opened], fi_filepath, path)) == 0;
+            list.pyramid = &pyr;
+        }
+
+        // 2. the ft of every target for this feature
+        fts[opened] = compute_targets(targets, funcs[opened]);
+    }
+
+    // 3. the fused top k, named by the container
+    if (valid)
+    {
+        name_table names;
+        view_image_data_bin(stores[0], names);
+        result = records ? scan_fused(lists, fts, k) : search_fused(lists, fts, k);
+        print_top_n_batch(result, names);
+    }
+    for (size_t f = 0; f < opened; f++)
+    {
+        close_image_data_bin(stores[f]);
+    }
+    close_image_data_container(container);
+    return result;
 }
 
 void show_img(cv::Mat img)
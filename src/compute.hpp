@@ -12,8 +12,20 @@
 #include <opencv2/opencv.hpp>
 #include <dirent.h>
 #include "filter.hpp"
+#include "feature_store.hpp"
+#include "topk.hpp"
 using namespace std;
 
+struct inverted_search_params;
+struct ivf_search_params;
+struct hnsw_params;
+struct hnsw_search_params;
+struct pq_params;
+struct pq_search_params;
+struct lsh_params;
+struct lsh_search_params;
+struct cascade_params;
+
 enum feature_function{
   pixel_func,
   rgb_func,
@@ -33,9 +45,17 @@ void show_img(cv::Mat img);
   Given two feature vectors ft and fi, compute the ssd
   @params ft the target image that we want to match
   @params fi the image in database
+  The float versions run on the SIMD kernels picked at startup, see distance_kernels.hpp.
  */
 
 float compute_ssd(vector<float> &ft, vector<float> &fi);
+float compute_ssd(const float *ft, const float *fi, int n);
+
+/*
+  Same on quantized codes, the value of a code is code * scale
+ */
+float compute_ssd(const uint8_t *ft, const uint8_t *fi, int n, float scale);
+float compute_ssd(const uint16_t *ft, const uint16_t *fi, int n, float scale);
 
 
 /*
@@ -43,8 +63,16 @@ float compute_ssd(vector<float> &ft, vector<float> &fi);
   that is the minimum of the number of counts
   @params ft the target image that we want to match
   @params fi the image in database
+  The float versions run on the SIMD kernels picked at startup, see distance_kernels.hpp.
  */
 float compute_hist_intersect_error(vector<float> &ft, vector<float> &fi);
+float compute_hist_intersect_error(const float *ft, const float *fi, int n);
+
+/*
+  Same on quantized codes, the value of a code is code * scale
+ */
+float compute_hist_intersect_error(const uint8_t *ft, const uint8_t *fi, int n, float scale);
+float compute_hist_intersect_error(const uint16_t *ft, const uint16_t *fi, int n, float scale);
 
 
 /*
@@ -60,14 +88,91 @@ float compute_hist_intersect_error(vector<float> &ft, vector<float> &fi);
   @params fi the image in database
  */
 float compute_mult_hist_intersect_error(vector<float> &ft, vector<float> &fi, int size_a, const float weight_a, const float weight_b);
+float compute_mult_hist_intersect_error(const float *ft, const float *fi, int n, int size_a, const float weight_a, const float weight_b);
+
+/*
+  A run of features scored on its own, the distance of a composite feature is
+  the weighted sum of the errors of its segments
+ */
+enum segment_metric
+{
+  intersect_metric, // 1 - histogram intersection
+  ssd_metric        // sum of squared differences
+};
+
+struct fi_segment
+{
+  int offset;  // first feature of the segment
+  int length;  // number of features
+  float weight;
+  segment_metric metric;
+};
+
+#define FI_MAX_SEGMENTS 8
+
+/*
+  Describes how the n features of func split into segments
+  @params segments room for FI_MAX_SEGMENTS segments
+  The function returns the number of segments.
+ */
+int get_feature_segments(feature_function func, int n, fi_segment *segments);
+
+/*
+  Weighted sum of the segment errors, computed in place on the two vectors
+ */
+float compute_segment_distance(const float *ft, const float *fi, const fi_segment *segments, int count);
+
+/*
+  Same for two rows of elem type, quantized rows are compared on their codes
+  @params scale the value of one code
+ */
+float compute_segment_distance(const void *ft, const void *fi, fi_elem_type type, float scale, const fi_segment *segments, int count);
+
+/*
+  Given two feature vectors of n features, compute the distance used by func
+  @params ft the target image that we want to match
+  @params fi the image in database
+  @params func the function that created both vectors
+ */
+float compute_distance(const float *ft, const float *fi, int n, feature_function func);
+
+/*
+  Same for two rows of elem type, quantized rows are compared on their codes
+  @params scale the value of one code
+ */
+float compute_distance(const void *ft, const void *fi, int n, fi_elem_type type, float scale, feature_function func);
+
+/*
+  The scale compute_fis quantizes the features of func with.
+  Pixels keep their channel values, histogram bins map [0, 1] to the full code range.
+ */
+float quant_scale(feature_function func, fi_elem_type type);
 
 /*
   Given a a dirPath argument, compute feature vector for all the images in that directory depending on the task number
   @params numOfArgs the number of arguments in argv
   @params dir_path_args the argument passed which is the directory path
-  @params saveToFile the csv file name to save to
+  @params saveToFile the file name to save to, a .bin file is written as binary feature store and anything else as csv
+  @params elem_type fi_u8 or fi_u16 to quantize the features of a .bin file, pixel_func is always stored as fi_u8
  */
-void compute_fis(int num_of_args, char const *dir_path_args[], char *fi_csv, feature_function func);
+void compute_fis(int num_of_args, char const *dir_path_args[], char *fi_csv, feature_function func, fi_elem_type elem_type = fi_f32);
+
+/*
+  Same as above but computes several feature types into one .fic feature container.
+  Every image is read once, its name is stored once and each feature type gets its own section.
+  @params funcs the feature functions to compute, one section each
+  @params interleave store the features of every image side by side in one record instead, for
+  queries that score all of them, see feature_container.hpp
+ */
+void compute_fis(int num_of_args, char const *dir_path_args[], char *fi_fic, const vector<feature_function> &funcs, fi_elem_type elem_type = fi_f32,
+                 bool interleave = false);
+
+/*
+  Given an image, compute the feature vector of func
+  @params img the image we want to compute feature vector of
+  @params fx the resulting feature vector
+ */
+void compute_feature(cv::Mat img, vector<float> &fx, feature_function func);
 
 
 /*
@@ -116,21 +221,141 @@ void compute_5_rgb_magori(cv::Mat img_uncropped, vector<float> &fx_rgb_magori);
 /*
   Given a list of images and its fis and target image t, compute the top n most similar - minimum distance
   from ft
-  @params name list of names of images
-  @params fis vector of features of the images
+  @params fis feature matrix of the images, one row per image, scored in place
+  @params names names of images, the id of a name is its row in fis
+  @params k the number of matches to keep
+  The rows are scored in parallel on the shared thread pool, see set_scan_threads, and a row
+  stops being scored once it cannot make the top k, see early_abandon.hpp.
+  The function prints and returns the k matches with the minimum errors, best first.
+ */
+vector<fi_match> compute_minimum_errors(vector<float> &ft, const feature_matrix &fis, const name_table &names, feature_function func, int k = 10);
+
+/*
+  Same on a quantized feature matrix, ft is quantized with the scale of fis first
+ */
+vector<fi_match> compute_minimum_errors(vector<float> &ft, const quant_matrix &fis, const name_table &names, feature_function func, int k = 10);
+
+/*
+  Same for many targets at once, fis is read once and every partition of its rows is scored
+  for all the targets while it is in cache
+  The function prints and returns the k matches of every target, in the order of fts.
+ */
+vector<vector<fi_match> > compute_minimum_errors_batch(const vector<vector<float> > &fts, const feature_matrix &fis, const name_table &names, feature_function func, int k = 10);
+vector<vector<fi_match> > compute_minimum_errors_batch(const vector<vector<float> > &fts, const quant_matrix &fis, const name_table &names, feature_function func, int k = 10);
+
+/*
+  Prints the rank, image name and error of every match
  */
-void compute_minimum_errors(vector<float> &ft, vector<vector<float>> &fis, vector<char *> &names, feature_function func);
+void print_top_n(const vector<fi_match> &top_n, const name_table &names);
 
 
 /* Given :
   @params target image
   @params func the function to create vector
   @params filepath name of database fis
+  @params k the number of matches to print
   It will: 
   - Computes the features for the target image by calling compute_featurex() 
-  - reads the feature vector file by calling read_image_data_csv()
+  - maps the feature vector file by calling open_image_data_bin() if it is a .bin file,
+    maps only the section of func if it is a .fic container
+    otherwise reads it by calling read_image_data_csv()
   and finally identifies the top N matches by calling compute_ranking()
 */
-void get_top_n(cv::Mat t, char * fi_filepath, feature_function func);
+void get_top_n(cv::Mat t, char * fi_filepath, feature_function func, int k = 10);
+
+/*
+  Same for many target images, the feature file is loaded once for all of them
+  The function returns the k matches of every target, in the order of targets.
+*/
+vector<vector<fi_match> > get_top_n_batch(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k = 10);
+
+/*
+  Same through an inverted index over the histogram bins of the feature file, read from the
+  <fi_filepath>.<func>.inv file saved with it, or built and saved there if it is missing or was
+  built from other rows. Only for the histogram features, see inverted_index.hpp.
+  @params params how much of every target to read, default_inverted_search_params reads all of it
+*/
+vector<vector<fi_match> > get_top_n_inverted(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                             const inverted_search_params &params);
+
+/*
+  Same through a k-means cluster index of the feature file, only the members of the
+  params.nprobe clusters nearest to a target are scored. The index is read from the
+  <fi_filepath>.<func>.ivf file saved with it, or trained and saved there if it is missing or was
+  trained on other rows or with another nlist. See ivf_index.hpp.
+  @params nlist clusters, 0 picks a number from the size of the file
+*/
+vector<vector<fi_match> > get_top_n_ivf(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                        int nlist, const ivf_search_params &params);
+
+/*
+  Same through an HNSW graph of the feature file, only the images the graph leads the search to
+  are scored. The graph is read from the <fi_filepath>.<func>.hnsw file saved with it, or built
+  with build and saved there if it is missing, was built from other rows or with other params.
+  See hnsw_index.hpp.
+  @params params ef_search of the queries, more finds more of the true top k
+*/
+vector<vector<fi_match> > get_top_n_hnsw(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                         const hnsw_params &build, const hnsw_search_params &params);
+
+/*
+  Same by the product quantized codes of the feature file, read from the <fi_filepath>.<func>.pq
+  file saved with them, or trained with build and saved there if it is missing, was trained on
+  other rows or has other runs or code bits than build. See pq_index.hpp.
+  @params params how many of the best by code are scored again on the feature file
+*/
+vector<vector<fi_match> > get_top_n_pq(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                       const pq_params &build, const pq_search_params &params);
+
+/*
+  Same through a vantage point tree of the feature file, for pixel_func. The matches are the
+  ones get_top_n_batch finds, from a fraction of the rows. The tree is read from the
+  <fi_filepath>.<func>.vp file saved with it, or built and saved there if it is missing or was
+  built from other rows. See vp_tree.hpp.
+*/
+vector<vector<fi_match> > get_top_n_vp(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k = 10);
+
+/*
+  Same through LSH tables of the feature file, for near duplicate lookups with pixel_func.
+  Only the images that share a bucket with a target are scored. The tables are read from the
+  <fi_filepath>.<func>.lsh file saved with them, or built with build and saved there if it is
+  missing, was built from other rows or with other params. See lsh_index.hpp.
+  @params build tables and hashes, see default_lsh_params
+  @params params buckets probed per table besides the target's own
+*/
+vector<vector<fi_match> > get_top_n_lsh(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                        const lsh_params &build, const lsh_search_params &params);
+
+/*
+  Same through the coarse levels of the histograms, read from the pyramid compute_fis saved with
+  the feature file, or summed and saved there if it is missing or was summed from another
+  version of the file. Only the images whose 8 and 64
+  bin bounds can still beat the k-th best error are scored on the full histograms, the matches
+  are the ones get_top_n_batch finds. See histogram_pyramid.hpp.
+*/
+vector<vector<fi_match> > get_top_n_pyramid(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k = 10);
+
+/*
+  Same in two stages, params.coarse_func is scanned over the whole file and keeps a shortlist
+  of every target that is re-ranked with func. The compact feature is read from its section of a
+  container made by compute_fis with both functions, or with coarse_func = func from the 64 bin
+  level of the pyramid of func. A .bin or csv file holds func only, so its shortlist always comes
+  from the pyramid. Prints the time of both stages and, with params.recall, the
+  share of the full scan matches found. See cascade.hpp.
+*/
+vector<vector<fi_match> > get_top_n_cascade(const vector<cv::Mat> &targets, char *fi_filepath, feature_function func, int k,
+                                            const cascade_params &params);
+
+/*
+  Exact top k by the weighted sum of the distances of several features, read from their
+  sections of a container made by compute_fis, so one query replaces running get_top_n once per
+  feature and fusing the lists. Fagin's threshold algorithm stops before every image is scored
+  on every feature. A container with interleaved records is scored in one pass over the records
+  instead. See fusion.hpp.
+  @params funcs the features, each a section of the container
+  @params weights the weight of every feature in the sum, not negative
+*/
+vector<vector<fi_match> > get_top_n_fused(const vector<cv::Mat> &targets, char *fi_filepath, const vector<feature_function> &funcs,
+                                          const vector<float> &weights, int k = 10);
 
 #endif
\ No newline at end of file
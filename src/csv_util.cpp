@@ -8,106 +8,149 @@ CPP functions for reading CSV files with a specific format
 - first column is a string containing a filename or path
 - every other column is a number
 
-The function returns a std::vector of char* for the filenames and a 2D std::vector of floats for the data
+The function returns a name_table for the filenames and an aligned feature_matrix for the data
 */
 #include <vector>
+#include <string>
+#include <chrono>
 #include <cstdio>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <cmath>
+#include <unistd.h>
 #include "csv_util.h"
 #include "opencv2/opencv.hpp"
 using namespace std;
 
-/*
-  reads a string from a CSV file. the 0-terminated string is returned in the char array os.
+// bytes read from the file per block
+#define CSV_BLOCK_SIZE (4 << 20)
 
-  The function returns false if it is successfully read. It returns true if it reaches the end of the line or the file.
- */
-int getstring(FILE *fp, char os[])
+// exact powers of ten, every one of them is representable as a double
+static const double pow10_exact[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static inline bool is_field_end(const char *p, const char *end)
 {
-  int p = 0;
-  int eol = 0;
+  return p == end || *p == ',' || *p == '\n';
+}
 
-  for (;;)
-  {
-    char ch = fgetc(fp);
-    if (ch == ',')
-    {
-      break;
-    }
-    else if (ch == '\n' || ch == EOF)
-    {
-      eol = 1;
-      break;
-    }
-    // printf("%c", ch ); // uncomment for debugging
-    os[p] = ch;
-    p++;
-  }
-  // printf("\n"); // uncomment for debugging
-  os[p] = '\0';
+/*
+  Utility function for reading one float value from a CSV buffer, p points to the first char of the field
+  and end to the end of the buffer. The value is stored in the v parameter.
 
-  return (eol); // return true if eol
-}
+  Plain decimals like "-0.0123" are converted without going through the locale: the digits are
+  collected into an integer mantissa m and the value is m / 10^k. When m < 2^53 and k <= 22 both
+  operands are exact doubles, so the division is correctly rounded and gives the same double as atof.
+  Anything else (exponents, '\r', very long mantissas, ...) falls back to strtod.
 
-int getint(FILE *fp, int *v)
+  The function returns a pointer to the char that ended the field.
+ */
+static const char *parse_float(const char *p, const char *end, float *v)
 {
-  char s[256];
-  int p = 0;
-  int eol = 0;
+  const char *s = p;
+  bool negative = false;
+  if (s < end && (*s == '-' || *s == '+'))
+  {
+    negative = *s == '-';
+    s++;
+  }
 
-  for (;;)
+  uint64_t mantissa = 0;
+  int significant = 0; // digits in mantissa, leading zeros excluded
+  int decimals = 0;
+  int digits = 0;
+  bool fraction = false;
+  for (; s < end; s++)
   {
-    char ch = fgetc(fp);
-    if (ch == ',')
+    if (*s >= '0' && *s <= '9')
     {
-      break;
+      if (mantissa != 0 || *s != '0')
+      {
+        significant++;
+      }
+      mantissa = mantissa * 10 + (*s - '0');
+      decimals += fraction;
+      digits++;
+    }
+    else if (*s == '.' && !fraction)
+    {
+      fraction = true;
     }
-    else if (ch == '\n' || ch == EOF)
+    else
     {
-      eol = 1;
       break;
     }
+  }
 
-    s[p] = ch;
-    p++;
+  if (digits > 0 && significant <= 15 && decimals <= 22 && is_field_end(s, end))
+  {
+    double value = (double)mantissa / pow10_exact[decimals];
+    *v = negative ? -value : value;
+    return (s);
   }
-  s[p] = '\0'; // terminator
-  *v = atoi(s);
 
-  return (eol); // return true if eol
+  // slow path, same conversion as atof
+  while (!is_field_end(s, end))
+  {
+    s++;
+  }
+  std::string field(p, s - p);
+  *v = strtod(field.c_str(), NULL);
+  return (s);
 }
 
 /*
-  Utility function for reading one float value from a CSV file
-  The value is stored in the v parameter
-  The function returns true if it reaches the end of a line or the file
+  Parses the complete lines in buf[0, size) and appends them to the results.
+  The function returns true if it reaches a line without features, which ends the file.
  */
-int getfloat(FILE *fp, float *v)
+static bool parse_csv_lines(const char *buf, size_t size, name_table &result_name, feature_matrix &result_fis, std::vector<float> &single_fi, int &err)
 {
-  char s[256];
-  int p = 0;
-  int eol = 0;
-
-  for (;;)
+  const char *p = buf;
+  const char *end = buf + size;
+  while (p < end)
   {
-    char ch = fgetc(fp);
-    if (ch == ',')
+    // 1. image file name
+    const char *q = p;
+    while (!is_field_end(q, end))
     {
-      break;
+      q++;
     }
-    else if (ch == '\n' || ch == EOF)
+    if (q == end || *q == '\n')
     {
-      eol = 1;
-      break;
+      return (true);
     }
+    const char *fname = p;
+    size_t fname_len = q - p;
+    p = q + 1;
 
-    s[p] = ch;
-    p++;
-  }
-  s[p] = '\0'; // terminator
-  *v = atof(s);
+    // 2. feature vector of 1 image
+    single_fi.clear();
+    for (;;)
+    {
+      float fval;
+      p = parse_float(p, end, &fval);
+      single_fi.push_back(fval);
+      if (p == end || *p == '\n')
+      {
+        break;
+      }
+      p++;
+    }
+    if (p < end)
+    {
+      p++; // EOL
+    }
 
-  return (eol); // return true if eol
+    // 3. copy it to the next row of all fis
+    if (append_feature_row(result_fis, single_fi.data(), single_fi.size()))
+    {
+      err = -1;
+      return (true);
+    }
+    add_name(result_name, fname, fname_len);
+  }
+  return (false);
 }
 
 /*
@@ -160,29 +203,147 @@ int append_image_data_csv(char *filepath, const char *image_filename, std::vecto
   return (0);
 }
 
+int format_float4(char *dst, float v)
+{
+  // v * 10^4 is exact in a double (24 + 14 bits), so rounding it to an integer with
+  // the default round-half-even mode gives the same digits as printf
+  double scaled = (double)v * 10000.0;
+  if (!(fabs(scaled) < 9.0e18))
+  {
+    return snprintf(dst, 64, "%.4f", v); // nan, inf and huge values
+  }
+
+  int n = 0;
+  if (signbit(v))
+  {
+    dst[n++] = '-';
+  }
+  uint64_t units = (uint64_t)nearbyint(fabs(scaled));
+  uint64_t whole = units / 10000;
+  unsigned frac = units % 10000;
+
+  // integer part, digits come out backwards
+  char digits[24];
+  int d = 0;
+  do
+  {
+    digits[d++] = '0' + whole % 10;
+    whole /= 10;
+  } while (whole > 0);
+  while (d > 0)
+  {
+    dst[n++] = digits[--d];
+  }
+
+  dst[n++] = '.';
+  dst[n++] = '0' + frac / 1000;
+  dst[n++] = '0' + frac / 100 % 10;
+  dst[n++] = '0' + frac / 10 % 10;
+  dst[n++] = '0' + frac % 10;
+  return (n);
+}
+
+// write the buffered rows to the file
+static int flush_csv_writer(csv_writer &writer)
+{
+  if (writer.used > 0 && fwrite(&writer.buffer[0], 1, writer.used, writer.fp) != writer.used)
+  {
+    printf("Unable to write to %s\n", writer.filepath);
+    return (-1);
+  }
+  writer.used = 0;
+  return (0);
+}
+
+int open_image_data_csv_writer(csv_writer &writer, const char *filepath, int reset_file, int fsync_on_close)
+{
+  writer.fp = fopen(filepath, reset_file ? "w" : "a");
+  if (!writer.fp)
+  {
+    printf("Unable to open output file %s\n", filepath);
+    return (-1);
+  }
+  // the writer does its own buffering
+  setvbuf(writer.fp, NULL, _IONBF, 0);
+
+  strncpy(writer.filepath, filepath, sizeof(writer.filepath) - 1);
+  writer.filepath[sizeof(writer.filepath) - 1] = '\0';
+  writer.buffer.resize(CSV_WRITE_BUFFER_SIZE);
+  writer.used = 0;
+  writer.fsync_on_close = fsync_on_close;
+  return (0);
+}
+
+int append_image_data_csv(csv_writer &writer, const char *image_filename, const float *feature_vector, int dim)
+{
+  // 1. make room for the longest possible row
+  size_t name_len = strlen(image_filename);
+  size_t max_row = name_len + (size_t)dim * 65 + 1;
+  if (writer.used + max_row > writer.buffer.size())
+  {
+    if (flush_csv_writer(writer))
+    {
+      return (-1);
+    }
+    if (max_row > writer.buffer.size())
+    {
+      writer.buffer.resize(max_row);
+    }
+  }
+
+  // 2. the filename, then the feature vector
+  char *dst = &writer.buffer[writer.used];
+  memcpy(dst, image_filename, name_len);
+  dst += name_len;
+  for (int i = 0; i < dim; i++)
+  {
+    *dst++ = ',';
+    dst += format_float4(dst, feature_vector[i]);
+  }
+  *dst++ = '\n'; // EOL
+
+  writer.used = dst - &writer.buffer[0];
+  return (0);
+}
+
+int close_image_data_csv_writer(csv_writer &writer)
+{
+  int err = flush_csv_writer(writer);
+  if (writer.fsync_on_close && !err)
+  {
+    err = fflush(writer.fp) != 0 || fsync(fileno(writer.fp)) != 0;
+  }
+  err |= fclose(writer.fp) != 0;
+  writer.fp = NULL;
+  if (err)
+  {
+    printf("Unable to finish writing %s\n", writer.filepath);
+    return (-1);
+  }
+  return (0);
+}
+
 /*
   Given a file with the format of a string as the first column and
   floating point numbers as the remaining columns, this function
-  returns the filenames as a std::vector of character arrays, and the
-  remaining data as a 2D std::vector<float>.
+  returns the filenames interned in a name_table, and the
+  remaining data as one aligned feature_matrix.
 
   src_csv the file to read from
   this will be the result:
-  - result_name will contain all of the image file names.
-  - resFbList will contain the features calculated from each image.
+  - result_name will contain all of the image file names, the id of a name is its row in result_fis.
+  - result_fis will contain the features calculated from each image, one row per image.
 
   If echo_file is true, it prints out the contents of the file as read
   into memory.
 
   The function returns a non-zero value if something goes wrong.
  */
-int read_image_data_csv(char *src_csv, std::vector<char *> &result_name, std::vector<std::vector<float>> &result_fis, int echo_file)
+int read_image_data_csv(char *src_csv, name_table &result_name, feature_matrix &result_fis, int echo_file)
 {
   FILE *fp;
-  float fval;
-  char img_file[256];
 
-  fp = fopen(src_csv, "r");
+  fp = fopen(src_csv, "rb");
   if (!fp)
   {
     printf("Unable to open feature file\n");
@@ -190,35 +351,47 @@ int read_image_data_csv(char *src_csv, std::vector<char *> &result_name, std::ve
   }
 
   printf("Reading %s\n", src_csv);
-  for (;;)
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<char> buf(CSV_BLOCK_SIZE);
+  std::vector<float> single_fi; // feature vector of a single image, reused for every row
+  size_t filled = 0;            // bytes in buf
+  size_t total = 0;             // bytes read from the file
+  bool eof = false;
+  bool done = false;
+  int err = 0;
+  while (!done && !eof)
   {
-    std::vector<float> single_fi; // feature vector of a single image
-
-    // read the src_csv
-    if (getstring(fp, img_file))
+    // 1. read the next block behind the partial line left by the previous one
+    if (filled == buf.size())
     {
-      break;
+      buf.resize(buf.size() * 2); // a single line is longer than the block
     }
-
-    // get the feature vector of 1 image
-    for (;;)
+    size_t n = fread(&buf[filled], 1, buf.size() - filled, fp);
+    filled += n;
+    total += n;
+    eof = n == 0 || feof(fp);
+
+    // 2. parse up to the last complete line, everything at the end of the file
+    size_t size = filled;
+    if (!eof)
     {
-      // get next feature
-      float eol = getfloat(fp, &fval);
-      single_fi.push_back(fval);
-      if (eol)
-        break;
+      while (size > 0 && buf[size - 1] != '\n')
+      {
+        size--;
+      }
     }
-    // printf("read %lu features\n", dvec.size() );
+    done = parse_csv_lines(&buf[0], size, result_name, result_fis, single_fi, err);
 
-    // push it to all fis
-    result_fis.push_back(single_fi);
-
-    char *fname = new char[strlen(img_file) + 1];
-    strcpy(fname, img_file);
-    result_name.push_back(fname);
+    // 3. keep the partial line for the next block
+    memmove(&buf[0], &buf[size], filled - size);
+    filled -= size;
   }
   fclose(fp);
-  printf("Finished reading CSV file\n");
-  return (0);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double mb = total / (1024.0 * 1024.0);
+  printf("Finished reading CSV file: %lu images, %.1f MB in %.3f s (%.1f MB/s)\n",
+         result_fis.rows, mb, seconds, seconds > 0 ? mb / seconds : 0.0);
+  return (err);
 }
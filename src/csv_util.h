@@ -10,6 +10,27 @@
 #ifndef CVS_UTIL_H
 #define CVS_UTIL_H
 
+#include <cstdio>
+#include <vector>
+#include "feature_matrix.hpp"
+#include "name_table.hpp"
+
+// bytes collected in memory before a csv_writer writes them to the file
+#define CSV_WRITE_BUFFER_SIZE (1 << 20)
+
+/*
+  Writer that keeps one CSV file open while a whole directory is processed.
+  Rows are formatted into an in-memory buffer that is written out in large blocks.
+ */
+struct csv_writer
+{
+  FILE *fp;
+  char filepath[256];
+  std::vector<char> buffer;
+  size_t used;        // bytes of buffer holding formatted rows
+  int fsync_on_close; // if true, close waits until the data is on disk
+};
+
 /*
   Given a filename, and image filename, and the image features, by
   default the function will append a line of data to the CSV format
@@ -22,23 +43,53 @@
 
   The function returns a non-zero value in case of an error.
  */
-int append_image_data_csv( char *filename, char *image_filename, std::vector<float> &feature_vector, int reset_file = 0 );
+int append_image_data_csv( char *filename, const char *image_filename, std::vector<float> &feature_vector, int reset_file = 0 );
+
+/*
+  Opens filepath for a csv_writer. If reset_file is true the existing contents are cleared,
+  otherwise the rows are appended. If fsync_on_close is true, close_image_data_csv_writer
+  does not return before the file is on disk.
+
+  The function returns a non-zero value in case of an error.
+ */
+int open_image_data_csv_writer( csv_writer &writer, const char *filepath, int reset_file = 1, int fsync_on_close = 0 );
+
+/*
+  Same row format as append_image_data_csv above, the row is buffered and written
+  to the file once the buffer is full.
+
+  The function returns a non-zero value in case of an error.
+ */
+int append_image_data_csv( csv_writer &writer, const char *image_filename, const float *feature_vector, int dim );
+
+/*
+  Writes the buffered rows and closes the file.
+
+  The function returns a non-zero value in case of an error.
+ */
+int close_image_data_csv_writer( csv_writer &writer );
+
+/*
+  Formats v like printf("%.4f") into dst, which needs room for 64 chars.
+  Returns the number of chars written, without a terminator.
+ */
+int format_float4( char *dst, float v );
 
 
 /*
   Given a file src_csv with the format of a string as the first column and
   floating point numbers as the remaining columns, this function
-  returns the filenames as a std::vector of character arrays, and the
-  remaining data as a 2D std::vector<float>.
+  returns the filenames interned in a name_table, and the
+  remaining data as one aligned feature_matrix.
 
-  result_name will contain all of the image file names.
-  result_fis will contain the features calculated from each image.
+  result_name will contain all of the image file names, the id of a name is its row in result_fis.
+  result_fis will contain the features calculated from each image, one row per image.
 
   If echo_file is true, it prints out the contents of the file as read
   into memory.
 
   The function returns a non-zero value if something goes wrong.
  */
-int read_image_data_csv(char *src_csv, std::vector<char *> &result_name, std::vector<std::vector<float>> &result_fis, int echo_file = 0);
+int read_image_data_csv(char *src_csv, name_table &result_name, feature_matrix &result_fis, int echo_file = 0);
 
 #endif
@@ -0,0 +1,402 @@
+//**********************************************************************************************************************
+// FILE: distance_kernels.cpp
+//
+// DESCRIPTION
+// Contains implementation for the float distance kernels and their CPUID dispatch
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include "distance_kernels.hpp"
+
+// the AVX kernels are compiled with function target attributes, so the rest of the
+// program keeps the baseline instruction set and still runs on older hosts
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FI_X86_DISPATCH
+// the _mm512_undefined_* helpers of some GCC releases trip -Wuninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+float intersect_f32_scalar(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += a[i] < b[i] ? a[i] : b[i];
+    }
+    return sum;
+}
+
+float ssd_f32_scalar(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sum;
+}
+
+float intersect_gather_f32_scalar(const float *values, const int32_t *index, int n, const float *b)
+{
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        float v = b[index[i]];
+        sum += values[i] < v ? values[i] : v;
+    }
+    return sum;
+}
+
+void fastscan_u4_scalar(const uint8_t *codes, const uint8_t *luts, int nsub, uint16_t *sums)
+{
+    uint32_t acc[32] = {0};
+    for (int s = 0; s < nsub; s++)
+    {
+        const uint8_t *row = codes + s * 16;
+        const uint8_t *lut = luts + s * 16;
+        for (int j = 0; j < 16; j++)
+        {
+            acc[j] += lut[row[j] & 15];
+            acc[j + 16] += lut[row[j] >> 4];
+        }
+    }
+    for (int j = 0; j < 32; j++)
+    {
+        sums[j] = acc[j] < 65535 ? acc[j] : 65535;
+    }
+}
+
+#ifdef __SSE2__
+// sum of the four lanes
+static inline float hsum_ps(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+static float intersect_f32_sse2(const float *a, const float *b, int n)
+{
+    // two accumulators so one add does not wait on the other
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_min_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_min_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float sum = hsum_ps(_mm_add_ps(acc0, acc1));
+    for (; i < n; i++)
+    {
+        sum += a[i] < b[i] ? a[i] : b[i];
+    }
+    return sum;
+}
+
+static float ssd_f32_sse2(const float *a, const float *b, int n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float sum = hsum_ps(_mm_add_ps(acc0, acc1));
+    for (; i < n; i++)
+    {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sum;
+}
+#endif
+
+#ifdef FI_X86_DISPATCH
+__attribute__((target("avx2,fma"))) static inline float hsum_ps256(__m256 v)
+{
+    return hsum_ps(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma"))) static float intersect_f32_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_add_ps(acc0, _mm256_min_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_min_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    if (i + 8 <= n)
+    {
+        acc0 = _mm256_add_ps(acc0, _mm256_min_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        i += 8;
+    }
+    float sum = hsum_ps256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++)
+    {
+        sum += a[i] < b[i] ? a[i] : b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float ssd_f32_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    if (i + 8 <= n)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+        i += 8;
+    }
+    float sum = hsum_ps256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; i++)
+    {
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float intersect_gather_f32_avx2(const float *values, const int32_t *index, int n, const float *b)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 vb = _mm256_i32gather_ps(b, _mm256_loadu_si256((const __m256i *)(index + i)), 4);
+        acc = _mm256_add_ps(acc, _mm256_min_ps(_mm256_loadu_ps(values + i), vb));
+    }
+    float sum = hsum_ps256(acc);
+    for (; i < n; i++)
+    {
+        float v = b[index[i]];
+        sum += values[i] < v ? values[i] : v;
+    }
+    return sum;
+}
+
+// two subspaces per instruction, one in each 128 bit lane. The shuffle looks the 16 low nibbles
+// and the 16 high nibbles up in the table of their lane, the uint8 entries are widened to uint16
+// and summed with saturation
+__attribute__((target("avx2,fma"))) static void fastscan_u4_avx2(const uint8_t *codes, const uint8_t *luts, int nsub, uint16_t *sums)
+{
+    __m256i low = _mm256_set1_epi8(15);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero; // images 0-7
+    __m256i acc1 = zero; // images 8-15
+    __m256i acc2 = zero; // images 16-23
+    __m256i acc3 = zero; // images 24-31
+    int s = 0;
+    for (; s + 2 <= nsub; s += 2)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(codes + s * 16));
+        __m256i lut = _mm256_loadu_si256((const __m256i *)(luts + s * 16));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(c, low));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(c, 4), low));
+        acc0 = _mm256_adds_epu16(acc0, _mm256_unpacklo_epi8(lo, zero));
+        acc1 = _mm256_adds_epu16(acc1, _mm256_unpackhi_epi8(lo, zero));
+        acc2 = _mm256_adds_epu16(acc2, _mm256_unpacklo_epi8(hi, zero));
+        acc3 = _mm256_adds_epu16(acc3, _mm256_unpackhi_epi8(hi, zero));
+    }
+
+    // fold the lanes, then the last subspace of an odd count
+    __m128i z = _mm_setzero_si128();
+    __m128i s0 = _mm_adds_epu16(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+    __m128i s1 = _mm_adds_epu16(_mm256_castsi256_si128(acc1), _mm256_extracti128_si256(acc1, 1));
+    __m128i s2 = _mm_adds_epu16(_mm256_castsi256_si128(acc2), _mm256_extracti128_si256(acc2, 1));
+    __m128i s3 = _mm_adds_epu16(_mm256_castsi256_si128(acc3), _mm256_extracti128_si256(acc3, 1));
+    if (s < nsub)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(codes + s * 16));
+        __m128i lut = _mm_loadu_si128((const __m128i *)(luts + s * 16));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(c, _mm_set1_epi8(15)));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(c, 4), _mm_set1_epi8(15)));
+        s0 = _mm_adds_epu16(s0, _mm_unpacklo_epi8(lo, z));
+        s1 = _mm_adds_epu16(s1, _mm_unpackhi_epi8(lo, z));
+        s2 = _mm_adds_epu16(s2, _mm_unpacklo_epi8(hi, z));
+        s3 = _mm_adds_epu16(s3, _mm_unpackhi_epi8(hi, z));
+    }
+    _mm_storeu_si128((__m128i *)sums, s0);
+    _mm_storeu_si128((__m128i *)(sums + 8), s1);
+    _mm_storeu_si128((__m128i *)(sums + 16), s2);
+    _mm_storeu_si128((__m128i *)(sums + 24), s3);
+}
+
+// the tail is loaded with a mask, the masked out lanes are 0 in both inputs and add nothing
+__attribute__((target("avx512f"))) static float intersect_f32_avx512(const float *a, const float *b, int n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm512_add_ps(acc0, _mm512_min_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+        acc1 = _mm512_add_ps(acc1, _mm512_min_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16)));
+    }
+    for (; i < n; i += 16)
+    {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        acc0 = _mm512_add_ps(acc0, _mm512_min_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static float intersect_gather_f32_avx512(const float *values, const int32_t *index, int n, const float *b)
+{
+    __m512 acc = _mm512_setzero_ps();
+    for (int i = 0; i < n; i += 16)
+    {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512i vi = _mm512_maskz_loadu_epi32(m, index + i);
+        __m512 vb = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, vi, b, 4);
+        acc = _mm512_add_ps(acc, _mm512_min_ps(_mm512_maskz_loadu_ps(m, values + i), vb));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f"))) static float ssd_f32_avx512(const float *a, const float *b, int n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i < n; i += 16)
+    {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+typedef float (*f32_kernel)(const float *, const float *, int);
+typedef float (*gather_kernel)(const float *, const int32_t *, int, const float *);
+typedef void (*fastscan_kernel)(const uint8_t *, const uint8_t *, int, uint16_t *);
+
+static simd_level level = simd_scalar;
+static f32_kernel intersect_kernel = intersect_f32_scalar;
+static f32_kernel ssd_kernel = ssd_f32_scalar;
+static gather_kernel intersect_gather_kernel = intersect_gather_f32_scalar;
+static fastscan_kernel fastscan_kernel_u4 = fastscan_u4_scalar;
+
+simd_level detect_simd_level()
+{
+#ifdef FI_X86_DISPATCH
+    // may run before the constructors of libgcc, which normally fill in the cpu model
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return simd_avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return simd_avx2;
+    }
+#endif
+#ifdef __SSE2__
+    return simd_sse2;
+#else
+    return simd_scalar;
+#endif
+}
+
+simd_level get_simd_level()
+{
+    return level;
+}
+
+simd_level set_simd_level(simd_level wanted)
+{
+    simd_level best = detect_simd_level();
+    level = wanted < best ? wanted : best;
+    switch (level)
+    {
+#ifdef FI_X86_DISPATCH
+    case simd_avx512:
+        intersect_kernel = intersect_f32_avx512;
+        ssd_kernel = ssd_f32_avx512;
+        intersect_gather_kernel = intersect_gather_f32_avx512;
+        fastscan_kernel_u4 = fastscan_u4_avx2; // the byte shuffle of AVX-512F is the AVX2 one
+        break;
+    case simd_avx2:
+        intersect_kernel = intersect_f32_avx2;
+        ssd_kernel = ssd_f32_avx2;
+        intersect_gather_kernel = intersect_gather_f32_avx2;
+        fastscan_kernel_u4 = fastscan_u4_avx2;
+        break;
+#endif
+#ifdef __SSE2__
+    case simd_sse2:
+        intersect_kernel = intersect_f32_sse2;
+        ssd_kernel = ssd_f32_sse2;
+        intersect_gather_kernel = intersect_gather_f32_scalar; // SSE2 has no gather
+        fastscan_kernel_u4 = fastscan_u4_scalar;        // nor a byte shuffle
+        break;
+#endif
+    default:
+        level = simd_scalar;
+        intersect_kernel = intersect_f32_scalar;
+        ssd_kernel = ssd_f32_scalar;
+        intersect_gather_kernel = intersect_gather_f32_scalar;
+        fastscan_kernel_u4 = fastscan_u4_scalar;
+        break;
+    }
+    return level;
+}
+
+// pick the kernels once at startup
+static simd_level startup_level = set_simd_level(simd_avx512);
+
+const char *simd_level_name(simd_level l)
+{
+    static const char *names[] = {"scalar", "sse2", "avx2", "avx512"};
+    return names[l];
+}
+
+float intersect_f32(const float *a, const float *b, int n)
+{
+    return intersect_kernel(a, b, n);
+}
+
+float ssd_f32(const float *a, const float *b, int n)
+{
+    return ssd_kernel(a, b, n);
+}
+
+float intersect_gather_f32(const float *values, const int32_t *index, int n, const float *b)
+{
+    return intersect_gather_kernel(values, index, n, b);
+}
+
+void fastscan_u4(const uint8_t *codes, const uint8_t *luts, int nsub, uint16_t *sums)
+{
+    fastscan_kernel_u4(codes, luts, nsub, sums);
+}
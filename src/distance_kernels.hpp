@@ -0,0 +1,78 @@
+//**********************************************************************************************************************
+// FILE: distance_kernels.hpp
+//
+// DESCRIPTION
+// Float kernels behind compute_ssd and compute_hist_intersect_error. There is one version per
+// instruction set and the best one the host supports is picked by CPUID when the program starts,
+// so the same binary runs the AVX-512 kernels where it can and the scalar loops everywhere else.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include <cstdint>
+
+enum simd_level
+{
+  simd_scalar, // plain loops, kept as the reference for the others
+  simd_sse2,
+  simd_avx2,   // AVX2 + FMA
+  simd_avx512  // AVX-512F
+};
+
+/*
+  The best level the host supports
+ */
+simd_level detect_simd_level();
+
+/*
+  The level the kernels currently run at
+ */
+simd_level get_simd_level();
+
+/*
+  Makes the kernels run at level, or the best supported level below it.
+  Used to compare the kernels against each other, returns the level now in use.
+ */
+simd_level set_simd_level(simd_level level);
+
+/*
+  Name of level for logs, e.g. "avx2"
+ */
+const char *simd_level_name(simd_level level);
+
+/*
+  sum of min(a[i], b[i]) over n features
+ */
+float intersect_f32(const float *a, const float *b, int n);
+
+/*
+  sum of (a[i] - b[i])^2 over n features
+ */
+float ssd_f32(const float *a, const float *b, int n);
+
+/*
+  sum of min(values[i], b[index[i]]) over n entries, for a sparse a whose
+  non-zero features are values at index
+ */
+float intersect_gather_f32(const float *values, const int32_t *index, int n, const float *b);
+
+/*
+  Table lookups of the product quantization fast scan, for a block of 32 images with 4 bit codes.
+  codes holds nsub rows of 16 bytes, byte j of a row has the code of image j in its low nibble and
+  the code of image j + 16 in its high nibble. luts holds nsub tables of 16 entries.
+  @params sums the 32 sums of the entries the codes pick, saturated at 65535
+ */
+void fastscan_u4(const uint8_t *codes, const uint8_t *luts, int nsub, uint16_t *sums);
+
+/*
+  Scalar versions, whatever the level
+ */
+float intersect_f32_scalar(const float *a, const float *b, int n);
+float ssd_f32_scalar(const float *a, const float *b, int n);
+float intersect_gather_f32_scalar(const float *values, const int32_t *index, int n, const float *b);
+void fastscan_u4_scalar(const uint8_t *codes, const uint8_t *luts, int nsub, uint16_t *sums);
+
+#endif
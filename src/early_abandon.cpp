@@ -0,0 +1,295 @@
+//**********************************************************************************************************************
+// FILE: early_abandon.cpp
+//
+// DESCRIPTION
+// Contains implementation for the early abandoning block scorer
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include "early_abandon.hpp"
+#include "distance_kernels.hpp"
+
+// block sums on floats or codes, in feature values
+static inline float block_intersect(const float *a, const float *b, int n, float)
+{
+    return intersect_f32(a, b, n);
+}
+
+static inline float block_intersect(const uint8_t *a, const uint8_t *b, int n, float scale)
+{
+    return intersect_u8(a, b, n) * scale;
+}
+
+static inline float block_intersect(const uint16_t *a, const uint16_t *b, int n, float scale)
+{
+    return intersect_u16(a, b, n) * scale;
+}
+
+static inline float block_ssd(const float *a, const float *b, int n, float)
+{
+    return ssd_f32(a, b, n);
+}
+
+static inline float block_ssd(const uint8_t *a, const uint8_t *b, int n, float scale)
+{
+    return ssd_u8(a, b, n) * scale * scale;
+}
+
+static inline float block_ssd(const uint16_t *a, const uint16_t *b, int n, float scale)
+{
+    return ssd_u16(a, b, n) * scale * scale;
+}
+
+static inline float block_gather(const float *values, const int32_t *index, int n, const float *b, float)
+{
+    return intersect_gather_f32(values, index, n, b);
+}
+
+static inline float block_gather(const uint8_t *values, const int32_t *index, int n, const uint8_t *b, float scale)
+{
+    return intersect_gather_u8(values, index, n, b) * scale;
+}
+
+static inline float block_gather(const uint16_t *values, const int32_t *index, int n, const uint16_t *b, float scale)
+{
+    return intersect_gather_u16(values, index, n, b) * scale;
+}
+
+static bool heavier(const pair<float, abandon_block> &a, const pair<float, abandon_block> &b)
+{
+    return a.first > b.first || (a.first == b.first && a.second.offset < b.second.offset);
+}
+
+// cut the non-zero bins of a sparse segment into gathered blocks. The bins are taken line by line,
+// heaviest cache line first, so a block that is scored touches few lines of the image and the lines
+// where the target is empty are never read
+template <typename T>
+static void plan_sparse_segment(abandon_plan &plan, const T *ft, const fi_segment &seg,
+                                vector<pair<float, abandon_block> > &blocks)
+{
+    // 1. the lines of the segment that hold target mass, heaviest first
+    int line = FM_ALIGN / sizeof(T);
+    vector<pair<float, abandon_block> > lines;
+    for (int first = seg.offset / line * line; first < seg.offset + seg.length; first += line)
+    {
+        abandon_block l;
+        l.offset = max(first, seg.offset);
+        l.length = min(first + line, seg.offset + seg.length) - l.offset;
+        float m = 0;
+        for (int i = l.offset; i < l.offset + l.length; i++)
+        {
+            m += ft[i];
+        }
+        if (m > 0)
+        {
+            lines.push_back(make_pair(m, l));
+        }
+    }
+    sort(lines.begin(), lines.end(), heavier);
+
+    // 2. the non-zero bins of whole lines, until a block has FI_GATHER_BLOCK of them
+    for (size_t l = 0; l < lines.size();)
+    {
+        abandon_block b;
+        b.offset = plan.index.size();
+        b.length = 0;
+        b.weight = seg.weight;
+        b.metric = intersect_metric;
+        b.sparse = true;
+        b.rest = 0;
+        vector<T> values;
+        for (; l < lines.size() && b.length < FI_GATHER_BLOCK; l++)
+        {
+            for (int i = lines[l].second.offset; i < lines[l].second.offset + lines[l].second.length; i++)
+            {
+                if (ft[i] > 0)
+                {
+                    values.push_back(ft[i]);
+                    plan.index.push_back(i);
+                    b.length++;
+                }
+            }
+        }
+        plan.values.insert(plan.values.end(), (const char *)values.data(), (const char *)(values.data() + b.length));
+
+        // gathered from the target itself, so it is added up like a match
+        float m = seg.weight * block_gather(values.data(), &plan.index[b.offset], b.length, ft, plan.scale);
+        blocks.push_back(make_pair(m, b));
+    }
+}
+
+template <typename T>
+static void plan_blocks(abandon_plan &plan, const T *ft, const fi_segment *segments, int count)
+{
+    // 1. cut every segment into blocks, intersection blocks heaviest first
+    // the mass of a block is its intersection with itself, so it is added up exactly like
+    // the intersection of the block with an image and is never below it
+    vector<float> mass;
+    for (int s = 0; s < count; s++)
+    {
+        const fi_segment &seg = segments[s];
+        vector<pair<float, abandon_block> > blocks;
+        plan.dims += seg.length;
+
+        int nonzero = 0;
+        for (int i = seg.offset; i < seg.offset + seg.length; i++)
+        {
+            nonzero += ft[i] > 0;
+        }
+        if (seg.metric == intersect_metric && nonzero <= seg.length * FI_SPARSE_RATIO)
+        {
+            plan_sparse_segment(plan, ft, seg, blocks);
+        }
+        else
+        {
+            for (int offset = seg.offset; offset < seg.offset + seg.length; offset += FI_ABANDON_BLOCK)
+            {
+                abandon_block b;
+                b.offset = offset;
+                b.length = min(FI_ABANDON_BLOCK, seg.offset + seg.length - offset);
+                b.weight = seg.weight;
+                b.metric = seg.metric;
+                b.sparse = false;
+                b.rest = 0;
+                float m = 0;
+                if (seg.metric == intersect_metric)
+                {
+                    m = seg.weight * block_intersect(ft + offset, ft + offset, b.length, plan.scale);
+                }
+                blocks.push_back(make_pair(m, b));
+            }
+        }
+        if (seg.metric == intersect_metric)
+        {
+            plan.base += seg.weight;
+            stable_sort(blocks.begin(), blocks.end(), heavier);
+        }
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            mass.push_back(blocks[i].first);
+            plan.blocks.push_back(blocks[i].second);
+        }
+    }
+
+    // 2. the mass the blocks after each block can still match
+    float rest = 0;
+    for (size_t i = plan.blocks.size(); i-- > 0;)
+    {
+        plan.blocks[i].rest = rest;
+        rest += mass[i];
+    }
+}
+
+void create_abandon_plan(abandon_plan &plan, const void *ft, fi_elem_type type, float scale,
+                         const fi_segment *segments, int count)
+{
+    plan.blocks.clear();
+    plan.index.clear();
+    plan.values.clear();
+    plan.base = 0;
+    plan.dims = 0;
+    plan.type = type;
+    plan.scale = type == fi_f32 ? 1 : scale;
+    if (type == fi_u8)
+    {
+        plan_blocks(plan, (const uint8_t *)ft, segments, count);
+    }
+    else if (type == fi_u16)
+    {
+        plan_blocks(plan, (const uint16_t *)ft, segments, count);
+    }
+    else
+    {
+        plan_blocks(plan, (const float *)ft, segments, count);
+    }
+}
+
+template <typename T>
+static float bounded_distance(const abandon_plan &plan, const T *ft, const T *fi, float threshold, abandon_stats &stats)
+{
+    // the error starts at base and every matched bin takes its mass off, ssd blocks add on top
+    float dist = plan.base;
+    int scored = 0;
+    bool abandoned = false;
+    float limit = threshold + FI_ABANDON_SLACK;
+    const abandon_block *blocks = plan.blocks.data();
+    const T *values = (const T *)plan.values.data();
+    int count = plan.blocks.size();
+    for (int i = 0; i < count; i++)
+    {
+        const abandon_block &b = blocks[i];
+        if (b.sparse)
+        {
+            dist -= b.weight * block_gather(values + b.offset, &plan.index[b.offset], b.length, fi, plan.scale);
+        }
+        else if (b.metric == intersect_metric)
+        {
+            dist -= b.weight * block_intersect(ft + b.offset, fi + b.offset, b.length, plan.scale);
+        }
+        else
+        {
+            dist += b.weight * block_ssd(ft + b.offset, fi + b.offset, b.length, plan.scale);
+        }
+        scored += b.length;
+
+        // the rest of the blocks can take at most rest off
+        if (dist - b.rest > limit && i + 1 < count)
+        {
+            abandoned = true;
+            break;
+        }
+    }
+
+    // the empty target bins of sparse segments count as skipped
+    stats.rows += 1;
+    stats.dims += plan.dims;
+    stats.dims_skipped += plan.dims - scored;
+    if (abandoned)
+    {
+        stats.rows_abandoned += 1;
+        return numeric_limits<float>::infinity();
+    }
+    return dist;
+}
+
+float compute_bounded_distance(const abandon_plan &plan, const void *ft, const void *fi, float threshold, abandon_stats &stats)
+{
+    if (plan.type == fi_u8)
+    {
+        return bounded_distance(plan, (const uint8_t *)ft, (const uint8_t *)fi, threshold, stats);
+    }
+    else if (plan.type == fi_u16)
+    {
+        return bounded_distance(plan, (const uint16_t *)ft, (const uint16_t *)fi, threshold, stats);
+    }
+    return bounded_distance(plan, (const float *)ft, (const float *)fi, threshold, stats);
+}
+
+void clear_abandon_stats(abandon_stats &stats)
+{
+    stats.rows = 0;
+    stats.rows_abandoned = 0;
+    stats.dims = 0;
+    stats.dims_skipped = 0;
+}
+
+void add_abandon_stats(abandon_stats &to, const abandon_stats &from)
+{
+    to.rows += from.rows;
+    to.rows_abandoned += from.rows_abandoned;
+    to.dims += from.dims;
+    to.dims_skipped += from.dims_skipped;
+}
+
+void print_abandon_stats(const abandon_stats &stats)
+{
+    printf("Early abandon: %llu of %llu images, %llu of %llu features skipped (%.1f%%)\n",
+           (unsigned long long)stats.rows_abandoned, (unsigned long long)stats.rows,
+           (unsigned long long)stats.dims_skipped, (unsigned long long)stats.dims,
+           stats.dims ? 100.0 * stats.dims_skipped / stats.dims : 0.0);
+}
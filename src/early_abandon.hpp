@@ -0,0 +1,85 @@
+//**********************************************************************************************************************
+// FILE: early_abandon.hpp
+//
+// DESCRIPTION
+// Scoring that gives up on an image as soon as it provably cannot make the top K. The features are
+// scored in blocks and after every block a lower bound of the full distance is checked against the
+// k-th best error. SSD only grows, so its partial sum is the bound. Intersection errors can still
+// shrink by the target mass of the bins not yet scored, so those blocks are scored heaviest first.
+// A bin that is empty in the target adds nothing to an intersection, so in the segments where most
+// of the target is empty only the non-zero bins are gathered from each image.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef EARLY_ABANDON_H
+#define EARLY_ABANDON_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define FI_ABANDON_BLOCK 32     // features scored between two checks of the bound
+#define FI_ABANDON_SLACK 1e-4f  // margin for float rounding, a row is dropped when bound > threshold + slack
+#define FI_GATHER_BLOCK 16      // least non-zero bins gathered between two checks of the bound
+#define FI_SPARSE_RATIO 0.5f    // an intersection segment is gathered when at most this share of its target is non-zero
+
+struct abandon_block
+{
+  int offset; // first feature of the block, or first entry in the gathered bins if sparse
+  int length;
+  float weight;
+  segment_metric metric;
+  bool sparse; // only the non-zero target bins are compared
+  float rest;  // weighted target mass of the intersection blocks after this one
+};
+
+/*
+  The blocks of one target in the order they are scored
+ */
+struct abandon_plan
+{
+  vector<abandon_block> blocks;
+  vector<int32_t> index; // bins of the non-zero target features of the sparse blocks
+  vector<char> values;   // their values, in the elem type of the plan
+  float base;  // sum of the weights of the intersection segments, the error when nothing matches
+  int dims;    // features in all the blocks
+  fi_elem_type type;
+  float scale; // value of one code
+};
+
+/*
+  How much work early abandoning saved
+ */
+struct abandon_stats
+{
+  uint64_t rows;
+  uint64_t rows_abandoned;
+  uint64_t dims;         // features of all scored rows
+  uint64_t dims_skipped; // features never compared
+};
+
+/*
+  Splits the segments of ft into blocks, the blocks of an intersection segment are sorted by
+  their target mass, heaviest first. A sparse segment is cut into blocks of its non-zero bins,
+  ordered by target value.
+  @params ft the target, floats or codes of type
+  @params scale the value of one code
+ */
+void create_abandon_plan(abandon_plan &plan, const void *ft, fi_elem_type type, float scale,
+                         const fi_segment *segments, int count);
+
+/*
+  Distance from the target of plan to fi, the weighted segment errors summed block by block.
+  The function returns infinity as soon as the distance is sure to be above threshold.
+ */
+float compute_bounded_distance(const abandon_plan &plan, const void *ft, const void *fi, float threshold, abandon_stats &stats);
+
+void clear_abandon_stats(abandon_stats &stats);
+
+void add_abandon_stats(abandon_stats &to, const abandon_stats &from);
+
+void print_abandon_stats(const abandon_stats &stats);
+
+#endif
@@ -0,0 +1,335 @@
+//**********************************************************************************************************************
+// FILE: feature_container.cpp
+//
+// DESCRIPTION
+// Contains implementation for writing and lazily mapping the feature container
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "feature_container.hpp"
+
+// round offset up to a multiple of align
+static uint64_t align_up(uint64_t offset, uint64_t align)
+{
+    return (offset + align - 1) / align * align;
+}
+
+// write size bytes at offset, retrying short writes
+static int pwrite_all(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const char *p = (const char *)buf;
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0)
+        {
+            return (-1);
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return (0);
+}
+
+// byte offset of the end of the last row of a section, rows can be further apart than their size
+static uint64_t section_end(const fi_header &sh)
+{
+    fi_elem_type type = (fi_elem_type)sh.elem_type;
+    if (sh.count == 0)
+    {
+        return sh.data_offset;
+    }
+    return sh.data_offset + ((sh.count - 1) * sh.stride + fi_elem_stride(sh.dim, type)) * fi_elem_size(type);
+}
+
+bool is_image_data_container(const char *filepath)
+{
+    const char *ext = strrchr(filepath, '.');
+    return ext != NULL && strcmp(ext, ".fic") == 0;
+}
+
+int open_image_data_container_writer(fi_container_writer &writer, const char *filepath, const name_table &names,
+                                     const vector<int> &feature_types, const vector<int> &dims,
+                                     const vector<fi_elem_type> &elem_types, const vector<float> &scales,
+                                     fi_container_layout layout)
+{
+    size_t section_count = feature_types.size();
+    if (dims.size() != section_count || elem_types.size() != section_count || scales.size() != section_count)
+    {
+        printf("Every section of %s needs a feature type, size, element type and scale\n", filepath);
+        return (-1);
+    }
+
+    writer.fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (writer.fd < 0)
+    {
+        printf("Unable to open output file %s\n", filepath);
+        return (-1);
+    }
+    strncpy(writer.filepath, filepath, sizeof(writer.filepath) - 1);
+    writer.filepath[sizeof(writer.filepath) - 1] = '\0';
+
+    // 1. name table behind the section directory
+    fi_container_header &h = writer.header;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FI_CONTAINER_MAGIC, 4);
+    h.version = FI_CONTAINER_VERSION;
+    h.section_count = section_count;
+    h.layout = layout;
+    h.count = names.count;
+    h.names_offset = sizeof(fi_container_header) + section_count * sizeof(fi_header);
+    h.names_size = nt_chars_size(names);
+
+    // 2. every section starts on its own page so it can be mapped alone,
+    // in a record every row starts where the padded row before it ends
+    uint64_t offset = align_up(h.names_offset + nt_offsets_size(names) + h.names_size, FI_SECTION_ALIGN);
+    uint64_t records_offset = offset;
+    uint64_t record_bytes = 0;
+    for (size_t s = 0; s < section_count; s++)
+    {
+        record_bytes += fi_elem_stride(dims[s], elem_types[s]) * fi_elem_size(elem_types[s]);
+    }
+    writer.sections.assign(section_count, fi_header());
+    for (size_t s = 0; s < section_count; s++)
+    {
+        fi_header &sh = writer.sections[s];
+        memset(&sh, 0, sizeof(sh));
+        memcpy(sh.magic, FI_BIN_MAGIC, 4);
+        sh.version = FI_BIN_VERSION;
+        sh.feature_type = feature_types[s];
+        sh.dim = dims[s];
+        sh.elem_type = elem_types[s];
+        sh.scale = elem_types[s] == fi_f32 ? 1 : scales[s];
+        sh.count = h.count;
+        sh.stride = fi_elem_stride(dims[s], elem_types[s]);
+        sh.data_offset = offset;
+        sh.names_offset = h.names_offset;
+        sh.names_size = h.names_size;
+        if (layout == fi_layout_records)
+        {
+            // the padded rows are whole cache lines, so a record is a whole number of elements of any type
+            size_t row_bytes = sh.stride * fi_elem_size(elem_types[s]);
+            sh.stride = record_bytes / fi_elem_size(elem_types[s]);
+            offset += row_bytes;
+            continue;
+        }
+        offset = align_up(offset + sh.count * sh.stride * fi_elem_size(elem_types[s]), FI_SECTION_ALIGN);
+    }
+    if (layout == fi_layout_records)
+    {
+        offset = align_up(records_offset + h.count * record_bytes, FI_SECTION_ALIGN);
+    }
+    h.file_size = offset;
+    writer.rows_written.assign(section_count, 0);
+
+    // 3. everything but the payloads, the file is sized so rows can land anywhere
+    int err = pwrite_all(writer.fd, &h, sizeof(h), 0);
+    err |= pwrite_all(writer.fd, writer.sections.data(), section_count * sizeof(fi_header), sizeof(h));
+    err |= pwrite_all(writer.fd, names.offsets, nt_offsets_size(names), h.names_offset);
+    err |= pwrite_all(writer.fd, names.chars, nt_chars_size(names), h.names_offset + nt_offsets_size(names));
+    err |= ftruncate(writer.fd, h.file_size);
+    if (err)
+    {
+        printf("Unable to write header to %s\n", filepath);
+        close(writer.fd);
+        writer.fd = -1;
+        return (-1);
+    }
+    return (0);
+}
+
+int write_image_data_container_row(fi_container_writer &writer, size_t section, size_t image, const float *fi, int dim)
+{
+    if (section >= writer.sections.size() || image >= writer.header.count)
+    {
+        printf("No row %lu in section %lu of %s\n", image, section, writer.filepath);
+        return (-1);
+    }
+    const fi_header &sh = writer.sections[section];
+    if (sh.dim != (uint32_t)dim)
+    {
+        printf("Feature size %d does not match %u in section %lu of %s\n", dim, sh.dim, section, writer.filepath);
+        return (-1);
+    }
+
+    // 1. the row in the payload format with its zero padding
+    fi_elem_type type = (fi_elem_type)sh.elem_type;
+    size_t row_size = fi_elem_stride(dim, type) * fi_elem_size(type);
+    writer.row.assign(row_size, 0);
+    if (type == fi_f32)
+    {
+        memcpy(&writer.row[0], fi, dim * sizeof(float));
+    }
+    else
+    {
+        quantize_fi(fi, dim, type, sh.scale, &writer.row[0]);
+    }
+
+    // 2. straight to its place in the section
+    if (pwrite_all(writer.fd, &writer.row[0], row_size, sh.data_offset + image * sh.stride * fi_elem_size(type)))
+    {
+        printf("Unable to write features of image %lu to %s\n", image, writer.filepath);
+        return (-1);
+    }
+    writer.rows_written[section] += 1;
+    return (0);
+}
+
+int close_image_data_container_writer(fi_container_writer &writer)
+{
+    int err = 0;
+    for (size_t s = 0; s < writer.sections.size(); s++)
+    {
+        if (writer.rows_written[s] != writer.header.count)
+        {
+            printf("Section %lu of %s has %lu of %lu rows\n", s, writer.filepath, writer.rows_written[s], writer.header.count);
+            err = -1;
+        }
+    }
+    err |= close(writer.fd);
+    writer.fd = -1;
+    if (err)
+    {
+        printf("Unable to finish writing %s\n", writer.filepath);
+        return (-1);
+    }
+    printf("Wrote %lu sections of %llu images to %s\n", writer.sections.size(), (unsigned long long)writer.header.count, writer.filepath);
+    return (0);
+}
+
+int open_image_data_container(const char *filepath, feature_container &container)
+{
+    memset(&container, 0, sizeof(container));
+    container.fd = open(filepath, O_RDONLY);
+    if (container.fd < 0)
+    {
+        printf("Unable to open feature file %s\n", filepath);
+        return (-1);
+    }
+
+    // 1. the header tells how much of the front of the file to map
+    fi_container_header h;
+    struct stat st;
+    bool valid = pread(container.fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+                 fstat(container.fd, &st) == 0 &&
+                 memcmp(h.magic, FI_CONTAINER_MAGIC, 4) == 0 &&
+                 h.version == FI_CONTAINER_VERSION &&
+                 h.file_size == (uint64_t)st.st_size &&
+                 h.names_offset == sizeof(h) + h.section_count * sizeof(fi_header) &&
+                 h.count < h.file_size / sizeof(uint64_t) && h.names_size <= h.file_size &&
+                 h.names_offset + (h.count + 1) * sizeof(uint64_t) + h.names_size <= h.file_size;
+    if (!valid)
+    {
+        printf("%s is not a valid feature container\n", filepath);
+        close(container.fd);
+        return (-1);
+    }
+
+    container.map_size = h.names_offset + (h.count + 1) * sizeof(uint64_t) + h.names_size;
+    container.map = mmap(NULL, container.map_size, PROT_READ, MAP_SHARED, container.fd, 0);
+    if (container.map == MAP_FAILED)
+    {
+        printf("Unable to map feature file %s\n", filepath);
+        close(container.fd);
+        container.map = NULL;
+        return (-1);
+    }
+
+    // 2. point into the mapping
+    const char *base = (const char *)container.map;
+    container.header = (const fi_container_header *)base;
+    container.sections = (const fi_header *)(base + sizeof(fi_container_header));
+    container.name_offsets = (const uint64_t *)(base + h.names_offset);
+    container.name_chars = base + h.names_offset + (h.count + 1) * sizeof(uint64_t);
+
+    // 3. every name lookup stays in the name chars and every section has to fit in the file
+    if (!check_name_table(container.name_offsets, container.name_chars, h.count, h.names_size))
+    {
+        printf("%s has an invalid name table\n", filepath);
+        close_image_data_container(container);
+        return (-1);
+    }
+    for (uint32_t s = 0; s < h.section_count; s++)
+    {
+        const fi_header &sh = container.sections[s];
+        if (sh.elem_type > fi_u16 || sh.stride < sh.dim || sh.count != h.count || h.layout > fi_layout_records ||
+            sh.data_offset % (h.layout == fi_layout_records ? FM_ALIGN : FI_SECTION_ALIGN) != 0 ||
+            sh.stride > h.file_size || sh.data_offset > h.file_size ||
+            (sh.count > 0 && sh.stride > 0 && sh.count - 1 > h.file_size / (sh.stride * fi_elem_size((fi_elem_type)sh.elem_type))) ||
+            section_end(sh) > h.file_size)
+        {
+            printf("%s has an invalid section %u\n", filepath, s);
+            close_image_data_container(container);
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+void close_image_data_container(feature_container &container)
+{
+    if (container.map)
+    {
+        munmap(container.map, container.map_size);
+    }
+    if (container.fd >= 0)
+    {
+        close(container.fd);
+    }
+    memset(&container, 0, sizeof(container));
+    container.fd = -1;
+}
+
+int open_container_section(const feature_container &container, int feature_type, feature_store &store)
+{
+    memset(&store, 0, sizeof(store));
+    store.fd = -1;
+
+    // 1. find the section
+    const fi_header *sh = NULL;
+    for (uint32_t s = 0; s < container.header->section_count; s++)
+    {
+        if (container.sections[s].feature_type == (uint32_t)feature_type)
+        {
+            sh = &container.sections[s];
+            break;
+        }
+    }
+    if (sh == NULL)
+    {
+        printf("Feature container has no section of type %d\n", feature_type);
+        return (-1);
+    }
+
+    // 2. map only its pages, the mapping has to start on a page of this host
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = sh->data_offset / page * page;
+    uint64_t end = section_end(*sh);
+    store.map_size = end - start;
+    if (store.map_size == 0)
+    {
+        store.map_size = 1; // empty section
+    }
+    store.map = mmap(NULL, store.map_size, PROT_READ, MAP_SHARED, container.fd, start);
+    if (store.map == MAP_FAILED)
+    {
+        printf("Unable to map section of type %d\n", feature_type);
+        store.map = NULL;
+        return (-1);
+    }
+    madvise(store.map, store.map_size, MADV_SEQUENTIAL);
+
+    store.header = sh;
+    store.data = (const float *)((const char *)store.map + (sh->data_offset - start));
+    store.name_offsets = container.name_offsets;
+    store.name_chars = container.name_chars;
+    return (0);
+}
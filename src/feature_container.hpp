@@ -0,0 +1,134 @@
+//**********************************************************************************************************************
+// FILE: feature_container.hpp
+//
+// DESCRIPTION
+// One binary file holding every feature type of an image collection. The image names are stored
+// once and every feature type has its own section, so a query maps only the section it scores.
+// With the record layout the rows of an image are interleaved instead, all its feature types sit
+// side by side in one record, so a query scoring several of them reads the file in one pass. A
+// section is then every record_bytes from its first row and still views as a strided matrix.
+//
+// File layout (native byte order):
+//   fi_container_header              fixed size header
+//   fi_header[section_count]         one directory entry per feature type, same fields as a .bin header
+//   uint64_t[count + 1]              offset of every image name in the name chars
+//   char[]                           0-terminated image names
+//   section payloads                 each one starts on a FI_SECTION_ALIGN boundary, same row
+//                                    layout as the payload of a .bin file
+//   or, with the record layout:
+//   records[count]                   start on a FI_SECTION_ALIGN boundary, the padded row of every
+//                                    section in section order
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef FEATURE_CONTAINER_H
+#define FEATURE_CONTAINER_H
+
+#include <vector>
+#include "feature_store.hpp"
+using namespace std;
+
+#define FI_CONTAINER_MAGIC "FIDC"
+#define FI_CONTAINER_VERSION 1
+#define FI_SECTION_ALIGN 4096
+
+enum fi_container_layout
+{
+  fi_layout_sections, // the rows of a feature type are contiguous
+  fi_layout_records   // the rows of an image are contiguous
+};
+
+struct fi_container_header
+{
+  char magic[4];          // FI_CONTAINER_MAGIC
+  uint32_t version;       // FI_CONTAINER_VERSION
+  uint32_t section_count; // number of feature types
+  uint32_t layout;        // fi_container_layout, 0 in files from before the record layout
+  uint64_t count;         // number of images, the same in every section
+  uint64_t names_offset;  // byte offset of the name offsets table
+  uint64_t names_size;    // byte size of the name chars
+  uint64_t file_size;     // byte size of the whole file
+};
+
+/*
+  A container opened with open_image_data_container. Only the header, the section
+  directory and the name table are mapped, sections are mapped on demand.
+ */
+struct feature_container
+{
+  int fd;
+  void *map;
+  size_t map_size;
+  const fi_container_header *header;
+  const fi_header *sections;
+  const uint64_t *name_offsets;
+  const char *name_chars;
+};
+
+/*
+  Writer for a container. The image names and the size of every section are known
+  up front, so rows can be written straight to their place in any order.
+ */
+struct fi_container_writer
+{
+  int fd;
+  char filepath[256];
+  fi_container_header header;
+  vector<fi_header> sections;
+  vector<uint64_t> rows_written;
+  vector<char> row; // one padded row in the payload format
+};
+
+/*
+  Returns true if the filepath has the .fic extension of a feature container
+ */
+bool is_image_data_container(const char *filepath);
+
+/*
+  Creates (or truncates) filepath and writes the header, section directory and name table
+  @params names the names of all the images, the id of a name is its row
+  @params feature_types the feature_function of each section
+  @params dims the number of features per image of each section
+  @params elem_types how each section stores its features, see open_image_data_bin_writer
+  @params scales the value of one code of each quantized section
+  @params layout sections, or records to interleave the rows of every image
+  The function returns a non-zero value in case of an error.
+ */
+int open_image_data_container_writer(fi_container_writer &writer, const char *filepath, const name_table &names,
+                                     const vector<int> &feature_types, const vector<int> &dims,
+                                     const vector<fi_elem_type> &elem_types, const vector<float> &scales,
+                                     fi_container_layout layout = fi_layout_sections);
+
+/*
+  Writes the feature vector of image to section
+  The function returns a non-zero value in case of an error.
+ */
+int write_image_data_container_row(fi_container_writer &writer, size_t section, size_t image, const float *fi, int dim);
+
+/*
+  Checks every row was written and closes the file
+  The function returns a non-zero value in case of an error.
+ */
+int close_image_data_container_writer(fi_container_writer &writer);
+
+/*
+  Maps the header, section directory and name table of filepath
+  The function returns a non-zero value if something goes wrong.
+ */
+int open_image_data_container(const char *filepath, feature_container &container);
+
+/*
+  Unmaps a container, the sections opened from it must be closed first
+ */
+void close_image_data_container(feature_container &container);
+
+/*
+  Maps the section of feature_type into store, which then works like a mapped .bin file.
+  The store shares the name table of the container and has to be closed with
+  close_image_data_bin before the container is closed.
+  The function returns a non-zero value if there is no such section.
+ */
+int open_container_section(const feature_container &container, int feature_type, feature_store &store);
+
+#endif
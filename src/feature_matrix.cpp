@@ -0,0 +1,109 @@
+//**********************************************************************************************************************
+// FILE: feature_matrix.cpp
+//
+// DESCRIPTION
+// Contains implementation for the aligned feature matrix
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "feature_matrix.hpp"
+
+// allocate capacity rows of m.stride floats and move the existing rows over
+static int reserve_rows(feature_matrix &m, size_t capacity)
+{
+    void *block = NULL;
+    if (posix_memalign(&block, FM_ALIGN, capacity * m.stride * sizeof(float)) != 0)
+    {
+        printf("Unable to allocate %lu feature rows\n", capacity);
+        return (-1);
+    }
+    if (m.rows > 0)
+    {
+        memcpy(block, m.data, m.rows * m.stride * sizeof(float));
+    }
+    if (m.owned)
+    {
+        free(m.data);
+    }
+    m.data = (float *)block;
+    m.capacity = capacity;
+    m.owned = true;
+    return (0);
+}
+
+int create_feature_matrix(feature_matrix &m, int dim, size_t capacity)
+{
+    m.data = NULL;
+    m.rows = 0;
+    m.capacity = 0;
+    m.dim = dim;
+    m.stride = fm_stride(dim);
+    m.owned = false;
+    if (capacity > 0)
+    {
+        return reserve_rows(m, capacity);
+    }
+    return (0);
+}
+
+void view_feature_matrix(feature_matrix &m, const float *data, size_t rows, int dim, size_t stride)
+{
+    m.data = (float *)data;
+    m.rows = rows;
+    m.capacity = rows;
+    m.dim = dim;
+    m.stride = stride;
+    m.owned = false;
+}
+
+int append_feature_row(feature_matrix &m, const float *fi, int dim)
+{
+    // 1. the first row decides the dimension of an empty matrix, a block reserved for the old
+    // stride is reserved again for the new one
+    if (m.rows == 0 && m.dim != dim)
+    {
+        size_t stride = m.stride;
+        m.dim = dim;
+        m.stride = fm_stride(dim);
+        if (m.owned && m.capacity > 0 && m.stride != stride && reserve_rows(m, m.capacity))
+        {
+            return (-1);
+        }
+    }
+    if (dim != m.dim)
+    {
+        printf("Feature size %d does not match matrix size %d\n", dim, m.dim);
+        return (-1);
+    }
+
+    // 2. double the block when full
+    if (m.rows == m.capacity || !m.owned)
+    {
+        size_t capacity = m.capacity < 64 ? 64 : m.capacity * 2;
+        if (reserve_rows(m, capacity))
+        {
+            return (-1);
+        }
+    }
+
+    // 3. copy the row and clear the padding
+    float *row = fm_row(m, m.rows);
+    memcpy(row, fi, dim * sizeof(float));
+    memset(row + dim, 0, (m.stride - dim) * sizeof(float));
+    m.rows += 1;
+    return (0);
+}
+
+void free_feature_matrix(feature_matrix &m)
+{
+    if (m.owned)
+    {
+        free(m.data);
+    }
+    create_feature_matrix(m, m.dim);
+}
@@ -0,0 +1,75 @@
+//**********************************************************************************************************************
+// FILE: feature_matrix.hpp
+//
+// DESCRIPTION
+// Row-major feature matrix holding the feature vectors of all images in one 64 byte aligned block.
+// Every row starts on a 64 byte boundary, the gap between dim and stride is zero so the distance
+// functions can read whole SIMD registers at the end of a row.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef FEATURE_MATRIX_H
+#define FEATURE_MATRIX_H
+
+#include <cstddef>
+
+#define FM_ALIGN 64                         // bytes, one cache line
+#define FM_SIMD_FLOATS (FM_ALIGN / sizeof(float)) // floats in one AVX-512 register
+
+struct feature_matrix
+{
+  float *data;     // rows * stride floats, FM_ALIGN aligned
+  size_t rows;     // number of images
+  size_t capacity; // number of rows allocated
+  int dim;         // number of features per image
+  size_t stride;   // number of floats between the start of two rows
+  bool owned;      // false if data points into a mapped feature file
+};
+
+/*
+  Row stride for a vector of dim features, padded to FM_SIMD_FLOATS
+ */
+inline size_t fm_stride(int dim)
+{
+  return (dim + FM_SIMD_FLOATS - 1) / FM_SIMD_FLOATS * FM_SIMD_FLOATS;
+}
+
+/*
+  Pointer to the feature vector of image i
+ */
+inline const float *fm_row(const feature_matrix &m, size_t i)
+{
+  return m.data + i * m.stride;
+}
+
+inline float *fm_row(feature_matrix &m, size_t i)
+{
+  return m.data + i * m.stride;
+}
+
+/*
+  Initialises an empty matrix of dim features per image and reserves room for capacity rows
+  The function returns a non-zero value if the allocation fails.
+ */
+int create_feature_matrix(feature_matrix &m, int dim, size_t capacity = 0);
+
+/*
+  Makes m a non-owning view of rows already laid out with the padded stride,
+  e.g. the payload of a mapped feature file
+ */
+void view_feature_matrix(feature_matrix &m, const float *data, size_t rows, int dim, size_t stride);
+
+/*
+  Copies fi to a new row at the end of the matrix, growing the block when needed.
+  The padding of the row is set to zero.
+  The function returns a non-zero value if fi has the wrong size or the allocation fails.
+ */
+int append_feature_row(feature_matrix &m, const float *fi, int dim);
+
+/*
+  Releases the block of an owned matrix and resets m to an empty matrix
+ */
+void free_feature_matrix(feature_matrix &m);
+
+#endif
@@ -0,0 +1,333 @@
+//**********************************************************************************************************************
+// FILE: feature_store.cpp
+//
+// DESCRIPTION
+// Contains implementation for writing and memory mapping the binary feature store
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "feature_store.hpp"
+#include "csv_util.h"
+
+bool is_image_data_bin(const char *filepath)
+{
+    const char *ext = strrchr(filepath, '.');
+    return ext != NULL && strcmp(ext, ".bin") == 0;
+}
+
+int read_fi_source(const char *fi_filepath, fi_elem_type type, float scale, fi_source &source)
+{
+    memset(&source, 0, sizeof(source));
+    struct stat st;
+    if (stat(fi_filepath, &st) != 0)
+    {
+        printf("Unable to read feature file %s\n", fi_filepath);
+        return (-1);
+    }
+    source.file_size = st.st_size;
+    source.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    source.elem_type = type;
+    source.scale = scale;
+    return (0);
+}
+
+bool same_fi_source(const fi_source &a, const fi_source &b)
+{
+    return a.file_size == b.file_size && a.mtime_ns == b.mtime_ns && a.elem_type == b.elem_type && a.scale == b.scale;
+}
+
+string sidecar_filepath(const char *fi_filepath, int feature_type, const char *ext)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.%s", feature_type, ext);
+    return string(fi_filepath) + suffix;
+}
+
+// pad the file with zero bytes up to the next multiple of FI_BIN_ALIGN
+static int pad_to_alignment(FILE *fp)
+{
+    static const char zeros[FI_BIN_ALIGN] = {0};
+    long pos = ftell(fp);
+    if (pos < 0)
+    {
+        return (-1);
+    }
+    size_t pad = (FI_BIN_ALIGN - (pos % FI_BIN_ALIGN)) % FI_BIN_ALIGN;
+    if (pad > 0 && fwrite(zeros, 1, pad, fp) != pad)
+    {
+        return (-1);
+    }
+    return (0);
+}
+
+int open_image_data_bin_writer(fi_bin_writer &writer, const char *filepath, int feature_type, fi_elem_type elem_type, float scale)
+{
+    writer.fp = fopen(filepath, "wb");
+    if (!writer.fp)
+    {
+        printf("Unable to open output file %s\n", filepath);
+        return (-1);
+    }
+    strncpy(writer.filepath, filepath, sizeof(writer.filepath) - 1);
+    writer.filepath[sizeof(writer.filepath) - 1] = '\0';
+
+    // 1. placeholder header, patched on close once count and name table are known
+    memset(&writer.header, 0, sizeof(writer.header));
+    memcpy(writer.header.magic, FI_BIN_MAGIC, 4);
+    writer.header.version = FI_BIN_VERSION;
+    writer.header.feature_type = feature_type;
+    writer.header.elem_type = elem_type;
+    writer.header.scale = elem_type == fi_f32 ? 1 : scale;
+    create_name_table(writer.names);
+    if (fwrite(&writer.header, sizeof(writer.header), 1, writer.fp) != 1 || pad_to_alignment(writer.fp))
+    {
+        printf("Unable to write header to %s\n", filepath);
+        fclose(writer.fp);
+        writer.fp = NULL;
+        return (-1);
+    }
+    writer.header.data_offset = ftell(writer.fp);
+    return (0);
+}
+
+int append_image_data_bin(fi_bin_writer &writer, const char *image_filename, const float *fi, int dim)
+{
+    // 1. the first row decides the dimension of the store
+    fi_elem_type type = (fi_elem_type)writer.header.elem_type;
+    size_t elem_size = fi_elem_size(type);
+    if (writer.header.count == 0)
+    {
+        writer.header.dim = dim;
+        writer.header.stride = fi_elem_stride(dim, type);
+        writer.row.assign(writer.header.stride * elem_size, 0);
+    }
+    else if (writer.header.dim != (uint32_t)dim)
+    {
+        printf("Feature size %d of %s does not match %u in %s\n", dim, image_filename, writer.header.dim, writer.filepath);
+        return (-1);
+    }
+
+    // 2. write the row and its zero padding
+    if (type == fi_f32)
+    {
+        memcpy(&writer.row[0], fi, dim * sizeof(float));
+    }
+    else
+    {
+        quantize_fi(fi, dim, type, writer.header.scale, &writer.row[0]);
+    }
+    if (fwrite(&writer.row[0], 1, writer.row.size(), writer.fp) != writer.row.size())
+    {
+        printf("Unable to write features of %s\n", image_filename);
+        return (-1);
+    }
+
+    // 3. remember the name
+    add_name(writer.names, image_filename);
+    writer.header.count += 1;
+    return (0);
+}
+
+int close_image_data_bin_writer(fi_bin_writer &writer)
+{
+    int err = 0;
+
+    // 1. name table behind the payload
+    const name_table &names = writer.names;
+    err |= pad_to_alignment(writer.fp);
+    writer.header.names_offset = ftell(writer.fp);
+    writer.header.names_size = nt_chars_size(names);
+    err |= fwrite(names.offsets, 1, nt_offsets_size(names), writer.fp) != nt_offsets_size(names);
+    err |= fwrite(names.chars, 1, nt_chars_size(names), writer.fp) != nt_chars_size(names);
+
+    // 2. patch the header now that count and offsets are known
+    err |= fseek(writer.fp, 0, SEEK_SET) != 0;
+    err |= fwrite(&writer.header, sizeof(writer.header), 1, writer.fp) != 1;
+    err |= fclose(writer.fp) != 0;
+    writer.fp = NULL;
+
+    if (err)
+    {
+        printf("Unable to finish writing %s\n", writer.filepath);
+        return (-1);
+    }
+    printf("Wrote %llu features to %s\n", (unsigned long long)writer.header.count, writer.filepath);
+    return (0);
+}
+
+int open_image_data_bin(const char *filepath, feature_store &store)
+{
+    memset(&store, 0, sizeof(store));
+    store.fd = open(filepath, O_RDONLY);
+    if (store.fd < 0)
+    {
+        printf("Unable to open feature file %s\n", filepath);
+        return (-1);
+    }
+
+    struct stat st;
+    if (fstat(store.fd, &st) != 0 || (size_t)st.st_size < sizeof(fi_header))
+    {
+        printf("Feature file %s is too small\n", filepath);
+        close(store.fd);
+        return (-1);
+    }
+
+    store.map_size = st.st_size;
+    store.map = mmap(NULL, store.map_size, PROT_READ, MAP_SHARED, store.fd, 0);
+    if (store.map == MAP_FAILED)
+    {
+        printf("Unable to map feature file %s\n", filepath);
+        close(store.fd);
+        store.map = NULL;
+        return (-1);
+    }
+
+    // 1. validate the header against the file size, every size is bounded by the file before
+    // it is multiplied or added so a crafted header cannot wrap around
+    const char *base = (const char *)store.map;
+    store.header = (const fi_header *)base;
+    const fi_header &h = *store.header;
+    uint64_t size = store.map_size;
+    bool valid = memcmp(h.magic, FI_BIN_MAGIC, 4) == 0 &&
+                 h.version == FI_BIN_VERSION &&
+                 h.elem_type <= fi_u16 &&
+                 h.stride >= h.dim && h.stride <= size &&
+                 h.data_offset <= size && h.names_offset <= size && h.names_size <= size &&
+                 h.count < size / sizeof(uint64_t) &&
+                 h.data_offset % FI_BIN_ALIGN == 0;
+    valid = valid &&
+            (h.stride == 0 || h.count <= size / (h.stride * fi_elem_size((fi_elem_type)h.elem_type))) &&
+            h.data_offset + h.count * h.stride * fi_elem_size((fi_elem_type)h.elem_type) <= h.names_offset &&
+            h.names_offset + (h.count + 1) * sizeof(uint64_t) + h.names_size <= size;
+
+    // every name lookup stays in the name chars
+    valid = valid && check_name_table((const uint64_t *)(base + h.names_offset),
+                                      base + h.names_offset + (h.count + 1) * sizeof(uint64_t), h.count, h.names_size);
+    if (!valid)
+    {
+        printf("%s is not a valid feature file\n", filepath);
+        close_image_data_bin(store);
+        return (-1);
+    }
+
+    // 2. point into the mapping
+    store.data = (const float *)(base + h.data_offset);
+    store.name_offsets = (const uint64_t *)(base + h.names_offset);
+    store.name_chars = base + h.names_offset + (h.count + 1) * sizeof(uint64_t);
+
+    // the scan reads the payload front to back
+    madvise(store.map, store.map_size, MADV_SEQUENTIAL);
+    return (0);
+}
+
+void close_image_data_bin(feature_store &store)
+{
+    if (store.map)
+    {
+        munmap(store.map, store.map_size);
+    }
+    if (store.fd >= 0)
+    {
+        close(store.fd);
+    }
+    memset(&store, 0, sizeof(store));
+    store.fd = -1;
+}
+
+void view_image_data_bin(const feature_store &store, name_table &names)
+{
+    view_name_table(names, store.name_offsets, store.name_chars, store.header->count);
+}
+
+int view_image_data_bin(const feature_store &store, feature_matrix &m)
+{
+    if (store.header->elem_type != fi_f32)
+    {
+        printf("Feature file holds quantized features\n");
+        return (-1);
+    }
+    view_feature_matrix(m, store.data, store.header->count, store.header->dim, store.header->stride);
+    return (0);
+}
+
+int view_image_data_bin(const feature_store &store, quant_matrix &m)
+{
+    if (store.header->elem_type == fi_f32)
+    {
+        printf("Feature file holds float features\n");
+        return (-1);
+    }
+    m.data = store.data;
+    m.rows = store.header->count;
+    m.dim = store.header->dim;
+    m.stride = store.header->stride;
+    m.type = (fi_elem_type)store.header->elem_type;
+    m.scale = store.header->scale;
+    return (0);
+}
+
+int convert_csv_to_bin(char *src_csv, const char *dst_bin, int feature_type, fi_elem_type elem_type, float scale)
+{
+    name_table names;
+    create_name_table(names);
+    feature_matrix fis;
+    create_feature_matrix(fis, 0);
+    if (read_image_data_csv(src_csv, names, fis, 0))
+    {
+        return (-1);
+    }
+
+    fi_bin_writer writer;
+    int err = open_image_data_bin_writer(writer, dst_bin, feature_type, elem_type, scale);
+    for (size_t i = 0; i < fis.rows && !err; i++)
+    {
+        err = append_image_data_bin(writer, nt_name(names, i), fm_row(fis, i), fis.dim);
+    }
+    if (writer.fp)
+    {
+        err |= close_image_data_bin_writer(writer);
+    }
+
+    free_feature_matrix(fis);
+    return (err);
+}
+
+int convert_bin_to_csv(const char *src_bin, const char *dst_csv)
+{
+    feature_store store;
+    if (open_image_data_bin(src_bin, store))
+    {
+        return (-1);
+    }
+
+    csv_writer writer;
+    int err = open_image_data_csv_writer(writer, dst_csv);
+    if (err)
+    {
+        close_image_data_bin(store);
+        return (-1);
+    }
+    const fi_header &h = *store.header;
+    vector<float> fi(h.dim);
+    for (size_t i = 0; i < h.count && !err; i++)
+    {
+        const float *row = fi_row(store, i);
+        if (h.elem_type != fi_f32)
+        {
+            dequantize_fi(fi_row_elems(store, i), h.dim, (fi_elem_type)h.elem_type, h.scale, fi.data());
+            row = fi.data();
+        }
+        err = append_image_data_csv(writer, fi_name(store, i), row, h.dim);
+    }
+    err |= close_image_data_csv_writer(writer);
+    close_image_data_bin(store);
+    return (err);
+}
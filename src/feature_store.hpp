@@ -0,0 +1,199 @@
+//**********************************************************************************************************************
+// FILE: feature_store.hpp
+//
+// DESCRIPTION
+// Binary on-disk feature store. compute_fis writes it and get_top_n maps it into memory so a query
+// can scan the feature vectors directly without parsing. The CSV files stay as import/export format.
+//
+// File layout (native byte order):
+//   fi_header                        fixed size header
+//   elem[count][stride]              feature payload, starts on a 64 byte boundary, rows padded
+//                                    with zeros to 64 bytes. elem is a float, or a uint8/uint16
+//                                    code standing for code * scale
+//   uint64_t[count + 1]              offset of every image name in the name chars
+//   char[]                           0-terminated image names
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include "feature_matrix.hpp"
+#include "quantize.hpp"
+#include "name_table.hpp"
+using namespace std;
+
+#define FI_BIN_MAGIC "FIDB"
+#define FI_BIN_VERSION 2
+#define FI_BIN_ALIGN 64
+
+struct fi_header
+{
+  char magic[4];         // FI_BIN_MAGIC
+  uint32_t version;      // FI_BIN_VERSION
+  uint32_t feature_type; // feature_function used to compute the vectors
+  uint32_t dim;          // number of features per image
+  uint32_t elem_type;    // fi_elem_type of the payload
+  float scale;           // value of one code of a quantized payload
+  uint64_t count;        // number of images
+  uint64_t stride;       // number of elements between the start of two rows
+  uint64_t data_offset;  // byte offset of the feature payload
+  uint64_t names_offset; // byte offset of the name offsets table
+  uint64_t names_size;   // byte size of the name chars
+};
+
+/*
+  A feature file mapped into memory with open_image_data_bin.
+  The pointers stay valid until close_image_data_bin is called.
+ */
+struct feature_store
+{
+  int fd;
+  void *map;
+  size_t map_size;
+  const fi_header *header;
+  const float *data;
+  const uint64_t *name_offsets;
+  const char *name_chars;
+};
+
+/*
+  The payload an index file next to a feature file was built from. A feature file rewritten
+  with the same number of images gets another size or modification time, and a different
+  quantization another elem type or scale, so an index is only reused while its source is the same.
+ */
+struct fi_source
+{
+  uint64_t file_size;
+  int64_t mtime_ns;   // modification time of the feature file
+  uint32_t elem_type; // fi_elem_type of the rows
+  float scale;
+};
+
+/*
+  Reads the source of rows of type and scale held by the feature file at fi_filepath
+  The function returns a non-zero value if the file is missing.
+ */
+int read_fi_source(const char *fi_filepath, fi_elem_type type, float scale, fi_source &source);
+
+/*
+  Returns true if both sources are the same payload
+ */
+bool same_fi_source(const fi_source &a, const fi_source &b);
+
+/*
+  Path of an index of the feature_type rows of a feature file, <fi_filepath>.<feature_type>.<ext>
+  so every section of a container has its own
+ */
+string sidecar_filepath(const char *fi_filepath, int feature_type, const char *ext);
+
+/*
+  Streaming writer used by compute_fis. Rows are appended one by one, the name table
+  is kept in memory and written behind the payload on close.
+ */
+struct fi_bin_writer
+{
+  FILE *fp;
+  char filepath[256];
+  fi_header header;
+  vector<char> row;      // one padded row in the payload format
+  name_table names;
+};
+
+/*
+  Returns true if the filepath has the .bin extension of the binary feature store
+ */
+bool is_image_data_bin(const char *filepath);
+
+/*
+  Creates (or truncates) filepath and writes a placeholder header
+  @params writer the writer state
+  @params filepath the binary feature file to write
+  @params feature_type the feature_function used to compute the vectors
+  @params elem_type fi_f32 to store the floats, fi_u8 or fi_u16 to store quantized codes
+  @params scale value of one code when elem_type is quantized
+  The function returns a non-zero value in case of an error.
+ */
+int open_image_data_bin_writer(fi_bin_writer &writer, const char *filepath, int feature_type, fi_elem_type elem_type = fi_f32, float scale = 1);
+
+/*
+  Appends the feature vector of one image, quantized if the store is. All the vectors must have the same size.
+  The function returns a non-zero value in case of an error.
+ */
+int append_image_data_bin(fi_bin_writer &writer, const char *image_filename, const float *fi, int dim);
+
+/*
+  Writes the name table, patches the header and closes the file.
+  The function returns a non-zero value in case of an error.
+ */
+int close_image_data_bin_writer(fi_bin_writer &writer);
+
+/*
+  Maps filepath into memory and validates the header. No parsing and no per-row allocation
+  is done, the rows are read straight from the mapping.
+  The function returns a non-zero value if something goes wrong.
+ */
+int open_image_data_bin(const char *filepath, feature_store &store);
+
+/*
+  Unmaps a store opened by open_image_data_bin
+ */
+void close_image_data_bin(feature_store &store);
+
+/*
+  Pointer to the feature vector of image i of a float store
+ */
+inline const float *fi_row(const feature_store &store, size_t i)
+{
+  return store.data + i * store.header->stride;
+}
+
+/*
+  Pointer to the elements of image i of a store of any elem_type
+ */
+inline const void *fi_row_elems(const feature_store &store, size_t i)
+{
+  return (const char *)store.data + i * store.header->stride * fi_elem_size((fi_elem_type)store.header->elem_type);
+}
+
+/*
+  0-terminated name of image i
+ */
+inline const char *fi_name(const feature_store &store, size_t i)
+{
+  return store.name_chars + store.name_offsets[i];
+}
+
+/*
+  Makes names a view of the name table of the store
+ */
+void view_image_data_bin(const feature_store &store, name_table &names);
+
+/*
+  Makes m a view of the payload of the store, the rows are used in place
+  The function returns a non-zero value if the store does not hold that kind of rows.
+ */
+int view_image_data_bin(const feature_store &store, feature_matrix &m);
+int view_image_data_bin(const feature_store &store, quant_matrix &m);
+
+/*
+  Imports a CSV feature file written by append_image_data_csv into the binary store,
+  quantized with elem_type and scale like open_image_data_bin_writer
+  The function returns a non-zero value if something goes wrong.
+ */
+int convert_csv_to_bin(char *src_csv, const char *dst_bin, int feature_type, fi_elem_type elem_type = fi_f32, float scale = 1);
+
+/*
+  Exports a binary feature store to the CSV format read by read_image_data_csv
+  Quantized stores are written as code * scale.
+  The function returns a non-zero value if something goes wrong.
+ */
+int convert_bin_to_csv(const char *src_bin, const char *dst_csv);
+
+#endif
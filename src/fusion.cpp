@@ -0,0 +1,306 @@
+//**********************************************************************************************************************
+// FILE: fusion.cpp
+//
+// DESCRIPTION
+// Contains implementation for the threshold algorithm over the feature lists and the single pass
+// fused scan
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "fusion.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+// an image in the queue of a list, key is a lower bound of its distance until exact is set
+struct fusion_entry
+{
+    float key;
+    uint32_t id;
+    bool exact;
+};
+
+// min-heap order, equal keys by id
+static inline bool entry_after(const fusion_entry &a, const fusion_entry &b)
+{
+    return a.key > b.key || (a.key == b.key && a.id > b.id);
+}
+
+// sorted and random access to one list for one target
+struct fusion_cursor
+{
+    const fusion_list *list;
+    vector<uint16_t> codes; // room for u8 or u16 codes
+    const void *target;
+    abandon_plan plan;
+    vector<float> coarse[PYRAMID_LEVELS];
+    vector<fusion_entry> queue;
+    vector<float> dist; // NAN until the image is scored
+    float last;         // distance of the last image out of the list
+    uint64_t scored;
+    abandon_stats stats;
+};
+
+// full distance of image id on the list of c, scored once
+static float fusion_distance(fusion_cursor &c, uint32_t id)
+{
+    if (std::isnan(c.dist[id]))
+    {
+        c.dist[id] = compute_bounded_distance(c.plan, c.target, fr_row(c.list->rows, id), numeric_limits<float>::infinity(), c.stats);
+        c.scored += 1;
+    }
+    return c.dist[id];
+}
+
+static void open_cursor(fusion_cursor &c, const fusion_list &list, const vector<float> &ft)
+{
+    const fi_rows &m = list.rows;
+    c.list = &list;
+    c.last = 0;
+    c.scored = 0;
+    clear_abandon_stats(c.stats);
+    c.dist.assign(m.rows, NAN);
+
+    // 1. the target as stored, its codes for the full rows and their values for the levels
+    vector<float> values;
+    const float *target_values = ft.data();
+    c.target = ft.data();
+    if (m.type != fi_f32)
+    {
+        c.codes.resize(m.dim);
+        values.resize(m.dim);
+        quantize_fi(ft.data(), m.dim, m.type, m.scale, c.codes.data());
+        dequantize_fi(c.codes.data(), m.dim, m.type, m.scale, values.data());
+        c.target = c.codes.data();
+        target_values = values.data();
+    }
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(list.func, m.dim, segments);
+    create_abandon_plan(c.plan, c.target, m.type, m.scale, segments, count);
+
+    // 2. every image queued by the bound of its 64 bin level, or by its distance without a pyramid
+    c.queue.resize(m.rows);
+    if (list.pyramid)
+    {
+        float *out[PYRAMID_LEVELS];
+        for (int l = 0; l < PYRAMID_LEVELS; l++)
+        {
+            c.coarse[l].resize(list.pyramid->level_dims[l]);
+            out[l] = c.coarse[l].data();
+        }
+        sum_pyramid_levels(*list.pyramid, target_values, out);
+    }
+    int l = PYRAMID_LEVELS - 1;
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        fusion_entry e = {0, (uint32_t)i, list.pyramid == NULL};
+        e.key = e.exact ? fusion_distance(c, i) : pyramid_level_bound(*list.pyramid, l, c.coarse[l].data(), i) - FI_ABANDON_SLACK;
+        c.queue[i] = e;
+    }
+    make_heap(c.queue.begin(), c.queue.end(), entry_after);
+}
+
+// the next image of the list by distance, false once the list is empty
+static bool next_sorted(fusion_cursor &c, uint32_t &id)
+{
+    while (!c.queue.empty())
+    {
+        pop_heap(c.queue.begin(), c.queue.end(), entry_after);
+        fusion_entry &e = c.queue.back();
+
+        // a distance below every bound left is the next in order
+        if (e.exact)
+        {
+            id = e.id;
+            c.last = e.key;
+            c.queue.pop_back();
+            return true;
+        }
+
+        // a bound goes back with the distance
+        e.key = fusion_distance(c, e.id);
+        e.exact = true;
+        push_heap(c.queue.begin(), c.queue.end(), entry_after);
+    }
+    return false;
+}
+
+// the lists and targets agree on the images and their sizes
+static bool check_fusion_lists(const vector<fusion_list> &lists, const vector<vector<vector<float> > > &fts)
+{
+    if (lists.empty() || fts.size() != lists.size())
+    {
+        printf("%lu target lists for %lu features\n", fts.size(), lists.size());
+        return false;
+    }
+    size_t rows = lists[0].rows.rows;
+    size_t targets = fts[0].size();
+    for (size_t l = 0; l < lists.size(); l++)
+    {
+        if (lists[l].rows.rows != rows || fts[l].size() != targets || lists[l].weight < 0 ||
+            (lists[l].pyramid && (lists[l].pyramid->count != rows || lists[l].pyramid->dim != lists[l].rows.dim)))
+        {
+            printf("Feature %d does not match the other features\n", lists[l].func);
+            return false;
+        }
+        for (size_t q = 0; q < targets; q++)
+        {
+            if ((int)fts[l][q].size() != lists[l].rows.dim)
+            {
+                printf("Feature size %d does not match target size %lu\n", lists[l].rows.dim, fts[l][q].size());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+vector<vector<fi_match> > search_fused(const vector<fusion_list> &lists, const vector<vector<vector<float> > > &fts, int k)
+{
+    vector<vector<fi_match> > result;
+    if (!check_fusion_lists(lists, fts))
+    {
+        return result;
+    }
+    size_t rows = lists[0].rows.rows;
+    size_t targets = fts[0].size();
+
+    // one target per task
+    result.resize(targets);
+    vector<uint64_t> seen_images(targets);
+    vector<uint64_t> scored(targets);
+    shared_thread_pool().run(targets, [&](size_t q, int) {
+        vector<fusion_cursor> cursors(lists.size());
+        for (size_t l = 0; l < lists.size(); l++)
+        {
+            open_cursor(cursors[l], lists[l], fts[l][q]);
+        }
+
+        // 1. read every list a block at a time, an image seen for the first time is scored on
+        // all the features
+        topk top_n;
+        create_topk(top_n, k);
+        vector<char> seen(rows, 0);
+        size_t seen_count = 0;
+        while (seen_count < rows)
+        {
+            for (size_t l = 0; l < cursors.size(); l++)
+            {
+                uint32_t id;
+                for (int b = 0; b < FUSION_BLOCK && next_sorted(cursors[l], id); b++)
+                {
+                    if (seen[id])
+                    {
+                        continue;
+                    }
+                    seen[id] = 1;
+                    seen_count += 1;
+                    float fused = 0;
+                    for (size_t m = 0; m < cursors.size(); m++)
+                    {
+                        fused += lists[m].weight * fusion_distance(cursors[m], id);
+                    }
+                    topk_push(top_n, id, fused);
+                }
+            }
+
+            // 2. an image not seen yet is at least as far as the last image of every list, so
+            // once the k-th best is below that no image left can get in
+            float threshold = 0;
+            for (size_t l = 0; l < cursors.size(); l++)
+            {
+                threshold += lists[l].weight * cursors[l].last;
+            }
+            if (topk_threshold(top_n) < threshold)
+            {
+                break;
+            }
+        }
+        result[q] = topk_sorted(top_n);
+        seen_images[q] = seen_count;
+        scored[q] = 0;
+        for (size_t l = 0; l < cursors.size(); l++)
+        {
+            scored[q] += cursors[l].scored;
+        }
+    });
+
+    uint64_t total_seen = 0;
+    uint64_t total_scored = 0;
+    for (size_t q = 0; q < targets; q++)
+    {
+        total_seen += seen_images[q];
+        total_scored += scored[q];
+    }
+    double per_target = targets ? (double)targets : 1.0;
+    printf("Fusion: saw %.1f of %lu images per target, scored %.1f%% of the image features\n",
+           total_seen / per_target, rows, rows ? 100.0 * total_scored / (per_target * rows * lists.size()) : 0.0);
+    return result;
+}
+
+vector<vector<fi_match> > scan_fused(const vector<fusion_list> &lists, const vector<vector<vector<float> > > &fts, int k)
+{
+    if (!check_fusion_lists(lists, fts))
+    {
+        return vector<vector<fi_match> >();
+    }
+    size_t rows = lists[0].rows.rows;
+    size_t targets = fts[0].size();
+
+    // 1. every target as stored in every list, with its plan
+    vector<vector<vector<uint16_t> > > codes(lists.size(), vector<vector<uint16_t> >(targets)); // room for u8 or u16 codes
+    vector<vector<const void *> > stored(lists.size(), vector<const void *>(targets));
+    vector<vector<abandon_plan> > plans(lists.size(), vector<abandon_plan>(targets));
+    size_t record_bytes = 0;
+    for (size_t l = 0; l < lists.size(); l++)
+    {
+        const fi_rows &m = lists[l].rows;
+        fi_segment segments[FI_MAX_SEGMENTS];
+        int count = get_feature_segments(lists[l].func, m.dim, segments);
+        for (size_t q = 0; q < targets; q++)
+        {
+            stored[l][q] = fts[l][q].data();
+            if (m.type != fi_f32)
+            {
+                codes[l][q].resize(m.dim);
+                quantize_fi(fts[l][q].data(), m.dim, m.type, m.scale, codes[l][q].data());
+                stored[l][q] = codes[l][q].data();
+            }
+            create_abandon_plan(plans[l][q], stored[l][q], m.type, m.scale, segments, count);
+        }
+        record_bytes += fi_elem_stride(m.dim, m.type) * fi_elem_size(m.type);
+    }
+
+    // 2. one pass over the images, every feature of an image is scored against what the sum
+    // so far leaves of the k-th best fused error
+    vector<abandon_stats> stats(shared_thread_pool().size());
+    for (size_t w = 0; w < stats.size(); w++)
+    {
+        clear_abandon_stats(stats[w]);
+    }
+    vector<vector<fi_match> > result = parallel_top_k_batch(rows, record_bytes, targets, k, [&](size_t q, size_t i, float threshold, int worker) {
+        float fused = 0;
+        for (size_t l = 0; l < lists.size() && fused <= threshold; l++)
+        {
+            const fusion_list &list = lists[l];
+            if (list.weight == 0)
+            {
+                continue;
+            }
+            float left = (threshold - fused) / list.weight;
+            fused += list.weight * compute_bounded_distance(plans[l][q], stored[l][q], fr_row(list.rows, i), left, stats[worker]);
+        }
+        return fused;
+    });
+
+    for (size_t w = 1; w < stats.size(); w++)
+    {
+        add_abandon_stats(stats[0], stats[w]);
+    }
+    print_abandon_stats(stats[0]);
+    return result;
+}
@@ -0,0 +1,57 @@
+//**********************************************************************************************************************
+// FILE: fusion.hpp
+//
+// DESCRIPTION
+// Exact top K of a weighted sum of the distances of several features, by Fagin's threshold
+// algorithm. Every feature is a list the images come out of in order of their distance to the
+// target (sorted access), and an image seen in one list is scored on the other features at once
+// (random access). The weighted sum of the last distance read from every list is a bound no image
+// not seen yet can beat, so the lists are read a block at a time until the k-th best fused error
+// is below it. A list is kept in order without scoring all its images, every image is queued by
+// the bound of its 64 bin pyramid level and only scored in full once that bound comes up first.
+// Features without a pyramid are scored in full up front.
+//
+// On a container with the record layout every image keeps all its features in one record, so
+// the fused distance is scored in one pass over the records instead, reading each once in order.
+// A feature is abandoned once the weighted sum so far cannot beat the k-th best fused error.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <vector>
+#include "compute.hpp"
+#include "histogram_pyramid.hpp"
+using namespace std;
+
+#define FUSION_BLOCK 16 // sorted accesses of every list between two checks of the threshold
+
+/*
+  One feature of the fused distance, the rows of every list are the same images
+ */
+struct fusion_list
+{
+  fi_rows rows;
+  feature_function func;
+  float weight;
+  const histogram_pyramid *pyramid; // levels of rows, NULL if the feature has none
+};
+
+/*
+  Exact top k of every target by the weighted sum of the list distances, the targets are
+  spread over the shared thread pool. Prints how many images and distances a target took.
+  @params fts fts[l][q] is target q computed with the function of list l
+  The function returns the k matches with the minimum fused errors of every target, best first.
+ */
+vector<vector<fi_match> > search_fused(const vector<fusion_list> &lists, const vector<vector<vector<float> > > &fts, int k);
+
+/*
+  Same in one sequential pass over the images, scoring every feature of an image before the
+  next one, the rows are spread over the shared thread pool. Meant for the record layout of a
+  container, where the features of an image are next to each other. The pyramids are not used.
+ */
+vector<vector<fi_match> > scan_fused(const vector<fusion_list> &lists, const vector<vector<vector<float> > > &fts, int k);
+
+#endif
@@ -0,0 +1,402 @@
+//**********************************************************************************************************************
+// FILE: histogram_pyramid.cpp
+//
+// DESCRIPTION
+// Contains implementation for summing and searching the coarse histogram levels
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "histogram_pyramid.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+// coarse bin of bin i of a segment of length n, the channels of level l have 2^(l + 1) bins
+static int coarse_bin(int i, int n, int l)
+{
+    int shift = PYRAMID_LEVELS - l;
+    int side = PYRAMID_SIDE >> shift;
+    if (n == PYRAMID_SIDE * PYRAMID_SIDE * PYRAMID_SIDE)
+    {
+        int r = i / (PYRAMID_SIDE * PYRAMID_SIDE);
+        int g = i / PYRAMID_SIDE % PYRAMID_SIDE;
+        int b = i % PYRAMID_SIDE;
+        return ((r >> shift) * side + (g >> shift)) * side + (b >> shift);
+    }
+    if (n == PYRAMID_SIDE * PYRAMID_SIDE)
+    {
+        int a = i / PYRAMID_SIDE;
+        int b = i % PYRAMID_SIDE;
+        return (a >> shift) * side + (b >> shift);
+    }
+    return 0;
+}
+
+// coarse bins of a segment of length n on level l
+static int coarse_size(int n, int l)
+{
+    int side = PYRAMID_SIDE >> (PYRAMID_LEVELS - l);
+    if (n == PYRAMID_SIDE * PYRAMID_SIDE * PYRAMID_SIDE)
+    {
+        return side * side * side;
+    }
+    return n == PYRAMID_SIDE * PYRAMID_SIDE ? side * side : 1;
+}
+
+int create_histogram_pyramid(histogram_pyramid &pyr, feature_function func, int dim)
+{
+    pyr.dim = dim;
+    pyr.count = 0;
+    pyr.func = func;
+    pyr.segment_count = get_feature_segments(func, dim, pyr.segments);
+    pyr.level_segment_count = 0;
+    memset(&pyr.source, 0, sizeof(pyr.source));
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        pyr.level_dims[l] = 0;
+        pyr.bin_maps[l].assign(dim, -1);
+        pyr.levels[l].clear();
+    }
+
+    // every intersection segment gets its own run of coarse bins on every level
+    for (int s = 0; s < pyr.segment_count; s++)
+    {
+        const fi_segment &seg = pyr.segments[s];
+        if (seg.metric != intersect_metric)
+        {
+            continue;
+        }
+        for (int l = 0; l < PYRAMID_LEVELS; l++)
+        {
+            fi_segment &coarse = pyr.level_segments[l][pyr.level_segment_count];
+            coarse.offset = pyr.level_dims[l];
+            coarse.length = coarse_size(seg.length, l);
+            coarse.weight = seg.weight;
+            coarse.metric = intersect_metric;
+            for (int i = 0; i < seg.length; i++)
+            {
+                pyr.bin_maps[l][seg.offset + i] = coarse.offset + coarse_bin(i, seg.length, l);
+            }
+            pyr.level_dims[l] += coarse.length;
+        }
+        pyr.level_segment_count += 1;
+    }
+    if (pyr.level_segment_count == 0)
+    {
+        printf("Feature %d has no histograms to sum into a pyramid\n", func);
+        return -1;
+    }
+    return 0;
+}
+
+void sum_pyramid_levels(const histogram_pyramid &pyr, const float *fi, float *const *out)
+{
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        const int32_t *map = pyr.bin_maps[l].data();
+        float *row = out[l];
+        fill(row, row + pyr.level_dims[l], 0.0f);
+        for (int i = 0; i < pyr.dim; i++)
+        {
+            if (map[i] >= 0)
+            {
+                row[map[i]] += fi[i];
+            }
+        }
+    }
+}
+
+void add_pyramid_row(histogram_pyramid &pyr, const float *fi, fi_elem_type type, float scale)
+{
+    // the bound has to hold for the stored values, so codes are summed as they will be read
+    vector<float> values;
+    if (type != fi_f32)
+    {
+        vector<uint16_t> codes(pyr.dim); // room for u8 or u16 codes
+        values.resize(pyr.dim);
+        quantize_fi(fi, pyr.dim, type, scale, codes.data());
+        dequantize_fi(codes.data(), pyr.dim, type, scale, values.data());
+        fi = values.data();
+    }
+    float *out[PYRAMID_LEVELS];
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        pyr.levels[l].resize((pyr.count + 1) * pyr.level_dims[l]);
+        out[l] = &pyr.levels[l][pyr.count * pyr.level_dims[l]];
+    }
+    sum_pyramid_levels(pyr, fi, out);
+    pyr.count += 1;
+}
+
+static int build_pyramid(histogram_pyramid &pyr, const fi_rows &m, feature_function func)
+{
+    if (create_histogram_pyramid(pyr, func, m.dim))
+    {
+        return -1;
+    }
+    pyr.count = m.rows;
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        pyr.levels[l].resize(m.rows * pyr.level_dims[l]);
+    }
+
+    // the rows are independent, one chunk of them per task
+    size_t chunk = 1024;
+    shared_thread_pool().run((m.rows + chunk - 1) / chunk, [&](size_t task, int) {
+        vector<float> scratch(m.dim);
+        size_t end = min(m.rows, (task + 1) * chunk);
+        for (size_t i = task * chunk; i < end; i++)
+        {
+            float *out[PYRAMID_LEVELS];
+            for (int l = 0; l < PYRAMID_LEVELS; l++)
+            {
+                out[l] = &pyr.levels[l][i * pyr.level_dims[l]];
+            }
+            sum_pyramid_levels(pyr, fr_values(m, i, scratch.data()), out);
+        }
+    });
+    return 0;
+}
+
+int build_histogram_pyramid(histogram_pyramid &pyr, const feature_matrix &fis, feature_function func)
+{
+    return build_pyramid(pyr, view_rows(fis), func);
+}
+
+int build_histogram_pyramid(histogram_pyramid &pyr, const quant_matrix &fis, feature_function func)
+{
+    return build_pyramid(pyr, view_rows(fis), func);
+}
+
+float pyramid_level_bound(const histogram_pyramid &pyr, int l, const float *target, size_t i)
+{
+    // the coarse intersection errors run on the same kernels as the full ones
+    const float *row = &pyr.levels[l][i * pyr.level_dims[l]];
+    float bound = 0;
+    for (int s = 0; s < pyr.level_segment_count; s++)
+    {
+        const fi_segment &seg = pyr.level_segments[l][s];
+        bound += seg.weight * compute_hist_intersect_error(target + seg.offset, row + seg.offset, seg.length);
+    }
+    return bound;
+}
+
+static vector<vector<fi_match> > search_pyramid(const histogram_pyramid &pyr, const fi_rows &m, const vector<vector<float> > &fts, int k)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != pyr.dim || m.rows != pyr.count)
+    {
+        printf("Pyramid of %lu x %d does not match %lu x %d features\n", pyr.count, pyr.dim, m.rows, m.dim);
+        return result;
+    }
+
+    // one target per task, scored like the full scan so the errors are the same
+    vector<uint64_t> bounded(fts.size());
+    vector<abandon_stats> stats(fts.size());
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        // 1. the target as stored, its codes for the full rows and their values for the levels
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        vector<float> values;
+        const void *target = fts[q].data();
+        const float *target_values = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            values.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            dequantize_fi(codes.data(), m.dim, m.type, m.scale, values.data());
+            target = codes.data();
+            target_values = values.data();
+        }
+        vector<float> coarse[PYRAMID_LEVELS];
+        float *out[PYRAMID_LEVELS];
+        for (int l = 0; l < PYRAMID_LEVELS; l++)
+        {
+            coarse[l].resize(pyr.level_dims[l]);
+            out[l] = coarse[l].data();
+        }
+        sum_pyramid_levels(pyr, target_values, out);
+        abandon_plan plan;
+        create_abandon_plan(plan, target, m.type, m.scale, pyr.segments, pyr.segment_count);
+
+        // 2. every image bounded on the coarsest level, the k lowest bounds are scored first
+        // so the threshold is tight before the rest are visited
+        vector<pair<float, uint32_t> > order(pyr.count);
+        for (size_t i = 0; i < pyr.count; i++)
+        {
+            order[i] = make_pair(pyramid_level_bound(pyr, 0, coarse[0].data(), i), (uint32_t)i);
+        }
+        if ((size_t)k < order.size())
+        {
+            nth_element(order.begin(), order.begin() + k, order.end());
+        }
+
+        // 3. the finer level rules out more images before their full rows are read
+        topk top_n;
+        create_topk(top_n, k);
+        clear_abandon_stats(stats[q]);
+        bounded[q] = 0;
+        for (size_t j = 0; j < order.size(); j++)
+        {
+            float threshold = topk_threshold(top_n);
+            if (order[j].first > threshold + FI_ABANDON_SLACK)
+            {
+                continue;
+            }
+            uint32_t id = order[j].second;
+            bounded[q] += 1;
+            if (pyramid_level_bound(pyr, PYRAMID_LEVELS - 1, coarse[PYRAMID_LEVELS - 1].data(), id) > threshold + FI_ABANDON_SLACK)
+            {
+                continue;
+            }
+            topk_push(top_n, id, compute_bounded_distance(plan, target, fr_row(m, id), threshold, stats[q]));
+        }
+        result[q] = topk_sorted(top_n);
+    });
+
+    uint64_t total_bounded = 0;
+    abandon_stats total;
+    clear_abandon_stats(total);
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        total_bounded += bounded[q];
+        add_abandon_stats(total, stats[q]);
+    }
+    double targets = fts.empty() ? 1.0 : (double)fts.size();
+    double full = (double)pyr.count * pyr.dim * targets;
+    double compared = (double)pyr.count * pyr.level_dims[0] * targets + (double)total_bounded * pyr.level_dims[PYRAMID_LEVELS - 1] +
+                      (double)(total.dims - total.dims_skipped);
+    printf("Pyramid: %.1f of %lu images past the %d bin bound, %.1f scored in full, %.1f%% of the bin comparisons\n",
+           total_bounded / targets, pyr.count, pyr.level_dims[0], total.rows / targets, full > 0 ? 100.0 * compared / full : 0.0);
+    return result;
+}
+
+vector<vector<fi_match> > search_histogram_pyramid(const histogram_pyramid &pyr, const feature_matrix &fis,
+                                                   const vector<vector<float> > &fts, int k)
+{
+    return search_pyramid(pyr, view_rows(fis), fts, k);
+}
+
+vector<vector<fi_match> > search_histogram_pyramid(const histogram_pyramid &pyr, const quant_matrix &fis,
+                                                   const vector<vector<float> > &fts, int k)
+{
+    return search_pyramid(pyr, view_rows(fis), fts, k);
+}
+
+vector<vector<fi_match> > shortlist_histogram_pyramid(const histogram_pyramid &pyr, const vector<vector<float> > &fts, int n)
+{
+    vector<vector<fi_match> > result(fts.size());
+    int l = PYRAMID_LEVELS - 1;
+
+    // the finer coarse level of every image against the level of the target, one target per task
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        if ((int)fts[q].size() != pyr.dim)
+        {
+            return;
+        }
+        vector<float> coarse[PYRAMID_LEVELS];
+        float *out[PYRAMID_LEVELS];
+        for (int c = 0; c < PYRAMID_LEVELS; c++)
+        {
+            coarse[c].resize(pyr.level_dims[c]);
+            out[c] = coarse[c].data();
+        }
+        sum_pyramid_levels(pyr, fts[q].data(), out);
+        topk top_n;
+        create_topk(top_n, n);
+        for (size_t i = 0; i < pyr.count; i++)
+        {
+            topk_push(top_n, i, pyramid_level_bound(pyr, l, coarse[l].data(), i));
+        }
+        result[q] = topk_sorted(top_n);
+    });
+    return result;
+}
+
+string pyramid_filepath(const char *fi_filepath, feature_function func)
+{
+    return sidecar_filepath(fi_filepath, func, "pyr");
+}
+
+int save_histogram_pyramid(const histogram_pyramid &pyr, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open pyramid file %s\n", filepath);
+        return -1;
+    }
+    pyramid_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PYRAMID_MAGIC, 4);
+    h.version = PYRAMID_VERSION;
+    h.feature_type = pyr.func;
+    h.dim = pyr.dim;
+    h.count = pyr.count;
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        h.level_dims[l] = pyr.level_dims[l];
+    }
+    h.source = pyr.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    for (int l = 0; l < PYRAMID_LEVELS; l++)
+    {
+        err |= fwrite(pyr.levels[l].data(), sizeof(float), pyr.levels[l].size(), fp) != pyr.levels[l].size();
+    }
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write pyramid file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_histogram_pyramid(const char *filepath, histogram_pyramid &pyr)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open pyramid file %s\n", filepath);
+        return -1;
+    }
+
+    // the bin maps are not stored, they follow from the feature and must give the same levels
+    pyramid_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, PYRAMID_MAGIC, 4) == 0 &&
+                 h.version == PYRAMID_VERSION && h.dim > 0 &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 create_histogram_pyramid(pyr, (feature_function)h.feature_type, h.dim) == 0;
+    uint64_t row_size = 0;
+    for (int l = 0; valid && l < PYRAMID_LEVELS; l++)
+    {
+        valid = h.level_dims[l] == (uint32_t)pyr.level_dims[l];
+        row_size += h.level_dims[l] * sizeof(float);
+    }
+
+    // the file holds exactly the levels of count rows
+    valid = valid && h.count <= (uint64_t)file_size / row_size && sizeof(h) + h.count * row_size == (uint64_t)file_size;
+    if (valid)
+    {
+        pyr.count = h.count;
+        pyr.source = h.source;
+        for (int l = 0; valid && l < PYRAMID_LEVELS; l++)
+        {
+            pyr.levels[l].resize(h.count * pyr.level_dims[l]);
+            valid = fread(pyr.levels[l].data(), sizeof(float), pyr.levels[l].size(), fp) == pyr.levels[l].size();
+        }
+    }
+    fclose(fp);
+    if (!valid)
+    {
+        printf("%s is not a pyramid file of version %d\n", filepath, PYRAMID_VERSION);
+        return -1;
+    }
+    return 0;
+}
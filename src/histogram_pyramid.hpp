@@ -0,0 +1,144 @@
+//**********************************************************************************************************************
+// FILE: histogram_pyramid.hpp
+//
+// DESCRIPTION
+// Coarse to fine bounds for the histogram features. Summing the 8x8x8 RGB histogram over 2x2x2
+// blocks of bins gives a 4x4x4 histogram, and once more a 2x2x2 one, the 8x8 two channel
+// histograms shrink to 4x4 and 2x2 the same way. The intersection of two coarse histograms is
+// never below the intersection of the fine ones, so the coarse error is a lower bound of the
+// full error. A query bounds every image on the 8 bin level, then on the 64 bin level, and only
+// scores the full histograms of the images whose bound can still beat the k-th best error.
+// Results are the same as the full scan. The levels are saved next to the feature file with the
+// size, time and element type of the file they were summed from.
+//
+// File layout (native byte order):
+//   pyramid_header
+//   float[count][level_dims[0]]        coarsest level
+//   float[count][level_dims[1]]
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef HISTOGRAM_PYRAMID_H
+#define HISTOGRAM_PYRAMID_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define PYRAMID_MAGIC "FIPY"
+#define PYRAMID_VERSION 2
+#define PYRAMID_LEVELS 2 // coarse levels, a side of 2 then 4 bins per channel
+#define PYRAMID_SIDE 8   // bins per channel of the full histograms
+
+struct pyramid_header
+{
+  char magic[4];         // PYRAMID_MAGIC
+  uint32_t version;      // PYRAMID_VERSION
+  uint32_t feature_type; // feature_function of the rows the levels were summed from
+  uint32_t dim;
+  uint64_t count;
+  uint32_t level_dims[PYRAMID_LEVELS];
+  fi_source source;
+};
+
+/*
+  The coarse levels of every image, coarsest first. Bin i of a full row is summed into bin
+  bin_maps[l][i] of level l, -1 for the features of SSD segments.
+ */
+struct histogram_pyramid
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  fi_segment level_segments[PYRAMID_LEVELS][FI_MAX_SEGMENTS]; // the intersection segments, in coarse bins
+  int level_segment_count;
+  int level_dims[PYRAMID_LEVELS];
+  vector<int32_t> bin_maps[PYRAMID_LEVELS];
+  vector<float> levels[PYRAMID_LEVELS]; // count rows of level_dims[l]
+  fi_source source;                     // feature file of the rows, set by the caller before saving
+};
+
+/*
+  Initialises an empty pyramid for rows of dim features. 512 bin segments are cubes and 64 bin
+  segments squares of PYRAMID_SIDE bins per channel, other histograms are summed to one bin.
+  @params func the function that created the rows, it needs an intersection segment
+  The function returns 0 on success.
+ */
+int create_histogram_pyramid(histogram_pyramid &pyr, feature_function func, int dim);
+
+/*
+  Sums the coarse levels of the next image
+  @params fi the dim features of the image as computed
+  @params type, scale how the rows are stored, the levels are summed from the stored values
+ */
+void add_pyramid_row(histogram_pyramid &pyr, const float *fi, fi_elem_type type, float scale);
+
+/*
+  Sums the coarse levels of every row of fis
+  The function returns 0 on success.
+ */
+int build_histogram_pyramid(histogram_pyramid &pyr, const feature_matrix &fis, feature_function func);
+
+/*
+  Same on quantized rows, the levels are summed from their values
+ */
+int build_histogram_pyramid(histogram_pyramid &pyr, const quant_matrix &fis, feature_function func);
+
+/*
+  Sums the full values fi into one row of every level
+  @params out room for level_dims[l] floats for every level l
+ */
+void sum_pyramid_levels(const histogram_pyramid &pyr, const float *fi, float *const *out);
+
+/*
+  Lower bound of the error of image i, from its level l
+  @params target the level l row of the target, see sum_pyramid_levels
+ */
+float pyramid_level_bound(const histogram_pyramid &pyr, int l, const float *target, size_t i);
+
+/*
+  Exact top k of every target in fts, the targets are spread over the shared thread pool.
+  Prints how many images every level ruled out and the share of bin comparisons left.
+  @params fis the rows the pyramid was summed from
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > search_histogram_pyramid(const histogram_pyramid &pyr, const feature_matrix &fis,
+                                                   const vector<vector<float> > &fts, int k);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis
+ */
+vector<vector<fi_match> > search_histogram_pyramid(const histogram_pyramid &pyr, const quant_matrix &fis,
+                                                   const vector<vector<float> > &fts, int k);
+
+/*
+  The n images of every target with the lowest error on the 64 bin level, best first. The
+  errors are bounds, not distances, so this is a shortlist to score again on the full rows.
+  @params fts the targets, dim features each
+ */
+vector<vector<fi_match> > shortlist_histogram_pyramid(const histogram_pyramid &pyr, const vector<vector<float> > &fts, int n);
+
+/*
+  Path of the pyramid of the func rows of a feature file, <fi_filepath>.<func>.pyr so every
+  section of a container has its own
+ */
+string pyramid_filepath(const char *fi_filepath, feature_function func);
+
+/*
+  Writes the levels to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_histogram_pyramid(const histogram_pyramid &pyr, const char *filepath);
+
+/*
+  Reads levels written by save_histogram_pyramid
+  The function returns a non-zero value if the file is missing or not a pyramid of this version.
+ */
+int load_histogram_pyramid(const char *filepath, histogram_pyramid &pyr);
+
+#endif
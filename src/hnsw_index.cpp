@@ -0,0 +1,505 @@
+//**********************************************************************************************************************
+// FILE: hnsw_index.cpp
+//
+// DESCRIPTION
+// Contains implementation for building, searching, saving and loading the HNSW graph
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include "hnsw_index.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+typedef pair<float, uint32_t> hnsw_cand; // distance to the target and node
+
+/*
+  Nodes seen by one search, a node is seen if its mark is the tag of the search
+ */
+struct hnsw_visited
+{
+    vector<uint32_t> mark;
+    uint32_t tag;
+};
+
+static void start_visit(hnsw_visited &visited, size_t count)
+{
+    if (visited.mark.size() != count)
+    {
+        visited.mark.assign(count, 0);
+        visited.tag = 0;
+    }
+    if (++visited.tag == 0)
+    {
+        fill(visited.mark.begin(), visited.mark.end(), 0);
+        visited.tag = 1;
+    }
+}
+
+void default_hnsw_params(hnsw_params &params)
+{
+    params.m = 16;
+    params.ef_construction = 100;
+}
+
+static inline int max_links(const hnsw_index &index, int level)
+{
+    return level == 0 ? 2 * index.m : index.m;
+}
+
+static inline uint32_t *node_links(hnsw_index &index, uint32_t node, int level)
+{
+    if (level == 0)
+    {
+        return &index.links0[(size_t)node * (2 * index.m + 1)];
+    }
+    return &index.upper_links[index.upper_offsets[node] + (size_t)(level - 1) * (index.m + 1)];
+}
+
+static inline const uint32_t *node_links(const hnsw_index &index, uint32_t node, int level)
+{
+    return node_links(const_cast<hnsw_index &>(index), node, level);
+}
+
+// the links of node on level, copied under the lock of the node while the graph is built
+static void copy_links(const hnsw_index &index, uint32_t node, int level, vector<mutex> *locks, vector<uint32_t> &links)
+{
+    unique_lock<mutex> hold;
+    if (locks)
+    {
+        hold = unique_lock<mutex>((*locks)[node]);
+    }
+    const uint32_t *l = node_links(index, node, level);
+    links.assign(l + 1, l + 1 + l[0]);
+}
+
+static inline float row_distance(const hnsw_index &index, const fi_rows &m, uint32_t a, uint32_t b)
+{
+    return compute_segment_distance(fr_row(m, a), fr_row(m, b), m.type, m.scale, index.segments, index.segment_count);
+}
+
+// the ef nodes of level nearest to the target of plan, nearest first, reached from entries.
+// A node is only scored in full if it can still get into the ef nearest
+static vector<hnsw_cand> search_layer(const hnsw_index &index, const fi_rows &m, const abandon_plan &plan, const void *target,
+                                      const vector<hnsw_cand> &entries, int ef, int level, hnsw_visited &visited,
+                                      abandon_stats &stats, vector<mutex> *locks)
+{
+    start_visit(visited, index.count);
+    priority_queue<hnsw_cand, vector<hnsw_cand>, greater<hnsw_cand> > candidates;
+    priority_queue<hnsw_cand> results;
+    for (size_t e = 0; e < entries.size(); e++)
+    {
+        visited.mark[entries[e].second] = visited.tag;
+        candidates.push(entries[e]);
+        results.push(entries[e]);
+        if ((int)results.size() > ef)
+        {
+            results.pop();
+        }
+    }
+
+    vector<uint32_t> links;
+    while (!candidates.empty())
+    {
+        hnsw_cand c = candidates.top();
+        if ((int)results.size() >= ef && c.first > results.top().first)
+        {
+            break; // every node left is further than the ef found
+        }
+        candidates.pop();
+        copy_links(index, c.second, level, locks, links);
+        for (size_t j = 0; j < links.size(); j++)
+        {
+            uint32_t n = links[j];
+            if (visited.mark[n] == visited.tag)
+            {
+                continue;
+            }
+            visited.mark[n] = visited.tag;
+            float threshold = (int)results.size() < ef ? numeric_limits<float>::infinity() : results.top().first;
+            float d = compute_bounded_distance(plan, target, fr_row(m, n), threshold, stats);
+            if (d < threshold)
+            {
+                candidates.push(make_pair(d, n));
+                results.push(make_pair(d, n));
+                if ((int)results.size() > ef)
+                {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    vector<hnsw_cand> nearest(results.size());
+    for (size_t i = nearest.size(); i-- > 0;)
+    {
+        nearest[i] = results.top();
+        results.pop();
+    }
+    return nearest;
+}
+
+// the first limit candidates that are nearer to the base node than to every one kept before
+// them, so the links point in different directions. candidates are sorted nearest first
+static void select_neighbors(const hnsw_index &index, const fi_rows &m, const vector<hnsw_cand> &candidates, int limit,
+                             vector<uint32_t> &neighbors)
+{
+    neighbors.clear();
+    for (size_t c = 0; c < candidates.size() && (int)neighbors.size() < limit; c++)
+    {
+        bool keep = true;
+        for (size_t r = 0; r < neighbors.size() && keep; r++)
+        {
+            keep = row_distance(index, m, candidates[c].second, neighbors[r]) >= candidates[c].first;
+        }
+        if (keep)
+        {
+            neighbors.push_back(candidates[c].second);
+        }
+    }
+}
+
+// links node to neighbors on level and back, a neighbor with no room left selects again among
+// its links and node
+static void connect_node(hnsw_index &index, const fi_rows &m, uint32_t node, const vector<uint32_t> &neighbors, int level,
+                         vector<mutex> &locks)
+{
+    {
+        lock_guard<mutex> hold(locks[node]);
+        uint32_t *links = node_links(index, node, level);
+        links[0] = neighbors.size();
+        copy(neighbors.begin(), neighbors.end(), links + 1);
+    }
+
+    int limit = max_links(index, level);
+    vector<hnsw_cand> candidates;
+    vector<uint32_t> kept;
+    for (size_t i = 0; i < neighbors.size(); i++)
+    {
+        uint32_t n = neighbors[i];
+        lock_guard<mutex> hold(locks[n]);
+        uint32_t *links = node_links(index, n, level);
+        if ((int)links[0] < limit)
+        {
+            links[1 + links[0]++] = node;
+            continue;
+        }
+        candidates.clear();
+        candidates.push_back(make_pair(row_distance(index, m, n, node), node));
+        for (uint32_t j = 0; j < links[0]; j++)
+        {
+            candidates.push_back(make_pair(row_distance(index, m, n, links[1 + j]), links[1 + j]));
+        }
+        sort(candidates.begin(), candidates.end());
+        select_neighbors(index, m, candidates, limit, kept);
+        links[0] = kept.size();
+        copy(kept.begin(), kept.end(), links + 1);
+    }
+}
+
+static void insert_node(hnsw_index &index, const fi_rows &m, const hnsw_params &params, uint32_t node, vector<mutex> &locks,
+                        mutex &entry_lock, hnsw_visited &visited, abandon_stats &stats)
+{
+    const void *target = fr_row(m, node);
+    abandon_plan plan;
+    create_abandon_plan(plan, target, m.type, m.scale, index.segments, index.segment_count);
+
+    // a node above the top layer keeps the entry locked until it is linked and becomes the entry
+    int level = index.levels[node];
+    unique_lock<mutex> top(entry_lock);
+    uint32_t entry = index.entry;
+    int max_level = index.max_level;
+    if (level <= max_level)
+    {
+        top.unlock();
+    }
+
+    // 1. walk down the layers above the node greedily
+    vector<hnsw_cand> nearest(1, make_pair(row_distance(index, m, node, entry), entry));
+    for (int l = max_level; l > level; l--)
+    {
+        nearest = search_layer(index, m, plan, target, nearest, 1, l, visited, stats, &locks);
+    }
+
+    // 2. link it on every layer it is on, from its top down
+    vector<uint32_t> neighbors;
+    for (int l = min(level, max_level); l >= 0 && !nearest.empty(); l--)
+    {
+        nearest = search_layer(index, m, plan, target, nearest, params.ef_construction, l, visited, stats, &locks);
+        nearest.erase(remove_if(nearest.begin(), nearest.end(), [node](const hnsw_cand &c) { return c.second == node; }),
+                      nearest.end());
+        select_neighbors(index, m, nearest, index.m, neighbors);
+        connect_node(index, m, node, neighbors, l, locks);
+    }
+    if (level > max_level)
+    {
+        index.entry = node;
+        index.max_level = level;
+    }
+}
+
+static int build_graph(hnsw_index &index, const fi_rows &m, feature_function func, const hnsw_params &params)
+{
+    if (m.rows == 0 || m.rows > UINT32_MAX)
+    {
+        printf("Cannot build an HNSW index of %lu images\n", m.rows);
+        return -1;
+    }
+    index.dim = m.dim;
+    index.count = m.rows;
+    index.func = func;
+    index.segment_count = get_feature_segments(func, m.dim, index.segments);
+    index.m = max(2, params.m);
+    index.ef_construction = params.ef_construction;
+    memset(&index.source, 0, sizeof(index.source));
+
+    // 1. the top layer of every node, each layer up holds about 1 / m of the nodes below
+    mt19937 rng(HNSW_SEED);
+    uniform_real_distribution<double> uniform(0, 1);
+    double scale = 1 / log((double)index.m);
+    index.levels.resize(m.rows);
+    index.upper_offsets.assign(m.rows + 1, 0);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        index.levels[i] = min(255, (int)(-log(1 - uniform(rng)) * scale));
+        index.upper_offsets[i + 1] = index.upper_offsets[i] + (uint64_t)index.levels[i] * (index.m + 1);
+    }
+    index.links0.assign(m.rows * (2 * index.m + 1), 0);
+    index.upper_links.assign(index.upper_offsets[m.rows], 0);
+    index.entry = 0;
+    index.max_level = index.levels[0];
+
+    // 2. insert the other nodes in batches, a node is locked while its links change
+    vector<mutex> locks(m.rows);
+    mutex entry_lock;
+    thread_pool &pool = shared_thread_pool();
+    vector<hnsw_visited> visited(pool.size());
+    vector<abandon_stats> stats(pool.size());
+    for (int w = 0; w < pool.size(); w++)
+    {
+        clear_abandon_stats(stats[w]);
+    }
+    pool.run((m.rows - 1 + HNSW_INSERT_BATCH - 1) / HNSW_INSERT_BATCH, [&](size_t task, int worker) {
+        for (size_t i = 1 + task * HNSW_INSERT_BATCH; i < m.rows && i < 1 + (task + 1) * HNSW_INSERT_BATCH; i++)
+        {
+            insert_node(index, m, params, i, locks, entry_lock, visited[worker], stats[worker]);
+        }
+    });
+    for (int w = 1; w < pool.size(); w++)
+    {
+        add_abandon_stats(stats[0], stats[w]);
+    }
+    printf("Built HNSW index: %lu images, m %d, %d layers, %.1f distances per image\n", m.rows, index.m,
+           index.max_level + 1, (double)stats[0].rows / m.rows);
+    return 0;
+}
+
+int build_hnsw_index(hnsw_index &index, const feature_matrix &fis, feature_function func, const hnsw_params &params)
+{
+    return build_graph(index, view_rows(fis), func, params);
+}
+
+int build_hnsw_index(hnsw_index &index, const quant_matrix &fis, feature_function func, const hnsw_params &params)
+{
+    return build_graph(index, view_rows(fis), func, params);
+}
+
+static vector<vector<fi_match> > search_graph(const hnsw_index &index, const fi_rows &m, const vector<vector<float> > &fts,
+                                              int k, const hnsw_search_params &params)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != index.dim || m.rows != index.count)
+    {
+        printf("HNSW index of %lu x %d does not match %lu x %d features\n", index.count, index.dim, m.rows, m.dim);
+        return result;
+    }
+    int ef = max(params.ef_search, k);
+
+    // one target per task
+    thread_pool &pool = shared_thread_pool();
+    vector<hnsw_visited> visited(pool.size());
+    vector<abandon_stats> stats(pool.size());
+    for (int w = 0; w < pool.size(); w++)
+    {
+        clear_abandon_stats(stats[w]);
+    }
+    pool.run(fts.size(), [&](size_t q, int worker) {
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        abandon_plan plan;
+        create_abandon_plan(plan, target, m.type, m.scale, index.segments, index.segment_count);
+
+        // 1. greedy down to layer 0, then the ef nearest there
+        float d = compute_segment_distance(target, fr_row(m, index.entry), m.type, m.scale, index.segments, index.segment_count);
+        vector<hnsw_cand> nearest(1, make_pair(d, index.entry));
+        for (int l = index.max_level; l > 0; l--)
+        {
+            nearest = search_layer(index, m, plan, target, nearest, 1, l, visited[worker], stats[worker], NULL);
+        }
+        nearest = search_layer(index, m, plan, target, nearest, ef, 0, visited[worker], stats[worker], NULL);
+
+        // 2. the best k of them
+        topk top_n;
+        create_topk(top_n, k);
+        for (size_t i = 0; i < nearest.size(); i++)
+        {
+            topk_push(top_n, nearest[i].second, nearest[i].first);
+        }
+        result[q] = topk_sorted(top_n);
+    });
+    for (int w = 1; w < pool.size(); w++)
+    {
+        add_abandon_stats(stats[0], stats[w]);
+    }
+    printf("HNSW index: ef %d, scored %.1f of %lu images per target\n", ef,
+           fts.empty() ? 0.0 : (double)stats[0].rows / fts.size(), index.count);
+    return result;
+}
+
+vector<vector<fi_match> > search_hnsw_index(const hnsw_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                            int k, const hnsw_search_params &params)
+{
+    return search_graph(index, view_rows(fis), fts, k, params);
+}
+
+vector<vector<fi_match> > search_hnsw_index(const hnsw_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                            int k, const hnsw_search_params &params)
+{
+    return search_graph(index, view_rows(fis), fts, k, params);
+}
+
+int save_hnsw_index(const hnsw_index &index, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open HNSW file %s\n", filepath);
+        return -1;
+    }
+    hnsw_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HNSW_MAGIC, 4);
+    h.version = HNSW_VERSION;
+    h.feature_type = index.func;
+    h.dim = index.dim;
+    h.count = index.count;
+    h.m = index.m;
+    h.max_level = index.max_level;
+    h.entry = index.entry;
+    h.ef_construction = index.ef_construction;
+    h.upper_size = index.upper_links.size();
+    h.source = index.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(index.levels.data(), sizeof(uint8_t), index.levels.size(), fp) != index.levels.size();
+    err |= fwrite(index.links0.data(), sizeof(uint32_t), index.links0.size(), fp) != index.links0.size();
+    err |= fwrite(index.upper_offsets.data(), sizeof(uint64_t), index.upper_offsets.size(), fp) != index.upper_offsets.size();
+    err |= fwrite(index.upper_links.data(), sizeof(uint32_t), index.upper_links.size(), fp) != index.upper_links.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write HNSW file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+// every link of node on level is a node that is on that level too
+static bool check_links(const hnsw_index &index, uint32_t node, int level)
+{
+    const uint32_t *links = node_links(index, node, level);
+    if (links[0] > (uint32_t)max_links(index, level))
+    {
+        return false;
+    }
+    for (uint32_t j = 1; j <= links[0]; j++)
+    {
+        if (links[j] >= index.count || index.levels[links[j]] < level)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int load_hnsw_index(const char *filepath, hnsw_index &index)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open HNSW file %s\n", filepath);
+        return -1;
+    }
+
+    // 1. the header, the sizes are checked against the file before anything is allocated
+    hnsw_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, HNSW_MAGIC, 4) == 0 &&
+                 h.version == HNSW_VERSION && h.m >= 2 && h.count > 0 && h.entry < h.count && h.max_level <= 255 &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.count <= (uint64_t)file_size && h.m <= (uint64_t)file_size / (h.count * 8) &&
+                 h.upper_size <= (uint64_t)file_size / sizeof(uint32_t) &&
+                 sizeof(h) + h.count + h.count * (2 * h.m + 1) * sizeof(uint32_t) + (h.count + 1) * sizeof(uint64_t) +
+                         h.upper_size * sizeof(uint32_t) == (uint64_t)file_size;
+    if (valid)
+    {
+        index.dim = h.dim;
+        index.count = h.count;
+        index.func = (feature_function)h.feature_type;
+        index.segment_count = get_feature_segments(index.func, index.dim, index.segments);
+        index.m = h.m;
+        index.ef_construction = h.ef_construction;
+        index.max_level = h.max_level;
+        index.entry = h.entry;
+        index.source = h.source;
+        index.levels.resize(h.count);
+        index.links0.resize(h.count * (2 * h.m + 1));
+        index.upper_offsets.resize(h.count + 1);
+        index.upper_links.resize(h.upper_size);
+        valid = fread(index.levels.data(), sizeof(uint8_t), index.levels.size(), fp) == index.levels.size() &&
+                fread(index.links0.data(), sizeof(uint32_t), index.links0.size(), fp) == index.links0.size() &&
+                fread(index.upper_offsets.data(), sizeof(uint64_t), index.upper_offsets.size(), fp) == index.upper_offsets.size() &&
+                fread(index.upper_links.data(), sizeof(uint32_t), index.upper_links.size(), fp) == index.upper_links.size();
+    }
+    fclose(fp);
+
+    // 2. the layers of every node are where the build puts them and the entry is on the top layer
+    valid = valid && index.upper_offsets[0] == 0 && index.upper_offsets[h.count] == h.upper_size &&
+            index.levels[h.entry] == h.max_level;
+    for (size_t i = 0; valid && i < h.count; i++)
+    {
+        valid = index.levels[i] <= h.max_level &&
+                index.upper_offsets[i + 1] - index.upper_offsets[i] == (uint64_t)index.levels[i] * (h.m + 1) &&
+                index.upper_offsets[i + 1] >= index.upper_offsets[i];
+    }
+
+    // 3. every link is a node the search can follow on that layer
+    for (size_t i = 0; valid && i < h.count; i++)
+    {
+        for (int l = 0; valid && l <= index.levels[i]; l++)
+        {
+            valid = check_links(index, i, l);
+        }
+    }
+    if (!valid)
+    {
+        printf("%s is not an HNSW file of version %d\n", filepath, HNSW_VERSION);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+//**********************************************************************************************************************
+// FILE: hnsw_index.hpp
+//
+// DESCRIPTION
+// Hierarchical navigable small world graph over the images of a feature file. Every image is a
+// node linked to its nearest images on layer 0 and, for a few of them, on sparser layers above. A
+// query walks down from the top layer greedily and then searches layer 0 with a list of ef
+// candidates, so it scores a few thousand images instead of the whole collection. The links are
+// found with the same distance the scan ranks with and the graph can be saved next to the
+// feature file.
+//
+// File layout (native byte order):
+//   hnsw_header
+//   uint8_t[count]                     top layer of every node
+//   uint32_t[count][2m + 1]            layer 0, number of links then the links
+//   uint64_t[count + 1]                first upper layer slot of every node
+//   uint32_t[upper_size]               layers 1 and up, m + 1 slots per node and layer
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef HNSW_INDEX_H
+#define HNSW_INDEX_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define HNSW_MAGIC "FIHN"
+#define HNSW_VERSION 2
+#define HNSW_SEED 5489u        // seed of the layers, the layers of a file are always the same
+#define HNSW_INSERT_BATCH 64   // images inserted by one task of the build
+
+struct hnsw_params
+{
+  int m;               // links per node on the upper layers, 2m on layer 0
+  int ef_construction; // candidates kept while linking a new node
+};
+
+struct hnsw_search_params
+{
+  int ef_search; // candidates kept on layer 0, at least k
+};
+
+struct hnsw_header
+{
+  char magic[4];         // HNSW_MAGIC
+  uint32_t version;      // HNSW_VERSION
+  uint32_t feature_type; // feature_function of the rows the graph links
+  uint32_t dim;
+  uint64_t count;
+  uint32_t m;
+  uint32_t max_level;
+  uint32_t entry;        // node the searches start from, on max_level
+  uint32_t ef_construction;
+  uint64_t upper_size;
+  fi_source source;
+};
+
+/*
+  The layers of the graph, the links of a node on a layer start with their number
+ */
+struct hnsw_index
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  int m;
+  int ef_construction;
+  int max_level;
+  uint32_t entry;
+  fi_source source; // feature file of the rows, set by the caller before saving
+  vector<uint8_t> levels;
+  vector<uint32_t> links0;
+  vector<uint64_t> upper_offsets;
+  vector<uint32_t> upper_links;
+};
+
+/*
+  Sets m = 16 and ef_construction = 100
+ */
+void default_hnsw_params(hnsw_params &params);
+
+/*
+  Links every row of fis into a graph. The images are inserted in batches on the shared thread
+  pool, see set_scan_threads, so with more than one thread the links can differ between runs.
+  @params func the function that created fis, gives the distance
+  The function returns 0 on success.
+ */
+int build_hnsw_index(hnsw_index &index, const feature_matrix &fis, feature_function func, const hnsw_params &params);
+
+/*
+  Same on quantized rows, the distances are taken on the codes
+ */
+int build_hnsw_index(hnsw_index &index, const quant_matrix &fis, feature_function func, const hnsw_params &params);
+
+/*
+  Approximate top k of every target in fts, the targets are spread over the shared thread pool
+  @params fis the rows the index was built on
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > search_hnsw_index(const hnsw_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                            int k, const hnsw_search_params &params);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis
+ */
+vector<vector<fi_match> > search_hnsw_index(const hnsw_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                            int k, const hnsw_search_params &params);
+
+/*
+  Writes the graph to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_hnsw_index(const hnsw_index &index, const char *filepath);
+
+/*
+  Reads a graph written by save_hnsw_index, every link is checked to be a node on its layer
+  The function returns a non-zero value if the file is missing or not a graph of this version.
+ */
+int load_hnsw_index(const char *filepath, hnsw_index &index);
+
+#endif
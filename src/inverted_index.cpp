@@ -0,0 +1,320 @@
+//**********************************************************************************************************************
+// FILE: inverted_index.cpp
+//
+// DESCRIPTION
+// Contains implementation for building, searching and saving the inverted bin index
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "inverted_index.hpp"
+#include "parallel_scan.hpp"
+
+void default_inverted_search_params(inverted_search_params &params)
+{
+    params.target_mass = 1;
+    params.min_posting = 0;
+}
+
+static bool heavier_posting(const fi_posting &a, const fi_posting &b)
+{
+    return a.mass > b.mass || (a.mass == b.mass && a.id < b.id);
+}
+
+// two passes over the rows, row(i, bin) is the value of a bin of image i
+template <typename Value>
+static void build_postings(inverted_index &index, size_t rows, int dim, feature_function func, float min_mass, Value value)
+{
+    index.dim = dim;
+    index.count = rows;
+    index.func = func;
+    index.min_mass = min_mass;
+    memset(&index.source, 0, sizeof(index.source));
+
+    // 1. size of every posting list
+    index.offsets.assign(dim + 1, 0);
+    for (size_t i = 0; i < rows; i++)
+    {
+        for (int b = 0; b < dim; b++)
+        {
+            float v = value(i, b);
+            if (v > 0 && v >= min_mass)
+            {
+                index.offsets[b + 1] += 1;
+            }
+        }
+    }
+    for (int b = 0; b < dim; b++)
+    {
+        index.offsets[b + 1] += index.offsets[b];
+    }
+
+    // 2. fill the lists in image order, then put the heaviest postings first
+    index.postings.resize(index.offsets[dim]);
+    vector<uint64_t> next(index.offsets.begin(), index.offsets.end() - 1);
+    for (size_t i = 0; i < rows; i++)
+    {
+        for (int b = 0; b < dim; b++)
+        {
+            float v = value(i, b);
+            if (v > 0 && v >= min_mass)
+            {
+                fi_posting &p = index.postings[next[b]++];
+                p.id = i;
+                p.mass = v;
+            }
+        }
+    }
+    for (int b = 0; b < dim; b++)
+    {
+        sort(index.postings.begin() + index.offsets[b], index.postings.begin() + index.offsets[b + 1], heavier_posting);
+    }
+    printf("Built inverted index: %lu images, %d bins, %lu postings (%.1f%% of the bins)\n", rows, dim,
+           index.postings.size(), rows && dim ? 100.0 * index.postings.size() / (rows * dim) : 0.0);
+}
+
+void build_inverted_index(inverted_index &index, const feature_matrix &fis, feature_function func, float min_mass)
+{
+    index.type = fi_f32;
+    index.scale = 1;
+    build_postings(index, fis.rows, fis.dim, func, min_mass, [&](size_t i, int b) {
+        return fm_row(fis, i)[b];
+    });
+}
+
+void build_inverted_index(inverted_index &index, const quant_matrix &fis, feature_function func, float min_mass)
+{
+    index.type = fis.type;
+    index.scale = fis.scale;
+    build_postings(index, fis.rows, fis.dim, func, min_mass, [&](size_t i, int b) -> float {
+        const void *row = qm_row(fis, i);
+        if (fis.type == fi_u8)
+        {
+            return ((const uint8_t *)row)[b] * fis.scale;
+        }
+        else if (fis.type == fi_u16)
+        {
+            return ((const uint16_t *)row)[b] * fis.scale;
+        }
+        return ((const float *)row)[b];
+    });
+}
+
+// scratch of one worker, matched mass of the images the postings read so far reached
+struct inverted_scratch
+{
+    vector<float> matched;
+    vector<uint32_t> touched;
+};
+
+vector<vector<fi_match> > search_inverted_index(const inverted_index &index, const vector<vector<float> > &fts, int k,
+                                                const inverted_search_params &params)
+{
+    vector<vector<fi_match> > result;
+
+    // 1. weight of every bin, an empty target would match nothing and have error base
+    fi_segment segments[FI_MAX_SEGMENTS];
+    int count = get_feature_segments(index.func, index.dim, segments);
+    vector<float> weight(index.dim, 0);
+    float base = 0;
+    for (int s = 0; s < count; s++)
+    {
+        if (segments[s].metric != intersect_metric)
+        {
+            printf("Inverted index only answers histogram intersection queries\n");
+            return result;
+        }
+        for (int b = segments[s].offset; b < segments[s].offset + segments[s].length && b < index.dim; b++)
+        {
+            weight[b] = segments[s].weight;
+        }
+        base += segments[s].weight;
+    }
+
+    // one target per task, every worker keeps its scratch for the next target
+    result.resize(fts.size());
+    vector<size_t> read_bins(fts.size());
+    vector<uint64_t> read_postings(fts.size());
+    vector<inverted_scratch> scratch(shared_thread_pool().size());
+    shared_thread_pool().run(fts.size(), [&](size_t q, int worker) {
+        inverted_scratch &sc = scratch[worker];
+        if (sc.matched.size() != index.count)
+        {
+            sc.matched.assign(index.count, 0);
+        }
+
+        // 2. the target as the rows hold it, quantized rows are matched with a quantized target
+        vector<float> ft(fts[q]);
+        if (index.type != fi_f32)
+        {
+            vector<uint16_t> codes(index.dim); // room for u8 or u16 codes
+            quantize_fi(fts[q].data(), index.dim, index.type, index.scale, codes.data());
+            dequantize_fi(codes.data(), index.dim, index.type, index.scale, ft.data());
+        }
+
+        // 3. the filled target bins, heaviest first, as many as it takes to cover target_mass
+        vector<pair<float, int> > bins;
+        float total = 0;
+        for (int b = 0; b < index.dim; b++)
+        {
+            if (ft[b] > 0 && weight[b] > 0)
+            {
+                bins.push_back(make_pair(weight[b] * ft[b], b));
+                total += weight[b] * ft[b];
+            }
+        }
+        sort(bins.begin(), bins.end(), [](const pair<float, int> &a, const pair<float, int> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+
+        // 4. every posting of a read bin takes the matched mass off the error of its image, a
+        // match is never 0 so the first one marks the image as touched
+        float covered = 0;
+        for (size_t n = 0; n < bins.size() && (params.target_mass >= 1 || covered < params.target_mass * total); n++)
+        {
+            int b = bins[n].second;
+            float v = ft[b];
+            float w = weight[b];
+            for (uint64_t p = index.offsets[b]; p < index.offsets[b + 1]; p++)
+            {
+                const fi_posting &post = index.postings[p];
+                if (post.mass < params.min_posting)
+                {
+                    break; // the rest of the list is lighter
+                }
+                if (sc.matched[post.id] == 0)
+                {
+                    sc.touched.push_back(post.id);
+                }
+                sc.matched[post.id] += w * (v < post.mass ? v : post.mass);
+                read_postings[q] += 1;
+            }
+            covered += bins[n].first;
+            read_bins[q] += 1;
+        }
+
+        // 5. the k minimum errors among the touched images, the lowest ids of the others tie
+        // at base if there are not k better ones
+        topk top_n;
+        create_topk(top_n, k);
+        for (size_t t = 0; t < sc.touched.size(); t++)
+        {
+            topk_push(top_n, sc.touched[t], base - sc.matched[sc.touched[t]]);
+        }
+        int untouched = 0;
+        for (size_t i = 0; i < index.count && untouched < k && sc.touched.size() < index.count; i++)
+        {
+            if (sc.matched[i] == 0)
+            {
+                topk_push(top_n, i, base);
+                untouched += 1;
+            }
+        }
+        result[q] = topk_sorted(top_n);
+
+        // 6. clear only what this target touched
+        for (size_t t = 0; t < sc.touched.size(); t++)
+        {
+            sc.matched[sc.touched[t]] = 0;
+        }
+        sc.touched.clear();
+    });
+
+    size_t total_bins = 0;
+    uint64_t total_postings = 0;
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        total_bins += read_bins[q];
+        total_postings += read_postings[q];
+    }
+    double per_target = fts.empty() ? 1.0 : (double)fts.size();
+    printf("Inverted index: read %.1f target bins and %.1f of %lu postings per target\n", total_bins / per_target,
+           total_postings / per_target, index.postings.size());
+    return result;
+}
+
+int save_inverted_index(const inverted_index &index, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open inverted index file %s\n", filepath);
+        return -1;
+    }
+    inverted_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INVERTED_MAGIC, 4);
+    h.version = INVERTED_VERSION;
+    h.feature_type = index.func;
+    h.dim = index.dim;
+    h.count = index.count;
+    h.min_mass = index.min_mass;
+    h.source = index.source;
+    h.posting_count = index.postings.size();
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), fp) != index.offsets.size();
+    err |= fwrite(index.postings.data(), sizeof(fi_posting), index.postings.size(), fp) != index.postings.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write inverted index file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_inverted_index(const char *filepath, inverted_index &index)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open inverted index file %s\n", filepath);
+        return -1;
+    }
+
+    // 1. the header, the sizes are checked against the file before anything is allocated
+    inverted_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, INVERTED_MAGIC, 4) == 0 &&
+                 h.version == INVERTED_VERSION && h.source.elem_type <= fi_u16 &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.dim < (uint64_t)file_size / sizeof(uint64_t) && h.posting_count <= (uint64_t)file_size / sizeof(fi_posting) &&
+                 sizeof(h) + (h.dim + 1) * sizeof(uint64_t) + h.posting_count * sizeof(fi_posting) == (uint64_t)file_size;
+    if (valid)
+    {
+        index.dim = h.dim;
+        index.count = h.count;
+        index.func = (feature_function)h.feature_type;
+        index.type = (fi_elem_type)h.source.elem_type;
+        index.scale = h.source.scale;
+        index.min_mass = h.min_mass;
+        index.source = h.source;
+        index.offsets.resize(h.dim + 1);
+        index.postings.resize(h.posting_count);
+        valid = fread(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), fp) == index.offsets.size() &&
+                fread(index.postings.data(), sizeof(fi_posting), index.postings.size(), fp) == index.postings.size();
+    }
+    fclose(fp);
+
+    // 2. every list is inside the postings and every posting is an image
+    valid = valid && index.offsets[0] == 0 && index.offsets[index.dim] == h.posting_count;
+    for (int b = 0; valid && b < index.dim; b++)
+    {
+        valid = index.offsets[b] <= index.offsets[b + 1];
+    }
+    for (size_t p = 0; valid && p < index.postings.size(); p++)
+    {
+        valid = index.postings[p].id < index.count;
+    }
+    if (!valid)
+    {
+        printf("%s is not an inverted index file of version %d\n", filepath, INVERTED_VERSION);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+//**********************************************************************************************************************
+// FILE: inverted_index.hpp
+//
+// DESCRIPTION
+// Inverted index over histogram bins. Every bin has a posting list of the images that have mass in
+// it, so a histogram intersection query only reads the lists of the bins the target fills and
+// only touches the images in them. The heaviest target bins are read first and the reading can
+// stop early, which trades exactness for speed on very large collections. The index is saved
+// next to the feature file.
+//
+// File layout (native byte order):
+//   inverted_header
+//   uint64_t[dim + 1]                  first posting of every bin
+//   fi_posting[posting_count]          postings of every bin, heaviest first
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef INVERTED_INDEX_H
+#define INVERTED_INDEX_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define INVERTED_MAGIC "FIIV"
+#define INVERTED_VERSION 1
+
+struct fi_posting
+{
+  uint32_t id; // image
+  float mass;  // value of the bin in the image
+};
+
+struct inverted_header
+{
+  char magic[4];         // INVERTED_MAGIC
+  uint32_t version;      // INVERTED_VERSION
+  uint32_t feature_type; // feature_function of the rows the postings were read from
+  uint32_t dim;
+  uint64_t count;
+  float min_mass;
+  uint32_t reserved;
+  fi_source source;
+  uint64_t posting_count;
+};
+
+/*
+  Posting lists of all bins, the postings of bin b are postings[offsets[b], offsets[b + 1]),
+  heaviest first
+ */
+struct inverted_index
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_elem_type type; // the targets are quantized like the rows
+  float scale;
+  float min_mass;
+  fi_source source; // feature file of the rows, set by the caller before saving
+  vector<uint64_t> offsets;
+  vector<fi_posting> postings;
+};
+
+struct inverted_search_params
+{
+  float target_mass; // share of the target mass to read, heaviest bins first, 1 reads every bin
+  float min_posting; // postings lighter than this are skipped, 0 reads them all
+};
+
+/*
+  Sets the params of an exact search
+ */
+void default_inverted_search_params(inverted_search_params &params);
+
+/*
+  Builds the posting lists of the rows of fis
+  @params func the function that created fis, it has to be made of histogram intersections
+  @params min_mass bins of an image with less mass are left out of the index, 0 keeps every non-zero bin
+ */
+void build_inverted_index(inverted_index &index, const feature_matrix &fis, feature_function func, float min_mass = 0);
+
+/*
+  Same from quantized rows, the postings hold the values of the codes
+ */
+void build_inverted_index(inverted_index &index, const quant_matrix &fis, feature_function func, float min_mass = 0);
+
+/*
+  Intersection top k of every target in fts, the targets are spread over the shared thread pool.
+  Every image starts at the error of an empty match and the postings of the target bins take
+  their matched mass off, the images in no posting read keep that error. A target is quantized
+  like the rows, so reading every bin gives the matches of the full scan.
+  The function returns the k matches with the minimum errors of every target, best first, or
+  nothing if func is not a histogram intersection.
+ */
+vector<vector<fi_match> > search_inverted_index(const inverted_index &index, const vector<vector<float> > &fts, int k,
+                                                const inverted_search_params &params);
+
+/*
+  Writes the postings to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_inverted_index(const inverted_index &index, const char *filepath);
+
+/*
+  Reads postings written by save_inverted_index, the elem type and scale come from the source
+  The function returns a non-zero value if the file is missing or not an index of this version.
+ */
+int load_inverted_index(const char *filepath, inverted_index &index);
+
+#endif
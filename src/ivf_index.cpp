@@ -0,0 +1,342 @@
+//**********************************************************************************************************************
+// FILE: ivf_index.cpp
+//
+// DESCRIPTION
+// Contains implementation for training, building, searching and saving the k-means cluster index
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include "ivf_index.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+static bool nearer(const pair<float, int> &a, const pair<float, int> &b)
+{
+    return a.first < b.first || (a.first == b.first && a.second < b.second);
+}
+
+// the centroid nearest to v and its distance
+static pair<float, int> nearest_centroid(const ivf_index &index, const float *v)
+{
+    pair<float, int> best(numeric_limits<float>::infinity(), 0);
+    for (int c = 0; c < index.nlist; c++)
+    {
+        pair<float, int> d(compute_segment_distance(&index.centroids[(size_t)c * index.dim], v, index.segments, index.segment_count), c);
+        if (nearer(d, best))
+        {
+            best = d;
+        }
+    }
+    return best;
+}
+
+// nearest centroid of every row of values, on the shared pool
+static void assign_rows(const ivf_index &index, size_t rows, const float *values, vector<pair<float, int> > &nearest)
+{
+    size_t partition = scan_partition_rows(index.dim * sizeof(float));
+    nearest.resize(rows);
+    shared_thread_pool().run((rows + partition - 1) / partition, [&](size_t task, int) {
+        for (size_t i = task * partition; i < rows && i < (task + 1) * partition; i++)
+        {
+            nearest[i] = nearest_centroid(index, values + i * index.dim);
+        }
+    });
+}
+
+// k-means on a sample of the rows, the first centroids are the first images of the sample
+static void train_centroids(ivf_index &index, const fi_rows &m)
+{
+    // 1. a fixed random sample, copied as floats
+    vector<uint32_t> order(m.rows);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        order[i] = i;
+    }
+    mt19937 rng(IVF_SEED);
+    shuffle(order.begin(), order.end(), rng);
+    size_t n = min(m.rows, (size_t)index.nlist * IVF_TRAIN_POINTS);
+    vector<float> sample(n * m.dim);
+    for (size_t s = 0; s < n; s++)
+    {
+        const float *v = fr_values(m, order[s], &sample[s * m.dim]);
+        if (v != &sample[s * m.dim])
+        {
+            memcpy(&sample[s * m.dim], v, m.dim * sizeof(float));
+        }
+    }
+    index.centroids.assign(sample.begin(), sample.begin() + (size_t)index.nlist * m.dim);
+
+    // 2. move every centroid to the mean of its images, an empty cluster takes over the
+    // image furthest from its centroid
+    vector<pair<float, int> > nearest;
+    vector<double> sums((size_t)index.nlist * m.dim);
+    vector<size_t> sizes(index.nlist);
+    for (int it = 0; it < IVF_TRAIN_ITERATIONS; it++)
+    {
+        assign_rows(index, n, sample.data(), nearest);
+        fill(sums.begin(), sums.end(), 0.0);
+        fill(sizes.begin(), sizes.end(), 0);
+        for (size_t s = 0; s < n; s++)
+        {
+            double *sum = &sums[(size_t)nearest[s].second * m.dim];
+            const float *v = &sample[s * m.dim];
+            for (int d = 0; d < m.dim; d++)
+            {
+                sum[d] += v[d];
+            }
+            sizes[nearest[s].second] += 1;
+        }
+        for (int c = 0; c < index.nlist; c++)
+        {
+            float *centroid = &index.centroids[(size_t)c * m.dim];
+            if (sizes[c] == 0)
+            {
+                size_t far = 0;
+                for (size_t s = 1; s < n; s++)
+                {
+                    far = nearest[s].first > nearest[far].first ? s : far;
+                }
+                memcpy(centroid, &sample[far * m.dim], m.dim * sizeof(float));
+                nearest[far].first = 0;
+                continue;
+            }
+            for (int d = 0; d < m.dim; d++)
+            {
+                centroid[d] = sums[(size_t)c * m.dim + d] / sizes[c];
+            }
+        }
+    }
+}
+
+int ivf_default_lists(size_t rows)
+{
+    return max(1, (int)(4 * sqrt((double)rows)));
+}
+
+int ivf_list_count(size_t rows, int nlist)
+{
+    return (int)min((size_t)(nlist > 0 ? nlist : ivf_default_lists(rows)), rows);
+}
+
+static int build_index(ivf_index &index, const fi_rows &m, feature_function func, int nlist)
+{
+    if (m.rows == 0)
+    {
+        printf("Cannot build an IVF index of no images\n");
+        return -1;
+    }
+    index.dim = m.dim;
+    index.count = m.rows;
+    index.func = func;
+    memset(&index.source, 0, sizeof(index.source));
+    index.nlist = ivf_list_count(m.rows, nlist);
+    index.segment_count = get_feature_segments(func, m.dim, index.segments);
+
+    // 1. centroids
+    train_centroids(index, m);
+
+    // 2. the cluster of every image, then the member lists in image order
+    vector<int> cluster(m.rows);
+    size_t partition = scan_partition_rows(m.row_bytes);
+    thread_pool &pool = shared_thread_pool();
+    vector<vector<float> > scratch(pool.size(), vector<float>(m.dim));
+    pool.run((m.rows + partition - 1) / partition, [&](size_t task, int worker) {
+        for (size_t i = task * partition; i < m.rows && i < (task + 1) * partition; i++)
+        {
+            cluster[i] = nearest_centroid(index, fr_values(m, i, scratch[worker].data())).second;
+        }
+    });
+    index.offsets.assign(index.nlist + 1, 0);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        index.offsets[cluster[i] + 1] += 1;
+    }
+    uint64_t largest = 0;
+    for (int c = 0; c < index.nlist; c++)
+    {
+        largest = max(largest, index.offsets[c + 1]);
+        index.offsets[c + 1] += index.offsets[c];
+    }
+    index.ids.resize(m.rows);
+    vector<uint64_t> next(index.offsets.begin(), index.offsets.end() - 1);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        index.ids[next[cluster[i]]++] = i;
+    }
+    printf("Built IVF index: %lu images in %d lists, largest list %llu\n", m.rows, index.nlist, (unsigned long long)largest);
+    return 0;
+}
+
+int build_ivf_index(ivf_index &index, const feature_matrix &fis, feature_function func, int nlist)
+{
+    return build_index(index, view_rows(fis), func, nlist);
+}
+
+int build_ivf_index(ivf_index &index, const quant_matrix &fis, feature_function func, int nlist)
+{
+    return build_index(index, view_rows(fis), func, nlist);
+}
+
+static vector<vector<fi_match> > search_rows(const ivf_index &index, const fi_rows &m, const vector<vector<float> > &fts,
+                                             int k, const ivf_search_params &params)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != index.dim || m.rows != index.count)
+    {
+        printf("IVF index of %lu x %d does not match %lu x %d features\n", index.count, index.dim, m.rows, m.dim);
+        return result;
+    }
+    int nprobe = max(1, min(params.nprobe, index.nlist));
+
+    // one target per task, a probed list is scored with early abandoning like the full scan
+    vector<uint64_t> scored(fts.size(), 0);
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        // 1. the nprobe nearest centroids
+        vector<pair<float, int> > lists(index.nlist);
+        for (int c = 0; c < index.nlist; c++)
+        {
+            lists[c] = make_pair(compute_segment_distance(fts[q].data(), &index.centroids[(size_t)c * index.dim],
+                                                          index.segments, index.segment_count), c);
+        }
+        partial_sort(lists.begin(), lists.begin() + nprobe, lists.end(), nearer);
+
+        // 2. their members, on the codes if the rows are quantized
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        abandon_plan plan;
+        abandon_stats stats;
+        clear_abandon_stats(stats);
+        create_abandon_plan(plan, target, m.type, m.scale, index.segments, index.segment_count);
+        topk top_n;
+        create_topk(top_n, k);
+        for (int p = 0; p < nprobe; p++)
+        {
+            int c = lists[p].second;
+            for (uint64_t j = index.offsets[c]; j < index.offsets[c + 1]; j++)
+            {
+                uint32_t id = index.ids[j];
+                topk_push(top_n, id, compute_bounded_distance(plan, target, fr_row(m, id), topk_threshold(top_n), stats));
+            }
+        }
+        scored[q] = stats.rows;
+        result[q] = topk_sorted(top_n);
+    });
+
+    uint64_t total = 0;
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        total += scored[q];
+    }
+    printf("IVF index: probed %d of %d lists, scored %.1f of %lu images per target\n", nprobe, index.nlist,
+           fts.empty() ? 0.0 : (double)total / fts.size(), index.count);
+    return result;
+}
+
+vector<vector<fi_match> > search_ivf_index(const ivf_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const ivf_search_params &params)
+{
+    return search_rows(index, view_rows(fis), fts, k, params);
+}
+
+vector<vector<fi_match> > search_ivf_index(const ivf_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const ivf_search_params &params)
+{
+    return search_rows(index, view_rows(fis), fts, k, params);
+}
+
+int save_ivf_index(const ivf_index &index, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open IVF file %s\n", filepath);
+        return -1;
+    }
+    ivf_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IVF_MAGIC, 4);
+    h.version = IVF_VERSION;
+    h.feature_type = index.func;
+    h.dim = index.dim;
+    h.count = index.count;
+    h.nlist = index.nlist;
+    h.source = index.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(index.centroids.data(), sizeof(float), index.centroids.size(), fp) != index.centroids.size();
+    err |= fwrite(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), fp) != index.offsets.size();
+    err |= fwrite(index.ids.data(), sizeof(uint32_t), index.ids.size(), fp) != index.ids.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write IVF file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_ivf_index(const char *filepath, ivf_index &index)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open IVF file %s\n", filepath);
+        return -1;
+    }
+
+    // 1. the header, the sizes are checked against the file before anything is allocated
+    ivf_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, IVF_MAGIC, 4) == 0 &&
+                 h.version == IVF_VERSION && h.nlist > 0 && h.nlist <= h.count &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.count <= (uint64_t)file_size / sizeof(uint32_t) && h.dim <= (uint64_t)file_size / sizeof(float) &&
+                 sizeof(h) + ((uint64_t)h.nlist * h.dim) * sizeof(float) + (h.nlist + 1) * sizeof(uint64_t) +
+                         h.count * sizeof(uint32_t) == (uint64_t)file_size;
+    if (valid)
+    {
+        index.dim = h.dim;
+        index.nlist = h.nlist;
+        index.count = h.count;
+        index.func = (feature_function)h.feature_type;
+        index.source = h.source;
+        index.segment_count = get_feature_segments(index.func, index.dim, index.segments);
+        index.centroids.resize((size_t)h.nlist * h.dim);
+        index.offsets.resize(h.nlist + 1);
+        index.ids.resize(h.count);
+        valid = fread(index.centroids.data(), sizeof(float), index.centroids.size(), fp) == index.centroids.size() &&
+                fread(index.offsets.data(), sizeof(uint64_t), index.offsets.size(), fp) == index.offsets.size() &&
+                fread(index.ids.data(), sizeof(uint32_t), index.ids.size(), fp) == index.ids.size();
+    }
+    fclose(fp);
+
+    // 2. every member list is inside the ids and every member is an image
+    valid = valid && index.offsets[0] == 0 && index.offsets[index.nlist] == index.count;
+    for (int c = 0; valid && c < index.nlist; c++)
+    {
+        valid = index.offsets[c] <= index.offsets[c + 1];
+    }
+    for (size_t j = 0; valid && j < index.ids.size(); j++)
+    {
+        valid = index.ids[j] < index.count;
+    }
+    if (!valid)
+    {
+        printf("%s is not an IVF file of version %d\n", filepath, IVF_VERSION);
+        return -1;
+    }
+    return 0;
+}
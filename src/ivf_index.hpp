@@ -0,0 +1,121 @@
+//**********************************************************************************************************************
+// FILE: ivf_index.hpp
+//
+// DESCRIPTION
+// Approximate index that clusters the images of a feature file with k-means. Every cluster keeps
+// the list of its member images and a query only scores the members of the nprobe clusters whose
+// centroids are nearest to the target, so the work per query no longer grows with the whole
+// collection. The clusters are found with the same distance the scan ranks with and the index
+// can be saved next to the feature file.
+//
+// File layout (native byte order):
+//   ivf_header
+//   float[nlist][dim]                  centroids
+//   uint64_t[nlist + 1]                first member of every cluster
+//   uint32_t[count]                    members of every cluster, in image order
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef IVF_INDEX_H
+#define IVF_INDEX_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define IVF_TRAIN_POINTS 32    // images sampled per cluster to train the centroids
+#define IVF_TRAIN_ITERATIONS 8 // k-means rounds
+#define IVF_SEED 5489u         // seed of the training sample, the same file always gives the same index
+#define IVF_MAGIC "FIIF"
+#define IVF_VERSION 1
+
+struct ivf_header
+{
+  char magic[4];         // IVF_MAGIC
+  uint32_t version;      // IVF_VERSION
+  uint32_t feature_type; // feature_function of the rows the centroids were trained on
+  uint32_t dim;
+  uint64_t count;
+  uint32_t nlist;
+  uint32_t reserved;
+  fi_source source;
+};
+
+/*
+  The centroids and the member lists of every cluster, the members of cluster c are
+  ids[offsets[c], offsets[c + 1]), in image order
+ */
+struct ivf_index
+{
+  int dim;
+  int nlist; // clusters
+  size_t count; // images
+  feature_function func;
+  fi_source source; // feature file of the rows, set by the caller before saving
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  vector<float> centroids; // nlist * dim
+  vector<uint64_t> offsets;
+  vector<uint32_t> ids;
+};
+
+struct ivf_search_params
+{
+  int nprobe; // clusters scored per query, nlist scores every image
+};
+
+/*
+  A number of clusters for rows images, about 4 * sqrt(rows)
+ */
+int ivf_default_lists(size_t rows);
+
+/*
+  The clusters of an index of rows images asked for nlist, 0 uses ivf_default_lists, never more
+  than the images
+ */
+int ivf_list_count(size_t rows, int nlist);
+
+/*
+  Trains nlist centroids on a sample of the rows of fis and files every row under its nearest
+  centroid. The sample is scored on the shared thread pool, see set_scan_threads.
+  @params func the function that created fis, gives the distance
+  @params nlist clusters, 0 uses ivf_default_lists
+  The function returns 0 on success.
+ */
+int build_ivf_index(ivf_index &index, const feature_matrix &fis, feature_function func, int nlist = 0);
+
+/*
+  Same on quantized rows, the centroids are trained on their values
+ */
+int build_ivf_index(ivf_index &index, const quant_matrix &fis, feature_function func, int nlist = 0);
+
+/*
+  Top k of every target in fts among the members of its nprobe nearest clusters. The targets are
+  spread over the shared thread pool.
+  @params fis the rows the index was built on
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > search_ivf_index(const ivf_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const ivf_search_params &params);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis
+ */
+vector<vector<fi_match> > search_ivf_index(const ivf_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const ivf_search_params &params);
+
+/*
+  Writes the centroids and member lists to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_ivf_index(const ivf_index &index, const char *filepath);
+
+/*
+  Reads an index written by save_ivf_index
+  The function returns a non-zero value if the file is missing or not an index of this version.
+ */
+int load_ivf_index(const char *filepath, ivf_index &index);
+
+#endif
@@ -0,0 +1,479 @@
+//**********************************************************************************************************************
+// FILE: lsh_index.cpp
+//
+// DESCRIPTION
+// Contains implementation for building, saving and loading the hash tables and the multi-probe search
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+#include "lsh_index.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+void default_lsh_params(lsh_params &params)
+{
+    params.tables = 16;
+    params.hashes = 8;
+    params.width = 0;
+}
+
+// position of v on the hashes of table t, in bucket widths
+static void project(const lsh_index &index, int t, const float *v, float *pos)
+{
+    for (int h = 0; h < index.hashes; h++)
+    {
+        const float *a = &index.projections[((size_t)t * index.hashes + h) * index.dim];
+        float dot = 0;
+        for (int d = 0; d < index.dim; d++)
+        {
+            dot += a[d] * v[d];
+        }
+        pos[h] = (dot + index.shifts[t * index.hashes + h]) / index.width;
+    }
+}
+
+// FNV-1a over the buckets of the hashes of a table
+static uint64_t bucket_key(const int32_t *cells, int n)
+{
+    uint64_t key = 1469598103934665603ull;
+    for (int i = 0; i < n; i++)
+    {
+        key = (key ^ (uint32_t)cells[i]) * 1099511628211ull;
+    }
+    return key;
+}
+
+// LSH_WIDTH_SCALE times the median distance of a sample of images to their nearest neighbour
+// in a larger sample
+static float pick_width(const lsh_index &index, const fi_rows &m)
+{
+    vector<uint32_t> order(m.rows);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        order[i] = i;
+    }
+    mt19937 rng(LSH_SEED);
+    shuffle(order.begin(), order.end(), rng);
+    size_t queries = min(m.rows, (size_t)LSH_WIDTH_SAMPLE);
+    size_t base = min(m.rows, (size_t)LSH_WIDTH_SAMPLE * 16);
+
+    vector<float> nearest(queries, 0);
+    shared_thread_pool().run(queries, [&](size_t q, int) {
+        float best = numeric_limits<float>::infinity();
+        for (size_t j = 0; j < base; j++)
+        {
+            float d = compute_segment_distance(fr_row(m, order[q]), fr_row(m, order[j]), m.type, m.scale, index.segments,
+                                               index.segment_count);
+            if (j != q && d > 0 && d < best)
+            {
+                best = d;
+            }
+        }
+        nearest[q] = isinf(best) ? 0 : sqrt(best);
+    });
+    nth_element(nearest.begin(), nearest.begin() + queries / 2, nearest.end());
+    float width = LSH_WIDTH_SCALE * nearest[queries / 2];
+    return width > 0 ? width : 1;
+}
+
+// the segments of func, false unless every one of them is an SSD
+static bool ssd_segments(lsh_index &index, feature_function func, int dim)
+{
+    index.segment_count = get_feature_segments(func, dim, index.segments);
+    for (int s = 0; s < index.segment_count; s++)
+    {
+        if (index.segments[s].metric != ssd_metric)
+        {
+            printf("LSH index only hashes SSD features\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// sorts the ids of a table by key in place, ids starts as 0, 1, ... so keys[id] is the key of
+// an id until the keys are moved along the sorted ids, one cycle of the permutation at a time
+static size_t sort_table(uint64_t *keys, uint32_t *ids, size_t rows)
+{
+    sort(ids, ids + rows, [&](uint32_t a, uint32_t b) {
+        return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+    });
+    vector<bool> moved(rows, false);
+    for (size_t i = 0; i < rows; i++)
+    {
+        if (moved[i])
+        {
+            continue;
+        }
+        uint64_t first = keys[i];
+        size_t j = i;
+        while (ids[j] != i)
+        {
+            keys[j] = keys[ids[j]];
+            moved[j] = true;
+            j = ids[j];
+        }
+        keys[j] = first;
+        moved[j] = true;
+    }
+    size_t buckets = 0;
+    for (size_t j = 0; j < rows; j++)
+    {
+        buckets += j == 0 || keys[j] != keys[j - 1];
+    }
+    return buckets;
+}
+
+static int build_tables(lsh_index &index, const fi_rows &m, feature_function func, const lsh_params &params)
+{
+    if (!ssd_segments(index, func, m.dim))
+    {
+        return -1;
+    }
+    if (m.rows == 0 || m.rows > UINT32_MAX || params.tables < 1 || params.hashes < 1)
+    {
+        printf("Cannot build an LSH index of %lu images with %d tables of %d hashes\n", m.rows, params.tables, params.hashes);
+        return -1;
+    }
+    index.dim = m.dim;
+    index.count = m.rows;
+    index.func = func;
+    index.tables = params.tables;
+    index.hashes = params.hashes;
+    index.width = params.width > 0 ? params.width : pick_width(index, m);
+    index.params_width = params.width > 0 ? params.width : 0;
+    memset(&index.source, 0, sizeof(index.source));
+
+    // 1. Gaussian directions in the space where the SSD is weighted by the segments
+    vector<float> scale(m.dim, 0);
+    for (int s = 0; s < index.segment_count; s++)
+    {
+        for (int d = index.segments[s].offset; d < index.segments[s].offset + index.segments[s].length && d < m.dim; d++)
+        {
+            scale[d] = sqrt(index.segments[s].weight);
+        }
+    }
+    mt19937 rng(LSH_SEED);
+    normal_distribution<float> gauss(0, 1);
+    uniform_real_distribution<float> uniform(0, index.width);
+    int functions = index.tables * index.hashes;
+    index.projections.resize((size_t)functions * m.dim);
+    index.shifts.resize(functions);
+    for (int f = 0; f < functions; f++)
+    {
+        for (int d = 0; d < m.dim; d++)
+        {
+            index.projections[(size_t)f * m.dim + d] = gauss(rng) * scale[d];
+        }
+        index.shifts[f] = uniform(rng);
+    }
+
+    // 2. the key of every row in every table
+    index.keys.resize(m.rows * index.tables);
+    index.ids.resize(m.rows * index.tables);
+    thread_pool &pool = shared_thread_pool();
+    size_t partition = scan_partition_rows(m.row_bytes);
+    vector<vector<float> > scratch(pool.size(), vector<float>(m.dim + index.hashes));
+    vector<vector<int32_t> > cells(pool.size(), vector<int32_t>(index.hashes));
+    pool.run((m.rows + partition - 1) / partition, [&](size_t task, int worker) {
+        float *pos = &scratch[worker][m.dim];
+        for (size_t i = task * partition; i < m.rows && i < (task + 1) * partition; i++)
+        {
+            const float *v = fr_values(m, i, scratch[worker].data());
+            for (int t = 0; t < index.tables; t++)
+            {
+                project(index, t, v, pos);
+                for (int h = 0; h < index.hashes; h++)
+                {
+                    cells[worker][h] = (int32_t)floor(pos[h]);
+                }
+                index.keys[t * m.rows + i] = bucket_key(cells[worker].data(), index.hashes);
+                index.ids[t * m.rows + i] = i;
+            }
+        }
+    });
+
+    // 3. every table sorted by key in place, so a bucket is one run of it
+    vector<size_t> buckets(index.tables, 0);
+    pool.run(index.tables, [&](size_t t, int) {
+        buckets[t] = sort_table(&index.keys[t * m.rows], &index.ids[t * m.rows], m.rows);
+    });
+    size_t total = 0;
+    for (int t = 0; t < index.tables; t++)
+    {
+        total += buckets[t];
+    }
+    printf("Built LSH index: %lu images, %d tables of %d hashes, width %g, %.1f images per bucket\n", m.rows, index.tables,
+           index.hashes, index.width, (double)m.rows * index.tables / total);
+    return 0;
+}
+
+int build_lsh_index(lsh_index &index, const feature_matrix &fis, feature_function func, const lsh_params &params)
+{
+    return build_tables(index, view_rows(fis), func, params);
+}
+
+int build_lsh_index(lsh_index &index, const quant_matrix &fis, feature_function func, const lsh_params &params)
+{
+    return build_tables(index, view_rows(fis), func, params);
+}
+
+typedef pair<float, vector<int> > lsh_probe; // score and steps of a probe
+
+// the probes of a table most likely to hold a neighbour its own bucket missed, best first.
+// A step moves one hash a bucket down or up and scores the square of how far the target is from
+// that edge, the probes are sets of steps generated from the cheapest up by shifting or adding
+// the last step
+static void probe_sequence(const float *pos, int hashes, int probes, vector<vector<pair<int, int> > > &sequence)
+{
+    vector<pair<float, pair<int, int> > > steps;
+    for (int h = 0; h < hashes; h++)
+    {
+        float below = pos[h] - floor(pos[h]);
+        steps.push_back(make_pair(below * below, make_pair(h, -1)));
+        steps.push_back(make_pair((1 - below) * (1 - below), make_pair(h, 1)));
+    }
+    sort(steps.begin(), steps.end());
+
+    sequence.clear();
+    priority_queue<lsh_probe, vector<lsh_probe>, greater<lsh_probe> > heap;
+    heap.push(lsh_probe(steps[0].first, vector<int>(1, 0)));
+    while (!heap.empty() && (int)sequence.size() < probes)
+    {
+        lsh_probe p = heap.top();
+        heap.pop();
+        int last = p.second.back();
+        if (last + 1 < (int)steps.size())
+        {
+            lsh_probe shift = p;
+            shift.second.back() = last + 1;
+            shift.first += steps[last + 1].first - steps[last].first;
+            heap.push(shift);
+            lsh_probe expand = p;
+            expand.second.push_back(last + 1);
+            expand.first += steps[last + 1].first;
+            heap.push(expand);
+        }
+
+        // a set that moves one hash both ways is no bucket
+        bool valid = true;
+        for (size_t i = 0; i < p.second.size() && valid; i++)
+        {
+            for (size_t j = i + 1; j < p.second.size() && valid; j++)
+            {
+                valid = steps[p.second[i]].second.first != steps[p.second[j]].second.first;
+            }
+        }
+        if (valid)
+        {
+            vector<pair<int, int> > moves;
+            for (size_t i = 0; i < p.second.size(); i++)
+            {
+                moves.push_back(steps[p.second[i]].second);
+            }
+            sequence.push_back(moves);
+        }
+    }
+}
+
+static vector<vector<fi_match> > search_tables(const lsh_index &index, const fi_rows &m, const vector<vector<float> > &fts,
+                                               int k, const lsh_search_params &params)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != index.dim || m.rows != index.count)
+    {
+        printf("LSH index of %lu x %d does not match %lu x %d features\n", index.count, index.dim, m.rows, m.dim);
+        return result;
+    }
+
+    // one target per task, a candidate is scored like the full scan the first time it is found
+    thread_pool &pool = shared_thread_pool();
+    vector<vector<uint32_t> > seen(pool.size());
+    vector<uint32_t> tags(pool.size(), 0);
+    vector<uint64_t> scored(fts.size());
+    pool.run(fts.size(), [&](size_t q, int worker) {
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        abandon_plan plan;
+        abandon_stats stats;
+        clear_abandon_stats(stats);
+        create_abandon_plan(plan, target, m.type, m.scale, index.segments, index.segment_count);
+        topk top_n;
+        create_topk(top_n, k);
+        if (seen[worker].size() != index.count)
+        {
+            seen[worker].assign(index.count, 0);
+        }
+        uint32_t tag = ++tags[worker];
+        if (tag == 0)
+        {
+            fill(seen[worker].begin(), seen[worker].end(), 0);
+            tag = tags[worker] = 1;
+        }
+
+        vector<float> pos(index.hashes);
+        vector<int32_t> cells(index.hashes);
+        vector<int32_t> probe(index.hashes);
+        vector<vector<pair<int, int> > > sequence;
+        for (int t = 0; t < index.tables; t++)
+        {
+            // 1. the own bucket of the target and its probes
+            project(index, t, fts[q].data(), pos.data());
+            for (int h = 0; h < index.hashes; h++)
+            {
+                cells[h] = (int32_t)floor(pos[h]);
+            }
+            probe_sequence(pos.data(), index.hashes, params.probes, sequence);
+
+            // 2. the images of every bucket read
+            const uint64_t *keys = &index.keys[t * index.count];
+            const uint32_t *ids = &index.ids[t * index.count];
+            for (int p = -1; p < (int)sequence.size(); p++)
+            {
+                probe = cells;
+                for (size_t s = 0; p >= 0 && s < sequence[p].size(); s++)
+                {
+                    probe[sequence[p][s].first] += sequence[p][s].second;
+                }
+                uint64_t key = bucket_key(probe.data(), index.hashes);
+                for (size_t j = lower_bound(keys, keys + index.count, key) - keys; j < index.count && keys[j] == key; j++)
+                {
+                    if (seen[worker][ids[j]] == tag)
+                    {
+                        continue;
+                    }
+                    seen[worker][ids[j]] = tag;
+                    topk_push(top_n, ids[j], compute_bounded_distance(plan, target, fr_row(m, ids[j]), topk_threshold(top_n), stats));
+                }
+            }
+        }
+        scored[q] = stats.rows;
+        result[q] = topk_sorted(top_n);
+    });
+
+    uint64_t total = 0;
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        total += scored[q];
+    }
+    printf("LSH index: %d tables, %d probes, %.1f candidates of %lu images per target\n", index.tables, params.probes,
+           fts.empty() ? 0.0 : (double)total / fts.size(), index.count);
+    return result;
+}
+
+vector<vector<fi_match> > search_lsh_index(const lsh_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const lsh_search_params &params)
+{
+    return search_tables(index, view_rows(fis), fts, k, params);
+}
+
+vector<vector<fi_match> > search_lsh_index(const lsh_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const lsh_search_params &params)
+{
+    return search_tables(index, view_rows(fis), fts, k, params);
+}
+
+int save_lsh_index(const lsh_index &index, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open LSH file %s\n", filepath);
+        return -1;
+    }
+    lsh_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LSH_MAGIC, 4);
+    h.version = LSH_VERSION;
+    h.feature_type = index.func;
+    h.dim = index.dim;
+    h.count = index.count;
+    h.tables = index.tables;
+    h.hashes = index.hashes;
+    h.width = index.width;
+    h.params_width = index.params_width;
+    h.source = index.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(index.projections.data(), sizeof(float), index.projections.size(), fp) != index.projections.size();
+    err |= fwrite(index.shifts.data(), sizeof(float), index.shifts.size(), fp) != index.shifts.size();
+    err |= fwrite(index.keys.data(), sizeof(uint64_t), index.keys.size(), fp) != index.keys.size();
+    err |= fwrite(index.ids.data(), sizeof(uint32_t), index.ids.size(), fp) != index.ids.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write LSH file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_lsh_index(const char *filepath, lsh_index &index)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open LSH file %s\n", filepath);
+        return -1;
+    }
+
+    // 1. the header, the sizes are checked against the file before anything is allocated
+    lsh_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, LSH_MAGIC, 4) == 0 && h.version == LSH_VERSION &&
+                 h.count > 0 && h.count <= UINT32_MAX && h.tables > 0 && h.hashes > 0 && h.width > 0 &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.count <= (uint64_t)file_size && h.tables <= (uint64_t)file_size / h.count &&
+                 h.hashes <= (uint64_t)file_size / h.tables && h.dim <= (uint64_t)file_size &&
+                 (uint64_t)h.tables * h.hashes <= (uint64_t)file_size / ((uint64_t)h.dim + 1) &&
+                 sizeof(h) + (uint64_t)h.tables * h.hashes * ((uint64_t)h.dim + 1) * sizeof(float) +
+                         (uint64_t)h.tables * h.count * (sizeof(uint64_t) + sizeof(uint32_t)) == (uint64_t)file_size;
+    if (valid)
+    {
+        index.dim = h.dim;
+        index.count = h.count;
+        index.func = (feature_function)h.feature_type;
+        index.tables = h.tables;
+        index.hashes = h.hashes;
+        index.width = h.width;
+        index.params_width = h.params_width;
+        index.source = h.source;
+        index.projections.resize((size_t)h.tables * h.hashes * h.dim);
+        index.shifts.resize((size_t)h.tables * h.hashes);
+        index.keys.resize(h.tables * h.count);
+        index.ids.resize(h.tables * h.count);
+        valid = ssd_segments(index, index.func, index.dim) &&
+                fread(index.projections.data(), sizeof(float), index.projections.size(), fp) == index.projections.size() &&
+                fread(index.shifts.data(), sizeof(float), index.shifts.size(), fp) == index.shifts.size() &&
+                fread(index.keys.data(), sizeof(uint64_t), index.keys.size(), fp) == index.keys.size() &&
+                fread(index.ids.data(), sizeof(uint32_t), index.ids.size(), fp) == index.ids.size();
+    }
+    fclose(fp);
+
+    // 2. every table is sorted by key for the bucket lookups and holds only images
+    for (size_t j = 0; valid && j < index.ids.size(); j++)
+    {
+        valid = index.ids[j] < index.count && (j % index.count == 0 || index.keys[j - 1] <= index.keys[j]);
+    }
+    if (!valid)
+    {
+        printf("%s is not an LSH file of version %d\n", filepath, LSH_VERSION);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+//**********************************************************************************************************************
+// FILE: lsh_index.hpp
+//
+// DESCRIPTION
+// Locality sensitive hashing for the SSD features, in the E2LSH style. A hash projects a row on a
+// random Gaussian direction and cuts the line into buckets of one width, images near each other
+// in SSD tend to fall in the same bucket. Every table keys its images by several hashes at once
+// and a query collects the images of its bucket in every table, plus the neighbouring buckets it
+// is most likely to have missed (multi-probe), then scores only those candidates. The index can
+// be saved next to the feature file.
+//
+// File layout (native byte order):
+//   lsh_header
+//   float[tables * hashes][dim]        projections
+//   float[tables * hashes]             shifts
+//   uint64_t[tables][count]            keys of every table, sorted
+//   uint32_t[tables][count]            ids of every table
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef LSH_INDEX_H
+#define LSH_INDEX_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define LSH_SEED 5489u          // seed of the projections, the same file always gives the same index
+#define LSH_WIDTH_SCALE 4.0f    // bucket width in nearest neighbour distances when the width is picked
+#define LSH_WIDTH_SAMPLE 256    // images whose nearest neighbour distance picks the width
+#define LSH_MAGIC "FILS"
+#define LSH_VERSION 1
+
+struct lsh_params
+{
+  int tables;  // independent tables, more find more neighbours
+  int hashes;  // hashes per table key, more make the buckets smaller
+  float width; // bucket width, 0 picks it from the rows
+};
+
+struct lsh_search_params
+{
+  int probes; // buckets read per table besides the target's own
+};
+
+struct lsh_header
+{
+  char magic[4];         // LSH_MAGIC
+  uint32_t version;      // LSH_VERSION
+  uint32_t feature_type; // feature_function of the rows the tables hash
+  uint32_t dim;
+  uint64_t count;
+  uint32_t tables;
+  uint32_t hashes;
+  float width;
+  float params_width;    // width of the build params, 0 if it was picked
+  fi_source source;
+};
+
+/*
+  The tables, table t keys image ids[t * count + j] by keys[t * count + j], sorted by key
+ */
+struct lsh_index
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  int tables;
+  int hashes;
+  float width;
+  float params_width; // width of the build params, 0 if width was picked from the rows
+  fi_source source;   // feature file of the rows, set by the caller before saving
+  vector<float> projections; // tables * hashes directions of dim, scaled by the root of the segment weights
+  vector<float> shifts;      // tables * hashes offsets in [0, width)
+  vector<uint64_t> keys;
+  vector<uint32_t> ids;
+};
+
+/*
+  Sets 16 tables of 8 hashes with the width picked from the rows
+ */
+void default_lsh_params(lsh_params &params);
+
+/*
+  Draws the projections and files every row of fis in every table, on the shared thread pool
+  @params func the function that created fis, every segment of it must be an SSD
+  The function returns 0 on success.
+ */
+int build_lsh_index(lsh_index &index, const feature_matrix &fis, feature_function func, const lsh_params &params);
+
+/*
+  Same on quantized rows, they are hashed by their values
+ */
+int build_lsh_index(lsh_index &index, const quant_matrix &fis, feature_function func, const lsh_params &params);
+
+/*
+  Approximate top k of every target in fts among the images of its buckets, the targets are
+  spread over the shared thread pool
+  @params fis the rows the index was built on, the candidates are scored on them like the scan
+  The function returns the k matches with the minimum errors of every target, best first,
+  fewer if the buckets hold fewer than k images.
+ */
+vector<vector<fi_match> > search_lsh_index(const lsh_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const lsh_search_params &params);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis for the scoring
+ */
+vector<vector<fi_match> > search_lsh_index(const lsh_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                           int k, const lsh_search_params &params);
+
+/*
+  Writes the projections and tables to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_lsh_index(const lsh_index &index, const char *filepath);
+
+/*
+  Reads an index written by save_lsh_index
+  The function returns a non-zero value if the file is missing or not an index of this version.
+ */
+int load_lsh_index(const char *filepath, lsh_index &index);
+
+#endif
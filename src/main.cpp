@@ -22,13 +22,13 @@ int main(int argc, char const *argv[])
     // Task 1
     // Part 1. Compute feature vector for database and save to a file
     cout << "\nCompute feature 1.." << endl;
-    char fi1_csv[] = "../res/fi1.csv";
-    compute_fis(argc, argv, fi1_csv, pixel_func);
+    char fi1_bin[] = "../res/fi1.bin";
+    compute_fis(argc, argv, fi1_bin, pixel_func);
 
     // Part 2. Given target image, the feature function enum, database fis
     // - computes the features for the target image, - reads the fis
     // - identifies the top N matches
-    get_top_n(t, fi1_csv, pixel_func);
+    get_top_n(t, fi1_bin, pixel_func);
 
 
     //-----------------------------------------------------------------
@@ -36,33 +36,33 @@ int main(int argc, char const *argv[])
     cout << "\nCompute feature 2.." << endl;
 
     // Part 1. Compute feature vector for database and save to a file
-    char fi2_csv[] = "../res/fi2.csv";
-    compute_fis(argc, argv, fi2_csv, rgb_func);
+    char fi2_bin[] = "../res/fi2.bin";
+    compute_fis(argc, argv, fi2_bin, rgb_func);
 
     // Part 2.
     t = cv::imread("../olympus/pic.0164.jpg", 1);
-    get_top_n(t, fi2_csv, rgb_func);
+    get_top_n(t, fi2_bin, rgb_func);
 
     //-----------------------------------------------------------------
     // Task 3
-    char fi3_csv[] = "../res/fi3.csv";
+    char fi3_bin[] = "../res/fi3.bin";
     cout << "\nCompute feature 3.." << endl;
-    compute_fis(argc, argv, fi3_csv, top_bom_func);
+    compute_fis(argc, argv, fi3_bin, top_bom_func);
 
     t = cv::imread("../olympus/pic.0923.jpg", 1);
-    get_top_n(t, fi3_csv, top_bom_func);
+    get_top_n(t, fi3_bin, top_bom_func);
 
     //-----------------------------------------------------------------
     // Task 4
     cout << "\nCompute feature 4.." << endl;
 
     // 1. get fis
-    char fi4_csv[] = "../res/fi4.csv";
-    compute_fis(argc, argv, fi4_csv, rgb_mag_func);
+    char fi4_bin[] = "../res/fi4.bin";
+    compute_fis(argc, argv, fi4_bin, rgb_mag_func);
 
     // 2. get top n
     t = cv::imread("../olympus/pic.1012.jpg", 1);
-    get_top_n(t, fi4_csv, rgb_mag_func);
+    get_top_n(t, fi4_bin, rgb_mag_func);
 
 
     //-----------------------------------------------------------------
@@ -70,11 +70,11 @@ int main(int argc, char const *argv[])
     cout << "\nCompute feature 5.." << endl;
 
     // 1. get fis
-    char fi5_csv[] = "../res/fi5.csv";
-    compute_fis(argc, argv, fi5_csv, rg_magori_func);
+    char fi5_bin[] = "../res/fi5.bin";
+    compute_fis(argc, argv, fi5_bin, rg_magori_func);
 
     //2. get top n
     t = cv::imread("../subset3/pic.0344.jpg", 1);
-    get_top_n(t, fi5_csv, rg_magori_func); 
+    get_top_n(t, fi5_bin, rg_magori_func); 
     // show_img(ti);
 }
@@ -0,0 +1,63 @@
+//**********************************************************************************************************************
+// FILE: name_table.cpp
+//
+// DESCRIPTION
+// Contains implementation for the interned image name table
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstring>
+#include "name_table.hpp"
+
+void create_name_table(name_table &t)
+{
+    t.arena_offsets.assign(1, 0);
+    t.arena.clear();
+    t.count = 0;
+    t.offsets = t.arena_offsets.data();
+    t.chars = t.arena.data();
+}
+
+void view_name_table(name_table &t, const uint64_t *offsets, const char *chars, size_t count)
+{
+    t.arena_offsets.clear();
+    t.arena.clear();
+    t.count = count;
+    t.offsets = offsets;
+    t.chars = chars;
+}
+
+bool check_name_table(const uint64_t *offsets, const char *chars, size_t count, uint64_t chars_size)
+{
+    if (offsets[0] != 0 || offsets[count] != chars_size)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (offsets[i + 1] <= offsets[i] || offsets[i + 1] > chars_size || chars[offsets[i + 1] - 1] != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t add_name(name_table &t, const char *name, size_t len)
+{
+    t.arena.append(name, len);
+    t.arena.push_back('\0');
+    t.arena_offsets.push_back(t.arena.size());
+
+    // the arena may have moved
+    t.offsets = t.arena_offsets.data();
+    t.chars = t.arena.data();
+    return t.count++;
+}
+
+uint32_t add_name(name_table &t, const char *name)
+{
+    return add_name(t, name, strlen(name));
+}
@@ -0,0 +1,81 @@
+//**********************************************************************************************************************
+// FILE: name_table.hpp
+//
+// DESCRIPTION
+// Image names interned in one string arena. An image is identified everywhere in the scan and
+// ranking code by its 32 bit id, the row of its features, and the name is only looked up
+// when the results are printed. The table is either built in memory name by name or is a
+// view of the name table of a mapped feature file, which has the same layout.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef NAME_TABLE_H
+#define NAME_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <string>
+using namespace std;
+
+/*
+  count names, name id starts at chars + offsets[id] and is 0-terminated.
+  offsets and chars point into the arena or into a mapped file, so a table
+  is passed by reference and never copied.
+ */
+struct name_table
+{
+  size_t count;
+  const uint64_t *offsets;       // count + 1 offsets into chars
+  const char *chars;             // 0-terminated names back to back
+  vector<uint64_t> arena_offsets; // storage of a table built in memory
+  string arena;
+};
+
+/*
+  Initialises an empty in-memory table
+ */
+void create_name_table(name_table &t);
+
+/*
+  Makes t a view of count names laid out like the name table of a feature file
+ */
+void view_name_table(name_table &t, const uint64_t *offsets, const char *chars, size_t count);
+
+/*
+  Checks the name table of a mapped file before it is viewed, the offsets start at 0, grow with
+  every name, end at chars_size and every name ends with its 0.
+  The function returns false if a name would be read outside chars.
+ */
+bool check_name_table(const uint64_t *offsets, const char *chars, size_t count, uint64_t chars_size);
+
+/*
+  Copies the len chars of name to the end of the arena
+  Returns the id of the name.
+ */
+uint32_t add_name(name_table &t, const char *name, size_t len);
+uint32_t add_name(name_table &t, const char *name);
+
+/*
+  0-terminated name of image id
+ */
+inline const char *nt_name(const name_table &t, uint32_t id)
+{
+  return t.chars + t.offsets[id];
+}
+
+/*
+  Byte size of the offsets and the chars as they are written to a feature file
+ */
+inline size_t nt_offsets_size(const name_table &t)
+{
+  return (t.count + 1) * sizeof(uint64_t);
+}
+
+inline size_t nt_chars_size(const name_table &t)
+{
+  return t.offsets[t.count];
+}
+
+#endif
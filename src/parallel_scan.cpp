@@ -0,0 +1,145 @@
+//**********************************************************************************************************************
+// FILE: parallel_scan.cpp
+//
+// DESCRIPTION
+// Contains implementation for the worker thread pool used by the database scans
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cstdio>
+#include "parallel_scan.hpp"
+
+thread_pool::thread_pool(int size)
+    : job(NULL), job_tasks(0), next_task(0), busy(0), generation(0), stop(false)
+{
+    for (int w = 1; w < size; w++)
+    {
+        workers.push_back(thread(&thread_pool::work, this, w));
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        workers[w].join();
+    }
+}
+
+int thread_pool::size() const
+{
+    return workers.size() + 1;
+}
+
+void thread_pool::drain(int worker)
+{
+    for (size_t task = next_task++; task < job_tasks; task = next_task++)
+    {
+        (*job)(task, worker);
+    }
+}
+
+void thread_pool::work(int worker)
+{
+    unsigned long seen = 0;
+    for (;;)
+    {
+        // 1. sleep until there is a new job
+        {
+            unique_lock<mutex> guard(lock);
+            while (!stop && generation == seen)
+            {
+                wake.wait(guard);
+            }
+            if (stop)
+            {
+                return;
+            }
+            seen = generation;
+        }
+
+        // 2. take tasks until there are none left
+        drain(worker);
+
+        // 3. the last worker to finish wakes the caller
+        unique_lock<mutex> guard(lock);
+        if (--busy == 0)
+        {
+            done.notify_one();
+        }
+    }
+}
+
+void thread_pool::run(size_t tasks, const function<void(size_t, int)> &fn)
+{
+    lock_guard<mutex> one_job(run_lock);
+    {
+        unique_lock<mutex> guard(lock);
+        job = &fn;
+        job_tasks = tasks;
+        next_task = 0;
+        busy = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    // the caller is worker 0
+    drain(0);
+
+    unique_lock<mutex> guard(lock);
+    while (busy > 0)
+    {
+        done.wait(guard);
+    }
+    job = NULL;
+}
+
+static int scan_threads = 0;
+static thread_pool *pool = NULL;
+static mutex pool_lock;
+
+// threads of a pool of scan_threads
+static int pool_size()
+{
+    int size = scan_threads > 0 ? scan_threads : (int)thread::hardware_concurrency();
+    return size < 1 ? 1 : size;
+}
+
+int set_scan_threads(int threads)
+{
+    lock_guard<mutex> guard(pool_lock);
+    int previous = scan_threads;
+    scan_threads = threads;
+
+    // a pool in use is never replaced, a reference to it would dangle
+    if (pool != NULL && pool->size() != pool_size())
+    {
+        printf("The scan pool already runs %d threads\n", pool->size());
+        scan_threads = previous;
+        return (-1);
+    }
+    return (0);
+}
+
+thread_pool &shared_thread_pool()
+{
+    lock_guard<mutex> guard(pool_lock);
+    if (pool == NULL)
+    {
+        pool = new thread_pool(pool_size());
+    }
+    return *pool;
+}
+
+size_t scan_partition_rows(size_t row_bytes)
+{
+    size_t rows = SCAN_PARTITION_BYTES / (row_bytes > 0 ? row_bytes : 1);
+    return rows > 0 ? rows : 1;
+}
@@ -0,0 +1,151 @@
+//**********************************************************************************************************************
+// FILE: parallel_scan.hpp
+//
+// DESCRIPTION
+// Multithreaded database scan. The rows are split into partitions that fit in L2, a pool of
+// worker threads scores the partitions into one top-K per worker and the top-Ks are merged at
+// the end. Matches are ordered by (error, id), so the result is the same for any thread count.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef PARALLEL_SCAN_H
+#define PARALLEL_SCAN_H
+
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include "topk.hpp"
+using namespace std;
+
+#define SCAN_PARTITION_BYTES (256 * 1024) // bytes of rows scored as one task, about the size of L2
+
+/*
+  Fixed set of worker threads that run the tasks of one job at a time.
+  The thread calling run works on the job as well, so a pool of size n has n - 1 threads.
+ */
+class thread_pool
+{
+public:
+  explicit thread_pool(int size);
+  ~thread_pool();
+
+  /*
+    Number of threads working on a job, including the caller
+   */
+  int size() const;
+
+  /*
+    Calls fn(task, worker) for every task in [0, tasks) and returns when all are done.
+    worker is in [0, size()) and no two tasks run on the same worker at the same time.
+    fn must not call run on the same pool.
+   */
+  void run(size_t tasks, const function<void(size_t, int)> &fn);
+
+private:
+  void work(int worker);
+  void drain(int worker);
+
+  vector<thread> workers;
+  mutex run_lock; // one job at a time
+  mutex lock;
+  condition_variable wake;
+  condition_variable done;
+  const function<void(size_t, int)> *job;
+  size_t job_tasks;
+  atomic<size_t> next_task;
+  int busy;
+  unsigned long generation;
+  bool stop;
+};
+
+/*
+  Sets the number of threads of the shared pool, 0 uses every core. The pool is sized once, on
+  first use, and callers keep a reference to it, so this has to be called before any scan.
+  The function returns a non-zero value if the pool already runs with another size.
+ */
+int set_scan_threads(int threads);
+
+/*
+  Pool used by the scans, created on first use
+ */
+thread_pool &shared_thread_pool();
+
+/*
+  Number of rows of row_bytes scored as one task
+ */
+size_t scan_partition_rows(size_t row_bytes);
+
+/*
+  Scores rows [0, rows) against several queries on the shared pool and returns the best k of
+  every query, best first. A task takes one partition of rows and scores it for every query in
+  turn, so the partition is read from memory once and stays in L2 for all of them.
+  score(query, id, threshold, worker) may give any error above threshold to a row that cannot
+  beat it, threshold is the k-th best error of that query the worker has seen so far.
+  @params row_bytes size of one row, used to size the partitions
+ */
+template <typename Score>
+vector<vector<fi_match> > parallel_top_k_batch(size_t rows, size_t row_bytes, size_t queries, int k, Score score)
+{
+  thread_pool &pool = shared_thread_pool();
+  size_t partition = scan_partition_rows(row_bytes);
+  size_t tasks = (rows + partition - 1) / partition;
+
+  // 1. one top-K per worker and query, filled by whichever partitions the worker takes
+  vector<topk> local(pool.size() * queries);
+  for (size_t t = 0; t < local.size(); t++)
+  {
+    create_topk(local[t], k);
+  }
+  pool.run(tasks, [&](size_t task, int worker) {
+    size_t end = (task + 1) * partition < rows ? (task + 1) * partition : rows;
+    for (size_t q = 0; q < queries; q++)
+    {
+      topk &top_n = local[worker * queries + q];
+      for (size_t i = task * partition; i < end; i++)
+      {
+        topk_push(top_n, i, score(q, i, topk_threshold(top_n), worker));
+      }
+    }
+  });
+
+  // 2. merge, the (error, id) order makes this independent of which worker saw what
+  vector<vector<fi_match> > result(queries);
+  for (size_t q = 0; q < queries; q++)
+  {
+    topk top_n;
+    create_topk(top_n, k);
+    for (int w = 0; w < pool.size(); w++)
+    {
+      topk_merge(top_n, local[w * queries + q]);
+    }
+    result[q] = topk_sorted(top_n);
+  }
+  return result;
+}
+
+/*
+  Same for one query, score(id, threshold, worker)
+ */
+template <typename Score>
+vector<fi_match> parallel_top_k_bounded(size_t rows, size_t row_bytes, int k, Score score)
+{
+  return parallel_top_k_batch(rows, row_bytes, 1, k, [&](size_t, size_t i, float threshold, int worker) {
+    return score(i, threshold, worker);
+  })[0];
+}
+
+/*
+  Same with score(id), every row is scored in full
+ */
+template <typename Score>
+vector<fi_match> parallel_top_k(size_t rows, size_t row_bytes, int k, Score score)
+{
+  return parallel_top_k_bounded(rows, row_bytes, k, [&](size_t i, float, int) { return score(i); });
+}
+
+#endif
@@ -0,0 +1,441 @@
+//**********************************************************************************************************************
+// FILE: pq_index.cpp
+//
+// DESCRIPTION
+// Contains implementation for training, encoding, scanning, saving and loading product quantized codes
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include "pq_index.hpp"
+#include "distance_kernels.hpp"
+#include "parallel_scan.hpp"
+
+void default_pq_params(pq_params &params, int dim)
+{
+    params.nsub = (dim + 7) / 8;
+    params.bits = 8;
+}
+
+// the centroid of a run nearest to v
+static int nearest_code(const float *v, const float *centroids, int ksub, int dsub, float &dist)
+{
+    int best = 0;
+    dist = numeric_limits<float>::infinity();
+    for (int c = 0; c < ksub; c++)
+    {
+        float d = ssd_f32(v, centroids + c * dsub, dsub);
+        if (d < dist)
+        {
+            dist = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// k-means of the run at offset of the n sample rows, the first centroids are the first rows
+static void train_run(const float *sample, size_t n, size_t stride, int offset, int dsub, int ksub, float *centroids)
+{
+    for (int c = 0; c < ksub; c++)
+    {
+        memcpy(centroids + c * dsub, sample + (c % n) * stride + offset, dsub * sizeof(float));
+    }
+    vector<int> code(n);
+    vector<float> dist(n);
+    vector<double> sums((size_t)ksub * dsub);
+    vector<size_t> sizes(ksub);
+    for (int it = 0; it < PQ_TRAIN_ITERATIONS; it++)
+    {
+        fill(sums.begin(), sums.end(), 0.0);
+        fill(sizes.begin(), sizes.end(), 0);
+        for (size_t s = 0; s < n; s++)
+        {
+            const float *v = sample + s * stride + offset;
+            code[s] = nearest_code(v, centroids, ksub, dsub, dist[s]);
+            for (int d = 0; d < dsub; d++)
+            {
+                sums[(size_t)code[s] * dsub + d] += v[d];
+            }
+            sizes[code[s]] += 1;
+        }
+
+        // an empty centroid takes over the row furthest from its centroid
+        for (int c = 0; c < ksub; c++)
+        {
+            if (sizes[c] == 0)
+            {
+                size_t far = max_element(dist.begin(), dist.end()) - dist.begin();
+                memcpy(centroids + c * dsub, sample + far * stride + offset, dsub * sizeof(float));
+                dist[far] = 0;
+                continue;
+            }
+            for (int d = 0; d < dsub; d++)
+            {
+                centroids[c * dsub + d] = sums[(size_t)c * dsub + d] / sizes[c];
+            }
+        }
+    }
+}
+
+// the values of row i, padded with zeros to nsub * dsub
+static void padded_values(const fi_rows &m, size_t i, float *scratch, float *values)
+{
+    memcpy(values, fr_values(m, i, scratch), m.dim * sizeof(float));
+}
+
+int pq_run_count(int dim, int nsub)
+{
+    int dsub = (dim + nsub - 1) / nsub;
+    return (dim + dsub - 1) / dsub;
+}
+
+size_t pq_code_size(size_t count, int nsub, int bits)
+{
+    if (bits == 8)
+    {
+        return count * nsub;
+    }
+    return (count + PQ_BLOCK - 1) / PQ_BLOCK * nsub * 16;
+}
+
+static int build_codes(pq_index &index, const fi_rows &m, feature_function func, const pq_params &params)
+{
+    if (m.rows == 0 || (params.bits != 4 && params.bits != 8) || params.nsub < 1 || params.nsub > m.dim ||
+        (params.bits == 4 && params.nsub > PQ_MAX_SUB))
+    {
+        printf("Cannot build a PQ index of %lu images with %d runs of %d bit codes\n", m.rows, params.nsub, params.bits);
+        return -1;
+    }
+    index.dim = m.dim;
+    index.count = m.rows;
+    index.func = func;
+    index.segment_count = get_feature_segments(func, m.dim, index.segments);
+    index.dsub = (m.dim + params.nsub - 1) / params.nsub;
+    index.nsub = pq_run_count(m.dim, params.nsub);
+    memset(&index.source, 0, sizeof(index.source));
+    index.bits = params.bits;
+    index.ksub = 1 << params.bits;
+    size_t padded = (size_t)index.nsub * index.dsub;
+
+    // 1. a fixed random sample, as padded floats
+    vector<uint32_t> order(m.rows);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        order[i] = i;
+    }
+    mt19937 rng(PQ_SEED);
+    shuffle(order.begin(), order.end(), rng);
+    size_t n = min(m.rows, (size_t)PQ_TRAIN_ROWS);
+    vector<float> sample(n * padded, 0);
+    vector<float> scratch(m.dim);
+    for (size_t s = 0; s < n; s++)
+    {
+        padded_values(m, order[s], scratch.data(), &sample[s * padded]);
+    }
+
+    // 2. the centroids of every run, one run per task
+    thread_pool &pool = shared_thread_pool();
+    index.centroids.assign((size_t)index.nsub * index.ksub * index.dsub, 0);
+    pool.run(index.nsub, [&](size_t s, int) {
+        train_run(sample.data(), n, padded, s * index.dsub, index.dsub, index.ksub, &index.centroids[s * index.ksub * index.dsub]);
+    });
+
+    // 3. the codes, a task takes whole blocks so no two tasks write the same byte
+    size_t blocks = (m.rows + PQ_BLOCK - 1) / PQ_BLOCK;
+    if (index.bits == 8)
+    {
+        index.codes.assign(m.rows * index.nsub, 0);
+    }
+    else
+    {
+        index.codes.assign(blocks * index.nsub * 16, 0);
+    }
+    size_t partition = max((size_t)PQ_BLOCK, scan_partition_rows(m.row_bytes) / PQ_BLOCK * PQ_BLOCK);
+    vector<vector<float> > values(pool.size(), vector<float>(padded + m.dim, 0));
+    pool.run((m.rows + partition - 1) / partition, [&](size_t task, int worker) {
+        float *v = values[worker].data();
+        for (size_t i = task * partition; i < m.rows && i < (task + 1) * partition; i++)
+        {
+            padded_values(m, i, v + padded, v);
+            for (int s = 0; s < index.nsub; s++)
+            {
+                float dist;
+                uint8_t c = nearest_code(v + s * index.dsub, &index.centroids[(size_t)s * index.ksub * index.dsub],
+                                         index.ksub, index.dsub, dist);
+                if (index.bits == 8)
+                {
+                    index.codes[i * index.nsub + s] = c;
+                }
+                else
+                {
+                    size_t j = i % PQ_BLOCK;
+                    index.codes[((i / PQ_BLOCK) * index.nsub + s) * 16 + j % 16] |= j < 16 ? c : c << 4;
+                }
+            }
+        }
+    });
+    printf("Built PQ index: %lu images, %d runs of %d features, %d bit codes, %.1f bytes per image\n", m.rows, index.nsub,
+           index.dsub, index.bits, (double)index.codes.size() / m.rows);
+    return 0;
+}
+
+int build_pq_index(pq_index &index, const feature_matrix &fis, feature_function func, const pq_params &params)
+{
+    return build_codes(index, view_rows(fis), func, params);
+}
+
+int build_pq_index(pq_index &index, const quant_matrix &fis, feature_function func, const pq_params &params)
+{
+    return build_codes(index, view_rows(fis), func, params);
+}
+
+// the distance table of target ft, entry [s][c] is what centroid c of run s adds to the error,
+// the error of an image is base plus the entries of its codes
+static float compute_tables(const pq_index &index, const float *ft, vector<float> &luts)
+{
+    // 1. weight and metric of every feature
+    size_t padded = (size_t)index.nsub * index.dsub;
+    vector<float> weight(padded, 0);
+    vector<char> ssd(padded, 0);
+    float base = 0;
+    for (int s = 0; s < index.segment_count; s++)
+    {
+        const fi_segment &seg = index.segments[s];
+        for (int d = seg.offset; d < seg.offset + seg.length && d < index.dim; d++)
+        {
+            weight[d] = seg.weight;
+            ssd[d] = seg.metric == ssd_metric;
+        }
+        base += seg.metric == intersect_metric ? seg.weight : 0;
+    }
+
+    // 2. an intersection run takes its matched mass off, an ssd run adds its squared differences
+    luts.assign((size_t)index.nsub * index.ksub, 0);
+    for (int s = 0; s < index.nsub; s++)
+    {
+        for (int c = 0; c < index.ksub; c++)
+        {
+            const float *centroid = &index.centroids[((size_t)s * index.ksub + c) * index.dsub];
+            float sum = 0;
+            for (int d = 0, f = s * index.dsub; d < index.dsub && f < index.dim; d++, f++)
+            {
+                sum += ssd[f] ? weight[f] * (ft[f] - centroid[d]) * (ft[f] - centroid[d])
+                              : -weight[f] * min(ft[f], centroid[d]);
+            }
+            luts[s * index.ksub + c] = sum;
+        }
+    }
+    return base;
+}
+
+// the best images by the 8 bit codes. Every table is shifted to start at 0, so the sum of the
+// first runs of an image is a lower bound and the image is dropped once it is above the k-th best
+static void scan_codes_u8(const pq_index &index, vector<float> &luts, float base, topk &top_n)
+{
+    for (int s = 0; s < index.nsub; s++)
+    {
+        vector<float>::iterator lut = luts.begin() + s * index.ksub;
+        float offset = *min_element(lut, lut + index.ksub);
+        for (int c = 0; c < index.ksub; c++)
+        {
+            lut[c] -= offset;
+        }
+        base += offset;
+    }
+    const uint8_t *codes = index.codes.data();
+    const float *tables = luts.data();
+    for (size_t i = 0; i < index.count; i++, codes += index.nsub)
+    {
+        float threshold = topk_threshold(top_n);
+        float dist = base;
+        for (int s = 0; s < index.nsub && dist <= threshold; s++)
+        {
+            dist += tables[s * index.ksub + codes[s]];
+        }
+        topk_push(top_n, i, dist);
+    }
+}
+
+// the best images by the 4 bit codes. The tables are quantized to uint8 with one step for all the
+// runs and an offset per run, so the fast scan sums are a scaled distance
+static void scan_codes_u4(const pq_index &index, const vector<float> &luts, float base, topk &top_n)
+{
+    vector<uint8_t> luts8(index.nsub * 16);
+    vector<float> offset(index.nsub);
+    float range = 0;
+    for (int s = 0; s < index.nsub; s++)
+    {
+        offset[s] = *min_element(luts.begin() + s * 16, luts.begin() + s * 16 + 16);
+        range = max(range, *max_element(luts.begin() + s * 16, luts.begin() + s * 16 + 16) - offset[s]);
+        base += offset[s];
+    }
+    float step = range > 0 ? range / 255 : 1;
+    for (int s = 0; s < index.nsub; s++)
+    {
+        for (int c = 0; c < 16; c++)
+        {
+            luts8[s * 16 + c] = (uint8_t)lround((luts[s * 16 + c] - offset[s]) / step);
+        }
+    }
+
+    uint16_t sums[PQ_BLOCK];
+    size_t blocks = (index.count + PQ_BLOCK - 1) / PQ_BLOCK;
+    for (size_t b = 0; b < blocks; b++)
+    {
+        fastscan_u4(&index.codes[b * index.nsub * 16], luts8.data(), index.nsub, sums);
+        for (size_t j = 0; j < PQ_BLOCK && b * PQ_BLOCK + j < index.count; j++)
+        {
+            topk_push(top_n, b * PQ_BLOCK + j, base + step * sums[j]);
+        }
+    }
+}
+
+static vector<vector<fi_match> > search_codes(const pq_index &index, const fi_rows &m, const vector<vector<float> > &fts,
+                                              int k, const pq_search_params &params)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != index.dim || m.rows != index.count)
+    {
+        printf("PQ index of %lu x %d does not match %lu x %d features\n", index.count, index.dim, m.rows, m.dim);
+        return result;
+    }
+    int shortlist = max(k, params.rerank);
+
+    // one target per task
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        // 1. the best shortlist by code
+        vector<float> luts;
+        float base = compute_tables(index, fts[q].data(), luts);
+        topk top_n;
+        create_topk(top_n, shortlist);
+        if (index.bits == 8)
+        {
+            scan_codes_u8(index, luts, base, top_n);
+        }
+        else
+        {
+            scan_codes_u4(index, luts, base, top_n);
+        }
+        result[q] = topk_sorted(top_n);
+        if (params.rerank <= 0)
+        {
+            return;
+        }
+
+        // 2. scored again on the rows, on the codes of the rows if they are quantized
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        create_topk(top_n, k);
+        for (size_t i = 0; i < result[q].size(); i++)
+        {
+            uint32_t id = result[q][i].id;
+            topk_push(top_n, id, compute_segment_distance(target, fr_row(m, id), m.type, m.scale, index.segments, index.segment_count));
+        }
+        result[q] = topk_sorted(top_n);
+    });
+    printf("PQ index: %d runs of %d bit codes, re-ranked %d of %lu images per target\n", index.nsub, index.bits,
+           params.rerank > 0 ? shortlist : 0, index.count);
+    return result;
+}
+
+vector<vector<fi_match> > search_pq_index(const pq_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                          int k, const pq_search_params &params)
+{
+    return search_codes(index, view_rows(fis), fts, k, params);
+}
+
+vector<vector<fi_match> > search_pq_index(const pq_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                          int k, const pq_search_params &params)
+{
+    return search_codes(index, view_rows(fis), fts, k, params);
+}
+
+int save_pq_index(const pq_index &index, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open PQ file %s\n", filepath);
+        return -1;
+    }
+    pq_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PQ_MAGIC, 4);
+    h.version = PQ_VERSION;
+    h.feature_type = index.func;
+    h.dim = index.dim;
+    h.count = index.count;
+    h.nsub = index.nsub;
+    h.dsub = index.dsub;
+    h.bits = index.bits;
+    h.code_size = index.codes.size();
+    h.source = index.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(index.centroids.data(), sizeof(float), index.centroids.size(), fp) != index.centroids.size();
+    err |= fwrite(index.codes.data(), 1, index.codes.size(), fp) != index.codes.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write PQ file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_pq_index(const char *filepath, pq_index &index)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open PQ file %s\n", filepath);
+        return -1;
+    }
+    // the runs have to cover dim like the build cuts them and the codes have to be every image,
+    // the sizes are checked against the file before anything is allocated
+    pq_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, PQ_MAGIC, 4) == 0 && h.version == PQ_VERSION &&
+                 (h.bits == 4 || h.bits == 8) && h.nsub > 0 && h.dsub > 0 && h.count > 0 &&
+                 h.nsub <= h.dim && h.dsub <= h.dim && (h.bits == 8 || h.nsub <= PQ_MAX_SUB) &&
+                 h.dsub == (h.dim + h.nsub - 1) / h.nsub && (int)h.nsub == pq_run_count(h.dim, h.nsub) &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.count <= (uint64_t)file_size && h.code_size == pq_code_size(h.count, h.nsub, h.bits) &&
+                 sizeof(h) + ((uint64_t)h.nsub * (1 << h.bits) * h.dsub) * sizeof(float) + h.code_size == (uint64_t)file_size;
+    if (valid)
+    {
+        index.dim = h.dim;
+        index.count = h.count;
+        index.func = (feature_function)h.feature_type;
+        index.segment_count = get_feature_segments(index.func, index.dim, index.segments);
+        index.nsub = h.nsub;
+        index.dsub = h.dsub;
+        index.bits = h.bits;
+        index.ksub = 1 << h.bits;
+        index.source = h.source;
+        index.centroids.resize((size_t)index.nsub * index.ksub * index.dsub);
+        index.codes.resize(h.code_size);
+        valid = fread(index.centroids.data(), sizeof(float), index.centroids.size(), fp) == index.centroids.size() &&
+                fread(index.codes.data(), 1, index.codes.size(), fp) == index.codes.size();
+    }
+    fclose(fp);
+    if (!valid)
+    {
+        printf("%s is not a PQ file of version %d\n", filepath, PQ_VERSION);
+        return -1;
+    }
+    return 0;
+}
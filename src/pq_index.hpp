@@ -0,0 +1,140 @@
+//**********************************************************************************************************************
+// FILE: pq_index.hpp
+//
+// DESCRIPTION
+// Product quantization of the rows of a feature file. The features are cut into nsub runs and
+// every run of an image is replaced by the number of its nearest centroid, so an image takes nsub
+// bytes, or nsub / 2 with 4 bit codes, instead of a full row. The distances of every run of the
+// target to every centroid go into a table once per query, and the distance to an image is the
+// sum of the entries its codes pick. 4 bit codes are laid out in blocks of 32 images so the
+// tables fit in a register and are looked up with byte shuffles. The best images by code can be
+// re-ranked against their full rows.
+//
+// File layout (native byte order):
+//   pq_header
+//   float[nsub][ksub][dsub]            centroids, features past dim are 0
+//   uint8_t[code_size]                 codes, see pq_index
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef PQ_INDEX_H
+#define PQ_INDEX_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define PQ_MAGIC "FIPQ"
+#define PQ_VERSION 2
+#define PQ_TRAIN_ROWS 16384    // images sampled to train the centroids
+#define PQ_TRAIN_ITERATIONS 10 // k-means rounds per run
+#define PQ_SEED 5489u          // seed of the training sample
+#define PQ_BLOCK 32            // images per block of 4 bit codes
+#define PQ_MAX_SUB 256         // runs of a 4 bit index, so the uint16 sums of the fast scan cannot overflow
+
+struct pq_params
+{
+  int nsub; // runs the features are cut into
+  int bits; // 8 for 256 centroids per run, 4 for 16 and the fast scan
+};
+
+struct pq_search_params
+{
+  int rerank; // best images by code scored again on their full rows, 0 ranks on the codes only
+};
+
+struct pq_header
+{
+  char magic[4];         // PQ_MAGIC
+  uint32_t version;      // PQ_VERSION
+  uint32_t feature_type; // feature_function of the rows
+  uint32_t dim;
+  uint64_t count;
+  uint32_t nsub;
+  uint32_t dsub;
+  uint32_t bits;
+  uint32_t reserved;
+  uint64_t code_size;    // bytes of codes
+  fi_source source;
+};
+
+/*
+  Centroids and codes. With 8 bits the codes of image i are codes[i * nsub, (i + 1) * nsub).
+  With 4 bits block b holds images [32 b, 32 b + 32) as nsub rows of 16 bytes, see fastscan_u4.
+ */
+struct pq_index
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  int nsub;
+  int dsub; // features per run
+  int bits;
+  int ksub; // centroids per run
+  fi_source source; // feature file of the rows, set by the caller before saving
+  vector<float> centroids;
+  vector<uint8_t> codes;
+};
+
+/*
+  Sets runs of 8 features with 8 bit codes
+ */
+void default_pq_params(pq_params &params, int dim);
+
+/*
+  Runs of a dim feature row asked to be cut into nsub, every run but the last has the same
+  number of features so there can be fewer
+ */
+int pq_run_count(int dim, int nsub);
+
+/*
+  Bytes of the codes of count images in nsub runs of bits
+ */
+size_t pq_code_size(size_t count, int nsub, int bits);
+
+/*
+  Trains the centroids of every run by k-means on squared differences over a sample of fis and
+  encodes every row. The runs are trained and the rows encoded on the shared thread pool.
+  @params func the function that created fis, gives the distance the tables hold
+  The function returns 0 on success.
+ */
+int build_pq_index(pq_index &index, const feature_matrix &fis, feature_function func, const pq_params &params);
+
+/*
+  Same on quantized rows, the centroids are trained on their values
+ */
+int build_pq_index(pq_index &index, const quant_matrix &fis, feature_function func, const pq_params &params);
+
+/*
+  Top k of every target in fts by the distance of its table, the targets are spread over the
+  shared thread pool. The best max(k, params.rerank) by code are scored again on the rows of fis
+  if params.rerank is set.
+  @params fis the rows the index was built on
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > search_pq_index(const pq_index &index, const feature_matrix &fis, const vector<vector<float> > &fts,
+                                          int k, const pq_search_params &params);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis for the re-ranking
+ */
+vector<vector<fi_match> > search_pq_index(const pq_index &index, const quant_matrix &fis, const vector<vector<float> > &fts,
+                                          int k, const pq_search_params &params);
+
+/*
+  Writes the centroids and codes to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_pq_index(const pq_index &index, const char *filepath);
+
+/*
+  Reads an index written by save_pq_index, the runs and codes are checked against dim and count
+  The function returns a non-zero value if the file is missing or not an index of this version.
+ */
+int load_pq_index(const char *filepath, pq_index &index);
+
+#endif
@@ -0,0 +1,230 @@
+//**********************************************************************************************************************
+// FILE: quantize.cpp
+//
+// DESCRIPTION
+// Contains implementation for quantizing feature vectors and the integer distance kernels
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "quantize.hpp"
+
+size_t fi_elem_size(fi_elem_type type)
+{
+    if (type == fi_u8)
+    {
+        return 1;
+    }
+    else if (type == fi_u16)
+    {
+        return 2;
+    }
+    return sizeof(float);
+}
+
+size_t fi_elem_stride(int dim, fi_elem_type type)
+{
+    size_t per_line = FM_ALIGN / fi_elem_size(type);
+    return (dim + per_line - 1) / per_line * per_line;
+}
+
+uint32_t fi_code_max(fi_elem_type type)
+{
+    return type == fi_u8 ? 255 : 65535;
+}
+
+void quantize_fi(const float *fi, int dim, fi_elem_type type, float scale, void *codes)
+{
+    float code_max = fi_code_max(type);
+    for (int i = 0; i < dim; i++)
+    {
+        float code = roundf(fi[i] / scale);
+        code = code < 0 ? 0 : (code > code_max ? code_max : code);
+        if (type == fi_u8)
+        {
+            ((uint8_t *)codes)[i] = (uint8_t)code;
+        }
+        else
+        {
+            ((uint16_t *)codes)[i] = (uint16_t)code;
+        }
+    }
+}
+
+void dequantize_fi(const void *codes, int dim, fi_elem_type type, float scale, float *fi)
+{
+    for (int i = 0; i < dim; i++)
+    {
+        uint32_t code = type == fi_u8 ? ((const uint8_t *)codes)[i] : ((const uint16_t *)codes)[i];
+        fi[i] = code * scale;
+    }
+}
+
+fi_rows view_rows(const feature_matrix &m)
+{
+    fi_rows r = {(const char *)m.data, m.rows, m.dim, m.stride * sizeof(float), fi_f32, 1};
+    return r;
+}
+
+fi_rows view_rows(const quant_matrix &m)
+{
+    fi_rows r = {(const char *)m.data, m.rows, m.dim, m.stride * fi_elem_size(m.type), m.type, m.scale};
+    return r;
+}
+
+#ifdef __SSE2__
+// sum of the two 64 bit lanes
+static inline uint64_t hsum_epi64(__m128i v)
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return lanes[0] + lanes[1];
+}
+#endif
+
+uint64_t intersect_u8(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint64_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // min of 16 bytes, then sad against zero adds them into two 64 bit lanes
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(va, vb), zero));
+    }
+    sum = hsum_epi64(acc);
+#endif
+    for (; i < n; i++)
+    {
+        sum += a[i] < b[i] ? a[i] : b[i];
+    }
+    return sum;
+}
+
+uint64_t intersect_u16(const uint16_t *a, const uint16_t *b, int n)
+{
+    uint64_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // SSE2 has no unsigned 16 bit min: min(a, b) = a - sat(a - b)
+    // the mins are widened to 32 bits, a lane gets two mins of every 8 elements and can take
+    // 65536 of them before it overflows, so a block is 8 * 32768 elements
+    __m128i zero = _mm_setzero_si128();
+    while (i + 8 <= n)
+    {
+        __m128i acc = zero;
+        int block_end = n - i > 8 * 32768 ? i + 8 * 32768 : n;
+        for (; i + 8 <= block_end; i += 8)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i m = _mm_sub_epi16(va, _mm_subs_epu16(va, vb));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(m, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(m, zero));
+        }
+        sum += hsum_epi64(_mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        sum += a[i] < b[i] ? a[i] : b[i];
+    }
+    return sum;
+}
+
+uint64_t ssd_u8(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint64_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // bytes are widened to 16 bits, the differences (-255..255) are squared and added
+    // in pairs by madd into 32 bit lanes. A lane gains at most 4 * 255^2 per 16 bytes,
+    // so the lanes are moved to 64 bits every 4096 iterations before they can overflow
+    __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= n)
+    {
+        __m128i acc = zero;
+        int block_end = n - i > 16 * 4096 ? i + 16 * 4096 : n;
+        for (; i + 16 <= block_end; i += 16)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(d_lo, d_lo));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(d_hi, d_hi));
+        }
+        sum += hsum_epi64(_mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int d = (int)a[i] - (int)b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+uint64_t ssd_u16(const uint16_t *a, const uint16_t *b, int n)
+{
+    uint64_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // |a - b| from two saturated subtractions, the 32 bit squares are built from
+    // the low and high halves of the 16 bit products and summed in 64 bit lanes
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+        __m128i lo = _mm_mullo_epi16(d, d);
+        __m128i hi = _mm_mulhi_epu16(d, d);
+        __m128i sq0 = _mm_unpacklo_epi16(lo, hi);
+        __m128i sq1 = _mm_unpackhi_epi16(lo, hi);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq0, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq0, zero));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq1, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq1, zero));
+    }
+    sum = hsum_epi64(acc);
+#endif
+    for (; i < n; i++)
+    {
+        int64_t d = (int64_t)a[i] - (int64_t)b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+uint64_t intersect_gather_u8(const uint8_t *values, const int32_t *index, int n, const uint8_t *b)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        uint8_t v = b[index[i]];
+        sum += values[i] < v ? values[i] : v;
+    }
+    return sum;
+}
+
+uint64_t intersect_gather_u16(const uint16_t *values, const int32_t *index, int n, const uint16_t *b)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        uint16_t v = b[index[i]];
+        sum += values[i] < v ? values[i] : v;
+    }
+    return sum;
+}
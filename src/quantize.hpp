@@ -0,0 +1,127 @@
+//**********************************************************************************************************************
+// FILE: quantize.hpp
+//
+// DESCRIPTION
+// Quantized storage of feature vectors as uint8 or uint16 codes and the integer kernels that
+// compare the codes directly. A code c stands for the value c * scale. Every row of a store
+// shares one scale, so the kernels can work on the codes and apply the scale once at the end.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "feature_matrix.hpp"
+
+enum fi_elem_type
+{
+  fi_f32, // float per feature
+  fi_u8,  // uint8 code per feature
+  fi_u16  // uint16 code per feature
+};
+
+/*
+  Bytes per feature of type
+ */
+size_t fi_elem_size(fi_elem_type type);
+
+/*
+  Row stride in elements for dim features of type, padded to FM_ALIGN bytes
+ */
+size_t fi_elem_stride(int dim, fi_elem_type type);
+
+/*
+  Largest code of type
+ */
+uint32_t fi_code_max(fi_elem_type type);
+
+/*
+  Converts dim float features to codes = round(fi / scale), clamped to the code range
+  @params codes room for dim codes of type
+ */
+void quantize_fi(const float *fi, int dim, fi_elem_type type, float scale, void *codes);
+
+/*
+  Converts dim codes back to floats = code * scale
+ */
+void dequantize_fi(const void *codes, int dim, fi_elem_type type, float scale, float *fi);
+
+/*
+  Row-major matrix of quantized feature vectors, a view of the payload of a mapped feature file
+ */
+struct quant_matrix
+{
+  const void *data;  // rows * stride codes, FM_ALIGN aligned
+  size_t rows;       // number of images
+  int dim;           // number of features per image
+  size_t stride;     // number of codes between the start of two rows
+  fi_elem_type type; // fi_u8 or fi_u16
+  float scale;       // value of one code
+};
+
+/*
+  Pointer to the codes of image i
+ */
+inline const void *qm_row(const quant_matrix &m, size_t i)
+{
+  return (const char *)m.data + i * m.stride * fi_elem_size(m.type);
+}
+
+/*
+  Rows of any elem type, a view of a feature_matrix or of a quant_matrix for the indexes
+  that work on both
+ */
+struct fi_rows
+{
+  const char *data;
+  size_t rows;
+  int dim;
+  size_t row_bytes;  // bytes between the start of two rows
+  fi_elem_type type;
+  float scale;       // value of one code, 1 for floats
+};
+
+fi_rows view_rows(const feature_matrix &m);
+fi_rows view_rows(const quant_matrix &m);
+
+/*
+  Pointer to the elements of image i
+ */
+inline const void *fr_row(const fi_rows &m, size_t i)
+{
+  return m.data + i * m.row_bytes;
+}
+
+/*
+  The values of image i as floats, in place for floats and dequantized into scratch otherwise
+  @params scratch room for dim floats
+ */
+inline const float *fr_values(const fi_rows &m, size_t i, float *scratch)
+{
+  if (m.type == fi_f32)
+  {
+    return (const float *)fr_row(m, i);
+  }
+  dequantize_fi(fr_row(m, i), m.dim, m.type, m.scale, scratch);
+  return scratch;
+}
+
+/*
+  Integer kernels over n codes, SSE2 with a scalar tail
+  intersect returns sum(min(a, b)), ssd returns sum((a - b)^2)
+ */
+uint64_t intersect_u8(const uint8_t *a, const uint8_t *b, int n);
+uint64_t intersect_u16(const uint16_t *a, const uint16_t *b, int n);
+uint64_t ssd_u8(const uint8_t *a, const uint8_t *b, int n);
+uint64_t ssd_u16(const uint16_t *a, const uint16_t *b, int n);
+
+/*
+  sum(min(values[i], b[index[i]])) over n entries, for a sparse a whose non-zero codes are values at index
+ */
+uint64_t intersect_gather_u8(const uint8_t *values, const int32_t *index, int n, const uint8_t *b);
+uint64_t intersect_gather_u16(const uint16_t *values, const int32_t *index, int n, const uint16_t *b);
+
+#endif
@@ -0,0 +1,33 @@
+//**********************************************************************************************************************
+// FILE: topk.cpp
+//
+// DESCRIPTION
+// Contains implementation for the bounded top-K selection
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include "topk.hpp"
+
+void create_topk(topk &t, size_t k)
+{
+    t.k = k;
+    t.heap.clear();
+    t.heap.reserve(k);
+}
+
+void topk_merge(topk &dst, const topk &src)
+{
+    for (size_t i = 0; i < src.heap.size(); i++)
+    {
+        topk_push(dst, src.heap[i].id, src.heap[i].error);
+    }
+}
+
+vector<fi_match> topk_sorted(const topk &t)
+{
+    vector<fi_match> sorted = t.heap;
+    sort_heap(sorted.begin(), sorted.end(), match_less);
+    return sorted;
+}
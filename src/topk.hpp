@@ -0,0 +1,95 @@
+//**********************************************************************************************************************
+// FILE: topk.hpp
+//
+// DESCRIPTION
+// Bounded top-K selection of the images with the minimum errors. The scan pushes every image
+// into a max-heap of at most K matches, so ranking costs O(N log K) and no error list of
+// size N is kept.
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <algorithm>
+using namespace std;
+
+/*
+  One ranked image
+ */
+struct fi_match
+{
+  uint32_t id; // image id, the row of the image in the feature file
+  float error; // distance to the target
+};
+
+/*
+  Smaller error ranks first, equal errors are ranked by id so the order never depends on
+  the order the images were scanned in
+ */
+inline bool match_less(const fi_match &a, const fi_match &b)
+{
+  return a.error < b.error || (a.error == b.error && a.id < b.id);
+}
+
+/*
+  The best k matches seen so far, heap.front() is the worst of them
+ */
+struct topk
+{
+  size_t k;
+  vector<fi_match> heap;
+};
+
+/*
+  Initialises an empty selector keeping the best k matches
+ */
+void create_topk(topk &t, size_t k);
+
+/*
+  Offers image id with error to the selector
+ */
+inline void topk_push(topk &t, uint32_t id, float error)
+{
+  fi_match m = {id, error};
+  if (t.heap.size() < t.k)
+  {
+    t.heap.push_back(m);
+    push_heap(t.heap.begin(), t.heap.end(), match_less);
+  }
+  else if (t.k > 0 && match_less(m, t.heap.front()))
+  {
+    pop_heap(t.heap.begin(), t.heap.end(), match_less);
+    t.heap.back() = m;
+    push_heap(t.heap.begin(), t.heap.end(), match_less);
+  }
+}
+
+/*
+  Error an image has to beat to get in, infinity until k matches are kept
+ */
+inline float topk_threshold(const topk &t)
+{
+  if (t.heap.size() < t.k || t.k == 0)
+  {
+    return numeric_limits<float>::infinity();
+  }
+  return t.heap.front().error;
+}
+
+/*
+  Offers every match kept by src to dst
+ */
+void topk_merge(topk &dst, const topk &src);
+
+/*
+  The kept matches, best first
+ */
+vector<fi_match> topk_sorted(const topk &t);
+
+#endif
@@ -0,0 +1,337 @@
+//**********************************************************************************************************************
+// FILE: vp_tree.cpp
+//
+// DESCRIPTION
+// Contains implementation for building and searching the vantage point tree
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include "vp_tree.hpp"
+#include "early_abandon.hpp"
+#include "parallel_scan.hpp"
+
+// splits ids[begin, end) and returns the node of the subtree
+static int build_node(vp_tree &tree, const fi_rows &m, uint32_t begin, uint32_t end, mt19937 &rng,
+                      vector<pair<float, uint32_t> > &scratch)
+{
+    int at = tree.nodes.size();
+    vp_node node = {begin, end, 0, -1, -1};
+    tree.nodes.push_back(node);
+    if (end - begin <= VP_LEAF)
+    {
+        return at;
+    }
+
+    // 1. a random vantage point first, the others by their distance to it
+    swap(tree.ids[begin], tree.ids[begin + rng() % (end - begin)]);
+    const void *vantage = fr_row(m, tree.ids[begin]);
+    scratch.clear();
+    for (uint32_t i = begin + 1; i < end; i++)
+    {
+        float d = compute_segment_distance(vantage, fr_row(m, tree.ids[i]), m.type, m.scale, tree.segments, tree.segment_count);
+        scratch.push_back(make_pair(sqrt(d), tree.ids[i]));
+    }
+    size_t half = scratch.size() / 2;
+    nth_element(scratch.begin(), scratch.begin() + half, scratch.end());
+    for (size_t i = 0; i < scratch.size(); i++)
+    {
+        tree.parent_dist[begin + 1 + i] = scratch[i].first;
+        tree.ids[begin + 1 + i] = scratch[i].second;
+    }
+
+    // 2. the nearer half inside, the rest outside
+    float radius = scratch[half].first;
+    uint32_t mid = begin + 1 + half;
+    int inside = build_node(tree, m, begin + 1, mid, rng, scratch);
+    int outside = build_node(tree, m, mid, end, rng, scratch);
+    tree.nodes[at].radius = radius;
+    tree.nodes[at].inside = inside;
+    tree.nodes[at].outside = outside;
+    return at;
+}
+
+// the segments of func, false unless every one of them is an SSD
+static bool ssd_segments(vp_tree &tree, feature_function func, int dim)
+{
+    tree.segment_count = get_feature_segments(func, dim, tree.segments);
+    for (int s = 0; s < tree.segment_count; s++)
+    {
+        if (tree.segments[s].metric != ssd_metric)
+        {
+            printf("VP tree only indexes SSD features\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static int build_tree(vp_tree &tree, const fi_rows &m, feature_function func)
+{
+    if (!ssd_segments(tree, func, m.dim))
+    {
+        return -1;
+    }
+    if (m.rows == 0 || m.rows > UINT32_MAX)
+    {
+        printf("Cannot build a VP tree of %lu images\n", m.rows);
+        return -1;
+    }
+    tree.dim = m.dim;
+    tree.count = m.rows;
+    tree.func = func;
+    memset(&tree.source, 0, sizeof(tree.source));
+    tree.nodes.clear();
+    tree.ids.resize(m.rows);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        tree.ids[i] = i;
+    }
+    tree.parent_dist.assign(m.rows, -1);
+    mt19937 rng(VP_SEED);
+    vector<pair<float, uint32_t> > scratch;
+    build_node(tree, m, 0, m.rows, rng, scratch);
+    printf("Built VP tree: %lu images, %lu nodes\n", m.rows, tree.nodes.size());
+    return 0;
+}
+
+int build_vp_tree(vp_tree &tree, const feature_matrix &fis, feature_function func)
+{
+    return build_tree(tree, view_rows(fis), func);
+}
+
+int build_vp_tree(vp_tree &tree, const quant_matrix &fis, feature_function func)
+{
+    return build_tree(tree, view_rows(fis), func);
+}
+
+// true if two distances that differ by gap rule out a match within tau, with room for the
+// rounding of distances of size scale
+static inline bool out_of_reach(float gap, float tau, float scale)
+{
+    return gap > tau + VP_SLACK * scale;
+}
+
+// the search of one target
+struct vp_search
+{
+    const vp_tree *tree;
+    const fi_rows *m;
+    const abandon_plan *plan;
+    const void *target;
+    topk top_n;
+    abandon_stats stats;
+    uint64_t nodes;
+};
+
+static void search_node(vp_search &s, int n, float parent_d)
+{
+    const vp_tree &tree = *s.tree;
+    const vp_node &node = tree.nodes[n];
+    s.nodes += 1;
+
+    // 1. a leaf scores the images the distance to the last vantage point does not rule out
+    if (node.inside < 0)
+    {
+        for (uint32_t j = node.begin; j < node.end; j++)
+        {
+            float tau = sqrt(topk_threshold(s.top_n));
+            if (parent_d >= 0 && out_of_reach(fabs(parent_d - tree.parent_dist[j]), tau, parent_d + tree.parent_dist[j]))
+            {
+                continue;
+            }
+            uint32_t id = tree.ids[j];
+            topk_push(s.top_n, id, compute_bounded_distance(*s.plan, s.target, fr_row(*s.m, id), topk_threshold(s.top_n), s.stats));
+        }
+        return;
+    }
+
+    // 2. the vantage point, then the side of the target first and the other if it can hold a match
+    uint32_t vantage = tree.ids[node.begin];
+    float error = compute_bounded_distance(*s.plan, s.target, fr_row(*s.m, vantage), numeric_limits<float>::infinity(), s.stats);
+    topk_push(s.top_n, vantage, error);
+    float d = sqrt(error);
+    if (d < node.radius)
+    {
+        search_node(s, node.inside, d);
+        if (!out_of_reach(node.radius - d, sqrt(topk_threshold(s.top_n)), node.radius + d))
+        {
+            search_node(s, node.outside, d);
+        }
+    }
+    else
+    {
+        search_node(s, node.outside, d);
+        if (!out_of_reach(d - node.radius, sqrt(topk_threshold(s.top_n)), node.radius + d))
+        {
+            search_node(s, node.inside, d);
+        }
+    }
+}
+
+static vector<vector<fi_match> > search_tree(const vp_tree &tree, const fi_rows &m, const vector<vector<float> > &fts, int k)
+{
+    vector<vector<fi_match> > result(fts.size());
+    if (m.dim != tree.dim || m.rows != tree.count)
+    {
+        printf("VP tree of %lu x %d does not match %lu x %d features\n", tree.count, tree.dim, m.rows, m.dim);
+        return result;
+    }
+
+    // one target per task, scored like the full scan so the errors are the same
+    vector<uint64_t> nodes(fts.size());
+    vector<uint64_t> scored(fts.size());
+    shared_thread_pool().run(fts.size(), [&](size_t q, int) {
+        vector<uint16_t> codes; // room for u8 or u16 codes
+        const void *target = fts[q].data();
+        if (m.type != fi_f32)
+        {
+            codes.resize(m.dim);
+            quantize_fi(fts[q].data(), m.dim, m.type, m.scale, codes.data());
+            target = codes.data();
+        }
+        abandon_plan plan;
+        create_abandon_plan(plan, target, m.type, m.scale, tree.segments, tree.segment_count);
+        vp_search s;
+        s.tree = &tree;
+        s.m = &m;
+        s.plan = &plan;
+        s.target = target;
+        create_topk(s.top_n, k);
+        clear_abandon_stats(s.stats);
+        s.nodes = 0;
+        search_node(s, 0, -1);
+        nodes[q] = s.nodes;
+        scored[q] = s.stats.rows;
+        result[q] = topk_sorted(s.top_n);
+    });
+
+    uint64_t total_nodes = 0;
+    uint64_t total_scored = 0;
+    for (size_t q = 0; q < fts.size(); q++)
+    {
+        total_nodes += nodes[q];
+        total_scored += scored[q];
+    }
+    printf("VP tree: visited %.1f of %lu nodes, scored %.1f of %lu images per target\n",
+           fts.empty() ? 0.0 : (double)total_nodes / fts.size(), tree.nodes.size(),
+           fts.empty() ? 0.0 : (double)total_scored / fts.size(), tree.count);
+    return result;
+}
+
+vector<vector<fi_match> > search_vp_tree(const vp_tree &tree, const feature_matrix &fis, const vector<vector<float> > &fts, int k)
+{
+    return search_tree(tree, view_rows(fis), fts, k);
+}
+
+vector<vector<fi_match> > search_vp_tree(const vp_tree &tree, const quant_matrix &fis, const vector<vector<float> > &fts, int k)
+{
+    return search_tree(tree, view_rows(fis), fts, k);
+}
+
+int save_vp_tree(const vp_tree &tree, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        printf("Unable to open VP tree file %s\n", filepath);
+        return -1;
+    }
+    vp_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, VP_MAGIC, 4);
+    h.version = VP_VERSION;
+    h.feature_type = tree.func;
+    h.dim = tree.dim;
+    h.count = tree.count;
+    h.node_count = tree.nodes.size();
+    h.source = tree.source;
+
+    bool err = fwrite(&h, sizeof(h), 1, fp) != 1;
+    err |= fwrite(tree.nodes.data(), sizeof(vp_node), tree.nodes.size(), fp) != tree.nodes.size();
+    err |= fwrite(tree.ids.data(), sizeof(uint32_t), tree.ids.size(), fp) != tree.ids.size();
+    err |= fwrite(tree.parent_dist.data(), sizeof(float), tree.parent_dist.size(), fp) != tree.parent_dist.size();
+    err |= fclose(fp) != 0;
+    if (err)
+    {
+        printf("Unable to write VP tree file %s\n", filepath);
+        return -1;
+    }
+    return 0;
+}
+
+int load_vp_tree(const char *filepath, vp_tree &tree)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        printf("Unable to open VP tree file %s\n", filepath);
+        return -1;
+    }
+
+    // 1. the header, the sizes are checked against the file before anything is allocated
+    vp_header h;
+    long file_size = 0;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, VP_MAGIC, 4) == 0 && h.version == VP_VERSION &&
+                 h.count > 0 && h.count <= UINT32_MAX && h.node_count > 0 &&
+                 fseek(fp, 0, SEEK_END) == 0 && (file_size = ftell(fp)) > 0 && fseek(fp, sizeof(h), SEEK_SET) == 0 &&
+                 h.count <= (uint64_t)file_size && h.node_count <= (uint64_t)file_size / sizeof(vp_node) &&
+                 sizeof(h) + h.node_count * sizeof(vp_node) + h.count * (sizeof(uint32_t) + sizeof(float)) == (uint64_t)file_size;
+    if (valid)
+    {
+        tree.dim = h.dim;
+        tree.count = h.count;
+        tree.func = (feature_function)h.feature_type;
+        tree.source = h.source;
+        tree.nodes.resize(h.node_count);
+        tree.ids.resize(h.count);
+        tree.parent_dist.resize(h.count);
+        valid = ssd_segments(tree, tree.func, tree.dim) &&
+                fread(tree.nodes.data(), sizeof(vp_node), tree.nodes.size(), fp) == tree.nodes.size() &&
+                fread(tree.ids.data(), sizeof(uint32_t), tree.ids.size(), fp) == tree.ids.size() &&
+                fread(tree.parent_dist.data(), sizeof(float), tree.parent_dist.size(), fp) == tree.parent_dist.size();
+    }
+    fclose(fp);
+
+    // 2. the root holds every image and every node is split like the build splits it, the
+    // vantage point then the nearer half inside, with the children after it, so the search only
+    // reads ids of the tree, cannot loop and goes no deeper than the build would
+    valid = valid && tree.nodes[0].begin == 0 && tree.nodes[0].end == h.count;
+    for (size_t n = 0; valid && n < tree.nodes.size(); n++)
+    {
+        const vp_node &node = tree.nodes[n];
+        valid = node.begin < node.end && node.end <= h.count && (node.inside < 0) == (node.end - node.begin <= VP_LEAF);
+        if (valid && node.inside >= 0)
+        {
+            uint32_t mid = node.begin + 1 + (node.end - node.begin - 1) / 2;
+            valid = (size_t)node.inside > n && (size_t)node.inside < tree.nodes.size() &&
+                    (size_t)node.outside > n && (size_t)node.outside < tree.nodes.size() &&
+                    tree.nodes[node.inside].begin == node.begin + 1 && tree.nodes[node.inside].end == mid &&
+                    tree.nodes[node.outside].begin == mid && tree.nodes[node.outside].end == node.end;
+        }
+    }
+
+    // 3. every image is in the tree once and its distance to the vantage point bounds the search
+    vector<bool> seen(valid ? h.count : 0, false);
+    for (size_t i = 0; valid && i < tree.ids.size(); i++)
+    {
+        float d = tree.parent_dist[i];
+        valid = tree.ids[i] < h.count && !seen[tree.ids[i]] && (d == -1 || (std::isfinite(d) && d >= 0));
+        if (valid)
+        {
+            seen[tree.ids[i]] = true;
+        }
+    }
+    if (!valid)
+    {
+        printf("%s is not a VP tree file of version %d\n", filepath, VP_VERSION);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+//**********************************************************************************************************************
+// FILE: vp_tree.hpp
+//
+// DESCRIPTION
+// Vantage point tree for exact nearest neighbours of the SSD features. The square root of the SSD
+// is a metric, so every node splits its images by their distance to one of them, the vantage
+// point, and a query skips a side once the triangle inequality shows nothing there can beat the
+// k-th best error. The leaves keep the distance of their images to the last vantage point, which
+// rules most of them out without reading their rows. Results are the same as the full scan.
+// The tree can be saved next to the feature file.
+//
+// File layout (native byte order):
+//   vp_header
+//   vp_node[node_count]                nodes[0] is the root
+//   uint32_t[count]                    ids
+//   float[count]                       parent_dist
+//
+// AUTHOR
+// Sherly Hartono
+//**********************************************************************************************************************
+#ifndef VP_TREE_H
+#define VP_TREE_H
+
+#include <vector>
+#include <cstdint>
+#include "compute.hpp"
+using namespace std;
+
+#define VP_LEAF 16     // images of a node that is not split further
+#define VP_SLACK 1e-4f // relative margin for float rounding, a side is skipped only if it is out by more
+#define VP_SEED 5489u  // seed of the vantage points, the same file always gives the same tree
+#define VP_MAGIC "FIVP"
+#define VP_VERSION 1
+
+struct vp_header
+{
+  char magic[4];         // VP_MAGIC
+  uint32_t version;      // VP_VERSION
+  uint32_t feature_type; // feature_function of the rows the tree splits
+  uint32_t dim;
+  uint64_t count;
+  uint64_t node_count;
+  fi_source source;
+};
+
+/*
+  A subtree, its images are ids[begin, end). The first of them is the vantage point of a split
+  node, the images nearer to it than radius are in the inside child and the others outside.
+ */
+struct vp_node
+{
+  uint32_t begin;
+  uint32_t end;
+  float radius;
+  int32_t inside;  // -1 for a leaf
+  int32_t outside;
+};
+
+struct vp_tree
+{
+  int dim;
+  size_t count; // images
+  feature_function func;
+  fi_segment segments[FI_MAX_SEGMENTS];
+  int segment_count;
+  fi_source source; // feature file of the rows, set by the caller before saving
+  vector<vp_node> nodes; // nodes[0] is the root
+  vector<uint32_t> ids;
+  vector<float> parent_dist; // distance of ids[i] to the vantage point of its last split, -1 for none
+};
+
+/*
+  Splits the rows of fis into a tree
+  @params func the function that created fis, every segment of it must be an SSD
+  The function returns 0 on success.
+ */
+int build_vp_tree(vp_tree &tree, const feature_matrix &fis, feature_function func);
+
+/*
+  Same on quantized rows, the distances are taken on the codes
+ */
+int build_vp_tree(vp_tree &tree, const quant_matrix &fis, feature_function func);
+
+/*
+  Exact top k of every target in fts, the targets are spread over the shared thread pool.
+  Prints how many nodes and images a target took.
+  @params fis the rows the tree was built on
+  The function returns the k matches with the minimum errors of every target, best first.
+ */
+vector<vector<fi_match> > search_vp_tree(const vp_tree &tree, const feature_matrix &fis, const vector<vector<float> > &fts, int k);
+
+/*
+  Same on quantized rows, the targets are quantized with the scale of fis
+ */
+vector<vector<fi_match> > search_vp_tree(const vp_tree &tree, const quant_matrix &fis, const vector<vector<float> > &fts, int k);
+
+/*
+  Writes the nodes, ids and parent distances to filepath
+  The function returns a non-zero value in case of an error.
+ */
+int save_vp_tree(const vp_tree &tree, const char *filepath);
+
+/*
+  Reads a tree written by save_vp_tree, every node is checked to split its images like the build
+  The function returns a non-zero value if the file is missing or not a tree of this version.
+ */
+int load_vp_tree(const char *filepath, vp_tree &tree);
+
+#endif